@@ -0,0 +1,303 @@
+--- Turbo.lua WebSocket load generator.
+-- Opens many WebSocketClient connections against a local server and drives
+-- an echo or broadcast pattern, then prints throughput, latency percentiles
+-- and memory per connection as JSON, for tracking regressions between
+-- versions.
+--
+-- Usage:
+--     luajit bench/websocket_bench.lua --connections=1000 --pattern=echo \
+--         --size=64 --duration=10
+--
+-- Options, all optional:
+--     --connections=N  Number of connections. Default is 100.
+--     --pattern=P      "echo": every connection sends a message and waits
+--                      for the echo before sending the next. "broadcast":
+--                      publishers send a message that the server broadcasts
+--                      to every connection, publishing the next when their
+--                      own copy arrives. Default is "echo".
+--     --size=N         Message size in bytes, at least 16. Default is 64.
+--     --pipeline=N     Messages in flight per echo connection. Default is 1.
+--     --publishers=N   Publishing connections with pattern=broadcast.
+--                      Default is 1.
+--     --binary         Send binary instead of text messages.
+--     --deflate        Negotiate permessage-deflate.
+--     --duration=S     Measured seconds. Default is 10.
+--     --warmup=S       Seconds to run before measuring. Default is 1.
+--     --port=N         Port of the local server. Default is 8765.
+--     --url=URL        Use a running server instead, with a /echo and a
+--                      /broadcast WebSocket route behaving like the ones
+--                      below. Memory per connection is then not measured.
+--     --out=FILE       Also write the result to FILE.
+--
+-- Copyright 2026 John Abrahamsen
+--
+-- Licensed under the Apache License, Version 2.0 (the "License");
+-- you may not use this file except in compliance with the License.
+-- You may obtain a copy of the License at
+--
+-- http://www.apache.org/licenses/LICENSE-2.0
+--
+-- Unless required by applicable law or agreed to in writing, software
+-- distributed under the License is distributed on an "AS IS" BASIS,
+-- WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+-- See the License for the specific language governing permissions and
+-- limitations under the License.
+
+_G.TURBO_SSL = true -- SSL must be enabled for WebSocket support!
+local turbo = require "turbo"
+local ffi = require "ffi"
+
+local opts = {
+    connections = 100,
+    pattern = "echo",
+    size = 64,
+    pipeline = 1,
+    publishers = 1,
+    duration = 10,
+    warmup = 1,
+    port = 8765
+}
+for _, a in ipairs(arg) do
+    local k, v = a:match("^%-%-([%w_]+)=(.*)$")
+    if not k then
+        k = a:match("^%-%-([%w_]+)$")
+        v = true
+    end
+    if not k or opts[k] == nil and not ({binary=1, deflate=1, url=1,
+                                          out=1})[k] then
+        io.stderr:write("Unknown option: " .. a .. "\n")
+        os.exit(1)
+    end
+    opts[k] = tonumber(v) or v
+end
+assert(opts.pattern == "echo" or opts.pattern == "broadcast",
+       "pattern must be echo or broadcast")
+assert(opts.size >= 16, "size must be at least 16")
+
+turbo.log.disable_all()
+
+local COMPRESSION = {threshold = 0}
+-- Connections opened at the same time, keeps within the listen backlog.
+local CONNECT_WINDOW = 64
+
+local _ts = ffi.new("struct timespec")
+local function now_us()
+    ffi.C.clock_gettime(1, _ts) -- CLOCK_MONOTONIC
+    return tonumber(_ts.tv_sec) * 1e6 + tonumber(_ts.tv_nsec) / 1e3
+end
+
+-- Resident set size of pid in bytes.
+local function rss(pid)
+    local f = io.open("/proc/" .. tostring(pid) .. "/statm")
+    if not f then
+        return nil
+    end
+    local pages = f:read("*l"):match("^%d+ (%d+)")
+    f:close()
+    return tonumber(pages) * 4096
+end
+
+local function run_server()
+    local handlers = {}
+    local EchoHandler = class("EchoHandler", turbo.websocket.WebSocketHandler)
+    -- on_message is not told the opcode, the forked server shares opts
+    -- with the clients instead.
+    function EchoHandler:on_message(msg)
+        self:write_message(msg, opts.binary)
+    end
+    local BroadcastHandler = class("BroadcastHandler",
+                                   turbo.websocket.WebSocketHandler)
+    function BroadcastHandler:open()
+        handlers[#handlers + 1] = self
+    end
+    function BroadcastHandler:on_message(msg)
+        turbo.websocket.broadcast(handlers, msg, opts.binary)
+    end
+    function BroadcastHandler:on_close()
+        for i = 1, #handlers do
+            if handlers[i] == self then
+                table.remove(handlers, i)
+                break
+            end
+        end
+    end
+    local route_opts = opts.deflate and {compression = COMPRESSION} or nil
+    turbo.web.Application({
+        {"^/echo$", EchoHandler, route_opts},
+        {"^/broadcast$", BroadcastHandler, route_opts}
+    }):listen(opts.port)
+    turbo.ioloop.instance():start()
+end
+
+local server_pid
+local base_url = opts.url
+if not base_url then
+    base_url = "ws://127.0.0.1:" .. tostring(opts.port)
+    server_pid = ffi.C.fork()
+    if server_pid == 0 then
+        run_server()
+        os.exit(0)
+    end
+end
+
+local io_loop = turbo.ioloop.instance()
+local padding = string.rep("x", opts.size - 16)
+local clients = {}
+local errors = 0
+local measuring = false
+local stopped = false
+local received = 0
+local latencies = {}
+
+local function message()
+    return string.format("%016.0f", now_us()) .. padding
+end
+
+local function on_message(self, msg)
+    if stopped then
+        return
+    end
+    if measuring then
+        received = received + 1
+        latencies[#latencies + 1] = now_us() - tonumber(msg:sub(1, 16))
+    end
+    if self.bench_sends then
+        self:write_message(message(), opts.binary)
+    end
+end
+
+local function percentile(sorted, p)
+    if #sorted == 0 then
+        return 0
+    end
+    return sorted[math.max(1, math.ceil(#sorted * p))]
+end
+
+local function finish(result)
+    local json = turbo.escape.json_encode(result)
+    print(json)
+    if opts.out then
+        local f = assert(io.open(opts.out, "w"))
+        f:write(json, "\n")
+        f:close()
+    end
+    if server_pid then
+        ffi.C.kill(server_pid, 15)
+        ffi.C.waitpid(server_pid, nil, 0)
+    end
+    io_loop:close()
+end
+
+local function sleep(ms)
+    coroutine.yield(turbo.async.task(function(cb, arg)
+        io_loop:add_timeout(turbo.util.gettimemonotonic() + ms, cb, arg)
+    end))
+end
+
+io_loop:add_callback(function()
+    if server_pid then
+        -- Give the server time to bind.
+        sleep(300)
+    end
+    local rss_idle = server_pid and rss(server_pid)
+    local client_rss_idle = rss(ffi.C.getpid())
+    local url = base_url .. "/" .. opts.pattern
+    local t_connect = now_us()
+    coroutine.yield(turbo.async.task(function(cb, arg)
+        local started, done = 0, 0
+        local open_next
+        local function settled()
+            done = done + 1
+            if done == opts.connections then
+                cb(arg)
+            else
+                open_next()
+            end
+        end
+        local kwargs = {
+            compression = opts.deflate and COMPRESSION or nil,
+            on_connect = function(self)
+                self.bench_open = true
+                clients[#clients + 1] = self
+                settled()
+            end,
+            on_message = on_message,
+            on_error = function(self)
+                errors = errors + 1
+                if not self.bench_open then
+                    settled()
+                end
+            end
+        }
+        -- The WebSocketClient constructor yields until connected.
+        local function connect()
+            turbo.websocket.WebSocketClient(url, kwargs)
+        end
+        open_next = function()
+            while started - done < CONNECT_WINDOW and
+                    started < opts.connections do
+                started = started + 1
+                io_loop:add_callback(connect)
+            end
+        end
+        open_next()
+    end))
+    local connect_s = (now_us() - t_connect) / 1e6
+    if #clients == 0 then
+        finish({error = "No connections could be opened.", options = opts})
+        return
+    end
+    -- Let the server settle before sampling its memory.
+    sleep(200)
+    local rss_connected = server_pid and rss(server_pid)
+    local client_rss_connected = rss(ffi.C.getpid())
+
+    local senders = opts.pattern == "echo" and #clients or
+        math.min(opts.publishers, #clients)
+    local per_sender = opts.pattern == "echo" and opts.pipeline or 1
+    for i = 1, senders do
+        local c = clients[i]
+        c.bench_sends = true
+        for _ = 1, per_sender do
+            c:write_message(message(), opts.binary)
+        end
+    end
+    sleep(opts.warmup * 1000)
+    measuring = true
+    local t_start = now_us()
+    sleep(opts.duration * 1000)
+    measuring = false
+    stopped = true
+    local elapsed = (now_us() - t_start) / 1e6
+
+    table.sort(latencies)
+    local sum = 0
+    for i = 1, #latencies do
+        sum = sum + latencies[i]
+    end
+    local function per_conn(after, before)
+        if after and before then
+            return math.floor((after - before) / #clients)
+        end
+    end
+    finish({
+        options = opts,
+        connections = #clients,
+        errors = errors,
+        connect_seconds = connect_s,
+        messages = received,
+        msgs_per_sec = received / elapsed,
+        latency_us = {
+            mean = #latencies > 0 and sum / #latencies or 0,
+            p50 = percentile(latencies, 0.5),
+            p99 = percentile(latencies, 0.99),
+            p999 = percentile(latencies, 0.999),
+            max = latencies[#latencies] or 0
+        },
+        server_rss_bytes = rss_connected,
+        server_rss_per_connection = per_conn(rss_connected, rss_idle),
+        client_rss_per_connection = per_conn(client_rss_connected,
+                                             client_rss_idle)
+    })
+end)
+io_loop:start()
@@ -36,6 +36,12 @@ SOFTWARE."			*/
 #include <openssl/ssl.h>
 #endif
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    defined(__SSE2__)
+#include <immintrin.h>
+#define TURBO_X86_SIMD 1
+#endif
+
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #define MAX(a,b) (((a)>(b))?(a):(b))
 
@@ -326,18 +332,438 @@ bool turbo_parser_check(struct turbo_parser_wrapper *s)
 }
 
 
-char* turbo_websocket_mask(const char* mask32, const char* in, size_t sz)
+#ifdef TURBO_X86_SIMD
+__attribute__((target("avx2")))
+static size_t websocket_mask_avx2(char *buf, uint32_t mask, size_t sz)
 {
     size_t i = 0;
+    __m256i m = _mm256_set1_epi32((int32_t)mask);
+
+    for (; i + 32 <= sz; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        _mm256_storeu_si256((__m256i *)(buf + i), _mm256_xor_si256(v, m));
+    }
+    return i;
+}
+
+static size_t websocket_mask_sse2(char *buf, uint32_t mask, size_t sz)
+{
+    size_t i = 0;
+    __m128i m = _mm_set1_epi32((int32_t)mask);
+
+    for (; i + 16 <= sz; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        _mm_storeu_si128((__m128i *)(buf + i), _mm_xor_si128(v, m));
+    }
+    return i;
+}
+#endif
+
+void turbo_websocket_mask_inplace(char *buf, const char *mask32, size_t sz)
+{
+    size_t i = 0;
+    uint32_t mask;
+    uint64_t mask64;
+
+    /* The mask is loaded in memory order, so XOR with words loaded the same
+     * way is correct on any endianness. Every block below is a multiple of 4
+     * bytes, so the mask stays aligned to the start of the buffer. */
+    memcpy(&mask, mask32, 4);
+#ifdef TURBO_X86_SIMD
+    static int have_avx2 = -1;
+    if (have_avx2 == -1) {
+        __builtin_cpu_init();
+        have_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    if (sz >= 32 && have_avx2)
+        i = websocket_mask_avx2(buf, mask, sz);
+    i += websocket_mask_sse2(buf + i, mask, sz - i);
+#endif
+    mask64 = ((uint64_t)mask << 32) | mask;
+    for (; i + 8 <= sz; i += 8) {
+        uint64_t v;
+        memcpy(&v, buf + i, 8);
+        v ^= mask64;
+        memcpy(buf + i, &v, 8);
+    }
+    for (; i < sz; i++)
+        buf[i] ^= mask32[i & 3];
+}
+
+char* turbo_websocket_mask(const char* mask32, const char* in, size_t sz)
+{
     char* buf = malloc(sz);
 
     if (!buf)
         return 0;
-    for (i = 0; i < sz; i++) {
-        buf[i] = in[i] ^ mask32[i % 4];
-    }
+    memcpy(buf, in, sz);
+    turbo_websocket_mask_inplace(buf, mask32, sz);
     return buf;
- }
+}
+
+int32_t turbo_websocket_parse_frames(
+        char *buf,
+        size_t sz,
+        struct turbo_ws_frame *frames,
+        int32_t max_frames,
+        size_t *consumed,
+        uint64_t *need)
+{
+    size_t pos = 0;
+    int32_t n = 0;
+
+    *need = 0;
+    while (n < max_frames) {
+        const unsigned char *p = (const unsigned char *)buf + pos;
+        size_t avail = sz - pos;
+        size_t hdr = 2;
+        uint64_t len;
+        int masked;
+        int i;
+
+        if (avail < 2) {
+            *need = pos + 2;
+            break;
+        }
+        len = p[1] & 0x7f;
+        masked = (p[1] & 0x80) != 0;
+        if (len == 126)
+            hdr += 2;
+        else if (len == 127)
+            hdr += 8;
+        if (masked)
+            hdr += 4;
+        if (avail < hdr) {
+            *need = pos + hdr;
+            break;
+        }
+        if (len == 126) {
+            len = ((uint64_t)p[2] << 8) | p[3];
+        } else if (len == 127) {
+            len = 0;
+            for (i = 0; i < 8; i++)
+                len = (len << 8) | p[2 + i];
+            /* Most significant bit must be 0 (RFC 6455 5.2). */
+            if (len >> 63)
+                return -1;
+        }
+        if (avail - hdr < len) {
+            *need = pos + hdr + len;
+            break;
+        }
+        frames[n].flags = p[0];
+        frames[n].masked = masked;
+        frames[n].offset = pos + hdr;
+        frames[n].len = len;
+        if (masked)
+            turbo_websocket_mask_inplace(
+                buf + pos + hdr, (const char *)p + hdr - 4, len);
+        pos += hdr + len;
+        n++;
+    }
+    *consumed = pos;
+    return n;
+}
+
+/* Length of the UTF-8 sequence at p (RFC 3629, Unicode Table 3-7), 0 if it is
+ * invalid, or -1 if the n available bytes are a valid start of a sequence. */
+static int utf8_sequence(const unsigned char *p, size_t n)
+{
+    unsigned char c = p[0];
+    unsigned char lo = 0x80, hi = 0xbf;
+    int need;
+    int i;
+
+    if (c < 0x80)
+        return 1;
+    if (c < 0xc2)
+        return 0;
+    if (c < 0xe0) {
+        need = 2;
+    } else if (c < 0xf0) {
+        need = 3;
+        if (c == 0xe0)
+            lo = 0xa0;      /* Overlong. */
+        else if (c == 0xed)
+            hi = 0x9f;      /* Surrogates. */
+    } else if (c < 0xf5) {
+        need = 4;
+        if (c == 0xf0)
+            lo = 0x90;      /* Overlong. */
+        else if (c == 0xf4)
+            hi = 0x8f;      /* Above U+10FFFF. */
+    } else {
+        return 0;
+    }
+    if (n < 2)
+        return -1;
+    if (p[1] < lo || p[1] > hi)
+        return 0;
+    for (i = 2; i < need; i++) {
+        if ((size_t)i >= n)
+            return -1;
+        if ((p[i] & 0xc0) != 0x80)
+            return 0;
+    }
+    return need;
+}
+
+static int utf8_valid_scalar(const unsigned char *buf, size_t sz)
+{
+    size_t i = 0;
+
+    while (i < sz) {
+        int len;
+        uint64_t v;
+
+        if (i + 8 <= sz) {
+            memcpy(&v, buf + i, 8);
+            if ((v & 0x8080808080808080ULL) == 0) {
+                i += 8;
+                continue;
+            }
+        }
+        len = utf8_sequence(buf + i, sz - i);
+        if (len <= 0)
+            return 0;
+        i += len;
+    }
+    return 1;
+}
+
+#ifdef TURBO_X86_SIMD
+/* Vectorized validation, the lookup algorithm of Keiser and Lemire,
+ * "Validating UTF-8 In Less Than One Instruction Per Byte" (2021). Each byte
+ * is classified by the high nibble of the previous byte, its low nibble and
+ * the high nibble of the byte itself; a error is any bit set in all three. */
+#define U8_TOO_SHORT    (1 << 0)
+#define U8_TOO_LONG     (1 << 1)
+#define U8_OVERLONG_3   (1 << 2)
+#define U8_TOO_LARGE    (1 << 3)
+#define U8_SURROGATE    (1 << 4)
+#define U8_OVERLONG_2   (1 << 5)
+#define U8_TOO_LARGE_1000 (1 << 6)
+#define U8_OVERLONG_4   (1 << 6)
+#define U8_TWO_CONTS    (1 << 7)
+#define U8_CARRY        (U8_TOO_SHORT | U8_TOO_LONG | U8_TWO_CONTS)
+
+#define U8_BYTE_1_HIGH \
+    U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, \
+    U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, \
+    U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS, \
+    U8_TOO_SHORT | U8_OVERLONG_2, \
+    U8_TOO_SHORT, \
+    U8_TOO_SHORT | U8_OVERLONG_3 | U8_SURROGATE, \
+    U8_TOO_SHORT | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_OVERLONG_4
+
+#define U8_BYTE_1_LOW \
+    U8_CARRY | U8_OVERLONG_3 | U8_OVERLONG_2 | U8_OVERLONG_4, \
+    U8_CARRY | U8_OVERLONG_2, \
+    U8_CARRY, \
+    U8_CARRY, \
+    U8_CARRY | U8_TOO_LARGE, \
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, \
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, \
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, \
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, \
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, \
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, \
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, \
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, \
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_SURROGATE, \
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, \
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000
+
+#define U8_BYTE_2_HIGH \
+    U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, \
+    U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, \
+    U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | \
+        U8_TOO_LARGE_1000 | U8_OVERLONG_4, \
+    U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | \
+        U8_TOO_LARGE, \
+    U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | \
+        U8_TOO_LARGE, \
+    U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | \
+        U8_TOO_LARGE, \
+    U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT
+
+__attribute__((target("avx2")))
+static int utf8_valid_avx2(const unsigned char *buf, size_t sz)
+{
+    const __m256i t1 = _mm256_setr_epi8(U8_BYTE_1_HIGH, U8_BYTE_1_HIGH);
+    const __m256i t2 = _mm256_setr_epi8(U8_BYTE_1_LOW, U8_BYTE_1_LOW);
+    const __m256i t3 = _mm256_setr_epi8(U8_BYTE_2_HIGH, U8_BYTE_2_HIGH);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    /* Last bytes that may start a sequence not ending in the block. */
+    const __m256i max = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        (char)0xef, (char)0xdf, (char)0xbf);
+    __m256i prev = _mm256_setzero_si256();
+    __m256i incomplete = _mm256_setzero_si256();
+    __m256i error = _mm256_setzero_si256();
+    unsigned char pad[32];
+    size_t i;
+
+    for (i = 0; i < sz; i += 32) {
+        __m256i in, prev1, prev2, prev3, shifted, sc, must23;
+
+        if (sz - i >= 32) {
+            in = _mm256_loadu_si256((const __m256i *)(buf + i));
+        } else {
+            /* Zeros are ASCII, so padding never adds a error. */
+            memset(pad, 0, sizeof(pad));
+            memcpy(pad, buf + i, sz - i);
+            in = _mm256_loadu_si256((const __m256i *)pad);
+        }
+        if (_mm256_movemask_epi8(in) == 0) {
+            error = _mm256_or_si256(error, incomplete);
+            incomplete = _mm256_setzero_si256();
+            prev = in;
+            continue;
+        }
+        shifted = _mm256_permute2x128_si256(prev, in, 0x21);
+        prev1 = _mm256_alignr_epi8(in, shifted, 15);
+        prev2 = _mm256_alignr_epi8(in, shifted, 14);
+        prev3 = _mm256_alignr_epi8(in, shifted, 13);
+        sc = _mm256_and_si256(
+            _mm256_and_si256(
+                _mm256_shuffle_epi8(t1, _mm256_and_si256(
+                    _mm256_srli_epi16(prev1, 4), nibble)),
+                _mm256_shuffle_epi8(t2, _mm256_and_si256(prev1, nibble))),
+            _mm256_shuffle_epi8(t3, _mm256_and_si256(
+                _mm256_srli_epi16(in, 4), nibble)));
+        /* Third and fourth bytes of a sequence must be continuations. */
+        must23 = _mm256_and_si256(
+            _mm256_or_si256(
+                _mm256_subs_epu8(prev2, _mm256_set1_epi8(0xe0 - 0x80)),
+                _mm256_subs_epu8(prev3, _mm256_set1_epi8(0xf0 - 0x80))),
+            _mm256_set1_epi8((char)0x80));
+        error = _mm256_or_si256(error, _mm256_xor_si256(must23, sc));
+        incomplete = _mm256_subs_epu8(in, max);
+        prev = in;
+    }
+    error = _mm256_or_si256(error, incomplete);
+    return _mm256_testz_si256(error, error);
+}
+
+__attribute__((target("sse4.1")))
+static int utf8_valid_sse4(const unsigned char *buf, size_t sz)
+{
+    const __m128i t1 = _mm_setr_epi8(U8_BYTE_1_HIGH);
+    const __m128i t2 = _mm_setr_epi8(U8_BYTE_1_LOW);
+    const __m128i t3 = _mm_setr_epi8(U8_BYTE_2_HIGH);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    const __m128i max = _mm_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        (char)0xef, (char)0xdf, (char)0xbf);
+    __m128i prev = _mm_setzero_si128();
+    __m128i incomplete = _mm_setzero_si128();
+    __m128i error = _mm_setzero_si128();
+    unsigned char pad[16];
+    size_t i;
+
+    for (i = 0; i < sz; i += 16) {
+        __m128i in, prev1, prev2, prev3, sc, must23;
+
+        if (sz - i >= 16) {
+            in = _mm_loadu_si128((const __m128i *)(buf + i));
+        } else {
+            memset(pad, 0, sizeof(pad));
+            memcpy(pad, buf + i, sz - i);
+            in = _mm_loadu_si128((const __m128i *)pad);
+        }
+        if (_mm_movemask_epi8(in) == 0) {
+            error = _mm_or_si128(error, incomplete);
+            incomplete = _mm_setzero_si128();
+            prev = in;
+            continue;
+        }
+        prev1 = _mm_alignr_epi8(in, prev, 15);
+        prev2 = _mm_alignr_epi8(in, prev, 14);
+        prev3 = _mm_alignr_epi8(in, prev, 13);
+        sc = _mm_and_si128(
+            _mm_and_si128(
+                _mm_shuffle_epi8(t1, _mm_and_si128(
+                    _mm_srli_epi16(prev1, 4), nibble)),
+                _mm_shuffle_epi8(t2, _mm_and_si128(prev1, nibble))),
+            _mm_shuffle_epi8(t3, _mm_and_si128(
+                _mm_srli_epi16(in, 4), nibble)));
+        must23 = _mm_and_si128(
+            _mm_or_si128(
+                _mm_subs_epu8(prev2, _mm_set1_epi8(0xe0 - 0x80)),
+                _mm_subs_epu8(prev3, _mm_set1_epi8(0xf0 - 0x80))),
+            _mm_set1_epi8((char)0x80));
+        error = _mm_or_si128(error, _mm_xor_si128(must23, sc));
+        incomplete = _mm_subs_epu8(in, max);
+        prev = in;
+    }
+    error = _mm_or_si128(error, incomplete);
+    return _mm_testz_si128(error, error);
+}
+#endif
+
+/* Validate a buffer that starts and should end on a character boundary. */
+static int utf8_valid(const unsigned char *buf, size_t sz)
+{
+#ifdef TURBO_X86_SIMD
+    static int level = -1;
+    if (level == -1) {
+        __builtin_cpu_init();
+        level = __builtin_cpu_supports("avx2") ? 2 :
+            __builtin_cpu_supports("sse4.1") ? 1 : 0;
+    }
+    if (sz >= 32 && level == 2)
+        return utf8_valid_avx2(buf, sz);
+    if (sz >= 16 && level >= 1)
+        return utf8_valid_sse4(buf, sz);
+#endif
+    return utf8_valid_scalar(buf, sz);
+}
+
+int32_t turbo_utf8_validate(
+        const char *buf,
+        size_t sz,
+        struct turbo_utf8_state *state)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    size_t tail = 0;
+    size_t i;
+    int len;
+
+    /* Complete a character split by the previous call. */
+    if (state->len) {
+        while (sz && state->len < 4) {
+            state->bytes[state->len++] = *p++;
+            sz--;
+            len = utf8_sequence(state->bytes, state->len);
+            if (len == 0)
+                return 0;
+            if (len > 0) {
+                if ((size_t)len != state->len)
+                    return 0;
+                state->len = 0;
+                break;
+            }
+        }
+        if (state->len)
+            return 1;
+    }
+    /* Keep a character split at the end for the next call. */
+    for (i = 1; i <= 3 && i <= sz; i++) {
+        unsigned char c = p[sz - i];
+        if ((c & 0xc0) != 0x80) {
+            if (c >= 0xc0 && utf8_sequence(p + sz - i, i) == -1)
+                tail = i;
+            break;
+        }
+    }
+    if (!utf8_valid(p, sz - tail))
+        return 0;
+    memcpy(state->bytes, p + sz - tail, tail);
+    state->len = (uint8_t)tail;
+    return 1;
+}
 
 uint64_t turbo_bswap_u64(uint64_t swap)
 {
@@ -346,3 +772,907 @@ uint64_t turbo_bswap_u64(uint64_t swap)
     swapped = ENDIAN_SWAP_U64(swap);
     return swapped;
 }
+
+/* Buffer slab. Blocks of 1KB to 64KB in power of two size classes are cut
+ * from 1MB chunks and kept on a free list per class when freed, so memory is
+ * reused without going through malloc. Chunks are never given back. Larger
+ * blocks use malloc directly. Not thread safe, every process has its own. */
+#define SLAB_MIN_SHIFT 10
+#define SLAB_CLASSES 7
+#define SLAB_MAX (1U << (SLAB_MIN_SHIFT + SLAB_CLASSES - 1))
+#define SLAB_CHUNK (1024 * 1024)
+
+struct slab_block {
+    struct slab_block *next;
+};
+
+static struct slab_block *slab_free_list[SLAB_CLASSES];
+static char *slab_bump;
+static size_t slab_bump_left;
+static struct turbo_slab_stats slab_stats;
+
+static int32_t slab_class(size_t sz)
+{
+    int32_t c = 0;
+
+    while ((size_t)1 << (SLAB_MIN_SHIFT + c) < sz)
+        c++;
+    return c;
+}
+
+static void slab_push(int32_t c, void *p)
+{
+    struct slab_block *b = p;
+
+    b->next = slab_free_list[c];
+    slab_free_list[c] = b;
+}
+
+static void *slab_class_alloc(int32_t c)
+{
+    size_t sz = (size_t)1 << (SLAB_MIN_SHIFT + c);
+    struct slab_block *b = slab_free_list[c];
+    char *p;
+    int32_t i;
+
+    if (b) {
+        slab_free_list[c] = b->next;
+        return b;
+    }
+    if (slab_bump_left < sz) {
+        /* Hand the rest of the chunk to the smaller classes. Chunk and
+         * blocks are multiples of SLAB_MIN, so nothing is lost. */
+        for (i = SLAB_CLASSES - 1; i >= 0; i--) {
+            size_t bsz = (size_t)1 << (SLAB_MIN_SHIFT + i);
+            while (slab_bump_left >= bsz) {
+                slab_push(i, slab_bump);
+                slab_bump += bsz;
+                slab_bump_left -= bsz;
+            }
+        }
+        slab_bump = malloc(SLAB_CHUNK);
+        if (!slab_bump)
+            return NULL;
+        slab_bump_left = SLAB_CHUNK;
+        slab_stats.slab_bytes += SLAB_CHUNK;
+    }
+    p = slab_bump;
+    slab_bump += sz;
+    slab_bump_left -= sz;
+    return p;
+}
+
+void *turbo_slab_alloc(size_t sz, size_t *got)
+{
+    void *p;
+    int32_t c;
+
+    if (sz > SLAB_MAX) {
+        p = malloc(sz);
+        if (p) {
+            *got = sz;
+            slab_stats.large_bytes += sz;
+        }
+        return p;
+    }
+    c = slab_class(sz);
+    p = slab_class_alloc(c);
+    if (p) {
+        *got = (size_t)1 << (SLAB_MIN_SHIFT + c);
+        slab_stats.used_bytes += *got;
+    }
+    return p;
+}
+
+void turbo_slab_free(void *p, size_t sz)
+{
+    if (!p)
+        return;
+    if (sz > SLAB_MAX) {
+        free(p);
+        slab_stats.large_bytes -= sz;
+        return;
+    }
+    slab_push(slab_class(sz), p);
+    slab_stats.used_bytes -= sz;
+}
+
+void *turbo_slab_realloc(void *p, size_t old_sz, size_t sz, size_t *got)
+{
+    void *n;
+
+    if (old_sz > SLAB_MAX && sz > SLAB_MAX) {
+        n = realloc(p, sz);
+        if (n) {
+            *got = sz;
+            slab_stats.large_bytes += sz;
+            slab_stats.large_bytes -= old_sz;
+        }
+        return n;
+    }
+    if (old_sz <= SLAB_MAX && sz <= SLAB_MAX &&
+            slab_class(old_sz) == slab_class(sz)) {
+        *got = old_sz;
+        return p;
+    }
+    n = turbo_slab_alloc(sz, got);
+    if (!n)
+        return NULL;
+    memcpy(n, p, old_sz < *got ? old_sz : *got);
+    turbo_slab_free(p, old_sz);
+    return n;
+}
+
+void turbo_slab_get_stats(struct turbo_slab_stats *stats)
+{
+    *stats = slab_stats;
+}
+
+/* Lua pattern matching over raw memory, for IOStream:read_until_pattern.
+ * Adapted from lstrlib.c of Lua 5.1, Copyright (C) 1994-2012 Lua.org,
+ * PUC-Rio, under the MIT license. Besides working on a buffer that is not
+ * a Lua string, it records whether a failed match ran into the end of the
+ * data, so a later search can resume where more data could still make a
+ * difference. The pattern must be NUL terminated, as Lua strings are. */
+#include <ctype.h>
+
+#define PAT_ESC '%'
+#define PAT_SPECIALS "^$*+?.([%-"
+#define PAT_MAXCAPTURES 32
+#define PAT_MAXCCALLS 200
+#define PAT_CAP_UNFINISHED (-1)
+#define PAT_CAP_POSITION (-2)
+
+struct pat_state {
+    const char *src_init;
+    const char *src_end;
+    const char *p_end;
+    int32_t level;
+    int32_t depth;
+    int32_t hit_end;
+    int32_t error;
+    struct {
+        const char *init;
+        ptrdiff_t len;
+    } capture[PAT_MAXCAPTURES];
+};
+
+static const char *pat_match(struct pat_state *ms, const char *s,
+                             const char *p);
+
+static const char *pat_error(struct pat_state *ms)
+{
+    ms->error = 1;
+    return NULL;
+}
+
+static const char *pat_class_end(struct pat_state *ms, const char *p)
+{
+    switch (*p++) {
+    case PAT_ESC:
+        if (p == ms->p_end)
+            return pat_error(ms);
+        return p + 1;
+    case '[':
+        if (*p == '^')
+            p++;
+        do {
+            if (p == ms->p_end)
+                return pat_error(ms);
+            if (*(p++) == PAT_ESC && p < ms->p_end)
+                p++;
+        } while (*p != ']');
+        return p + 1;
+    default:
+        return p;
+    }
+}
+
+static int32_t pat_match_class(int32_t c, int32_t cl)
+{
+    int32_t res;
+
+    switch (tolower(cl)) {
+    case 'a': res = isalpha(c); break;
+    case 'c': res = iscntrl(c); break;
+    case 'd': res = isdigit(c); break;
+    case 'l': res = islower(c); break;
+    case 'p': res = ispunct(c); break;
+    case 's': res = isspace(c); break;
+    case 'u': res = isupper(c); break;
+    case 'w': res = isalnum(c); break;
+    case 'x': res = isxdigit(c); break;
+    case 'z': res = (c == 0); break;
+    default: return cl == c;
+    }
+    if (isupper(cl))
+        res = !res;
+    return res;
+}
+
+static int32_t pat_match_bracket(int32_t c, const char *p, const char *ec)
+{
+    int32_t sig = 1;
+
+    if (*(p + 1) == '^') {
+        sig = 0;
+        p++;
+    }
+    while (++p < ec) {
+        if (*p == PAT_ESC) {
+            p++;
+            if (pat_match_class(c, (unsigned char)*p))
+                return sig;
+        } else if (*(p + 1) == '-' && p + 2 < ec) {
+            p += 2;
+            if ((unsigned char)*(p - 2) <= c && c <= (unsigned char)*p)
+                return sig;
+        } else if ((unsigned char)*p == c) {
+            return sig;
+        }
+    }
+    return !sig;
+}
+
+static int32_t pat_single(struct pat_state *ms, const char *s, const char *p,
+                          const char *ep)
+{
+    int32_t c;
+
+    if (s >= ms->src_end) {
+        ms->hit_end = 1;
+        return 0;
+    }
+    c = (unsigned char)*s;
+    switch (*p) {
+    case '.': return 1;
+    case PAT_ESC: return pat_match_class(c, (unsigned char)*(p + 1));
+    case '[': return pat_match_bracket(c, p, ep - 1);
+    default: return (unsigned char)*p == c;
+    }
+}
+
+static const char *pat_balance(struct pat_state *ms, const char *s,
+                               const char *p)
+{
+    int32_t b, e, cont = 1;
+
+    if (p >= ms->p_end - 1)
+        return pat_error(ms);
+    if (s >= ms->src_end) {
+        ms->hit_end = 1;
+        return NULL;
+    }
+    if (*s != *p)
+        return NULL;
+    b = *p;
+    e = *(p + 1);
+    while (++s < ms->src_end) {
+        if (*s == e) {
+            if (--cont == 0)
+                return s + 1;
+        } else if (*s == b) {
+            cont++;
+        }
+    }
+    ms->hit_end = 1;
+    return NULL;
+}
+
+static const char *pat_max_expand(struct pat_state *ms, const char *s,
+                                  const char *p, const char *ep)
+{
+    ptrdiff_t i = 0;
+    const char *res;
+
+    while (pat_single(ms, s + i, p, ep))
+        i++;
+    while (i >= 0) {
+        res = pat_match(ms, s + i, ep + 1);
+        if (res)
+            return res;
+        i--;
+    }
+    return NULL;
+}
+
+static const char *pat_min_expand(struct pat_state *ms, const char *s,
+                                  const char *p, const char *ep)
+{
+    const char *res;
+
+    for (;;) {
+        res = pat_match(ms, s, ep + 1);
+        if (res)
+            return res;
+        if (!pat_single(ms, s, p, ep))
+            return NULL;
+        s++;
+    }
+}
+
+static const char *pat_start_capture(struct pat_state *ms, const char *s,
+                                     const char *p, int32_t what)
+{
+    const char *res;
+    int32_t level = ms->level;
+
+    if (level >= PAT_MAXCAPTURES)
+        return pat_error(ms);
+    ms->capture[level].init = s;
+    ms->capture[level].len = what;
+    ms->level = level + 1;
+    res = pat_match(ms, s, p);
+    if (!res)
+        ms->level--;
+    return res;
+}
+
+static const char *pat_end_capture(struct pat_state *ms, const char *s,
+                                   const char *p)
+{
+    const char *res;
+    int32_t l;
+
+    for (l = ms->level - 1; l >= 0; l--) {
+        if (ms->capture[l].len == PAT_CAP_UNFINISHED)
+            break;
+    }
+    if (l < 0)
+        return pat_error(ms);
+    ms->capture[l].len = s - ms->capture[l].init;
+    res = pat_match(ms, s, p);
+    if (!res)
+        ms->capture[l].len = PAT_CAP_UNFINISHED;
+    return res;
+}
+
+static const char *pat_match_capture(struct pat_state *ms, const char *s,
+                                     int32_t l)
+{
+    size_t len, avail;
+
+    l -= '1';
+    if (l < 0 || l >= ms->level || ms->capture[l].len == PAT_CAP_UNFINISHED)
+        return pat_error(ms);
+    len = (size_t)ms->capture[l].len;
+    avail = (size_t)(ms->src_end - s);
+    if (avail >= len) {
+        if (memcmp(ms->capture[l].init, s, len) == 0)
+            return s + len;
+    } else if (memcmp(ms->capture[l].init, s, avail) == 0) {
+        ms->hit_end = 1;
+    }
+    return NULL;
+}
+
+static const char *pat_match(struct pat_state *ms, const char *s,
+                             const char *p)
+{
+    const char *ep, *res;
+    int32_t prev, cur;
+
+    if (ms->error)
+        return NULL;
+    if (ms->depth-- == 0)
+        return pat_error(ms);
+init:
+    if (p == ms->p_end)
+        goto done;
+    switch (*p) {
+    case '(':
+        if (*(p + 1) == ')')
+            s = pat_start_capture(ms, s, p + 2, PAT_CAP_POSITION);
+        else
+            s = pat_start_capture(ms, s, p + 1, PAT_CAP_UNFINISHED);
+        goto done;
+    case ')':
+        s = pat_end_capture(ms, s, p + 1);
+        goto done;
+    case '$':
+        if (p + 1 != ms->p_end)
+            goto dflt;
+        s = (s == ms->src_end) ? s : NULL;
+        goto done;
+    case PAT_ESC:
+        switch (*(p + 1)) {
+        case 'b':
+            s = pat_balance(ms, s, p + 2);
+            if (s) {
+                p += 4;
+                goto init;
+            }
+            goto done;
+        case 'f':
+            p += 2;
+            if (*p != '[') {
+                s = pat_error(ms);
+                goto done;
+            }
+            ep = pat_class_end(ms, p);
+            if (!ep) {
+                s = NULL;
+                goto done;
+            }
+            prev = (s == ms->src_init) ? 0 : (unsigned char)*(s - 1);
+            if (s < ms->src_end) {
+                cur = (unsigned char)*s;
+            } else {
+                cur = 0;
+                ms->hit_end = 1;
+            }
+            if (!pat_match_bracket(prev, p, ep - 1) &&
+                    pat_match_bracket(cur, p, ep - 1)) {
+                p = ep;
+                goto init;
+            }
+            s = NULL;
+            goto done;
+        case '0': case '1': case '2': case '3': case '4':
+        case '5': case '6': case '7': case '8': case '9':
+            s = pat_match_capture(ms, s, (unsigned char)*(p + 1));
+            if (s) {
+                p += 2;
+                goto init;
+            }
+            goto done;
+        default:
+            goto dflt;
+        }
+    default:
+    dflt:
+        ep = pat_class_end(ms, p);
+        if (!ep) {
+            s = NULL;
+            goto done;
+        }
+        if (!pat_single(ms, s, p, ep)) {
+            if (*ep == '*' || *ep == '?' || *ep == '-') {
+                p = ep + 1;
+                goto init;
+            }
+            s = NULL;
+            goto done;
+        }
+        switch (*ep) {
+        case '?':
+            res = pat_match(ms, s + 1, ep + 1);
+            if (res) {
+                s = res;
+                goto done;
+            }
+            p = ep + 1;
+            goto init;
+        case '+':
+            s = pat_max_expand(ms, s + 1, p, ep);
+            goto done;
+        case '*':
+            s = pat_max_expand(ms, s, p, ep);
+            goto done;
+        case '-':
+            s = pat_min_expand(ms, s, p, ep);
+            goto done;
+        default:
+            s++;
+            p = ep;
+            goto init;
+        }
+    }
+done:
+    ms->depth++;
+    return s;
+}
+
+int32_t turbo_pattern_find(
+        const char *pat,
+        size_t pat_len,
+        const char *buf,
+        size_t sz,
+        size_t init,
+        struct turbo_pattern_match *m)
+{
+    struct pat_state ms;
+    const char *s = buf + (init < sz ? init : sz);
+    const char *p = pat;
+    const char *res;
+    int32_t anchor = 0, first = -1, i;
+
+    if (pat_len != 0 && *p == '^') {
+        anchor = 1;
+        p++;
+        s = buf;
+    } else if (pat_len != 0 && !strchr(PAT_SPECIALS, *p) &&
+            (pat_len == 1 || !strchr("*?-", p[1]))) {
+        /* Matches can only start at this byte. */
+        first = (unsigned char)*p;
+    }
+    ms.src_init = buf;
+    ms.src_end = buf + sz;
+    ms.p_end = pat + pat_len;
+    ms.error = 0;
+    m->resume = sz;
+    for (;;) {
+        if (first != -1 && s < ms.src_end) {
+            s = memchr(s, first, ms.src_end - s);
+            if (!s)
+                s = ms.src_end;
+        }
+        ms.level = 0;
+        ms.depth = PAT_MAXCCALLS;
+        ms.hit_end = 0;
+        res = pat_match(&ms, s, p);
+        if (ms.error)
+            return -1;
+        if (res) {
+            for (i = 0; i < ms.level; i++) {
+                if (ms.capture[i].len == PAT_CAP_UNFINISHED)
+                    return -1;
+            }
+            m->start = s - buf;
+            m->end = res - buf;
+            return 1;
+        }
+        if (ms.hit_end && (size_t)(s - buf) < m->resume)
+            m->resume = s - buf;
+        if (anchor || s >= ms.src_end)
+            break;
+        s++;
+    }
+    if (anchor)
+        m->resume = 0;
+    return 0;
+}
+
+/* Plain delimiter search. Candidates are filtered on the first and the last
+ * byte of the needle at once, 16 or 32 start positions at a time, as in
+ * Wojciech Mula's "SIMD-friendly algorithms for substring searching". Only
+ * positions where both match are compared in full, which rules out most of
+ * the false candidates a memchr on the first byte alone stops at, like every
+ * "\r\n" in a header block searched for "\r\n\r\n". */
+#ifdef TURBO_X86_SIMD
+__attribute__((target("avx2")))
+static const char *searcher_scan_avx2(
+        const char *needle,
+        size_t n,
+        const char *h,
+        size_t starts,
+        size_t *next)
+{
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[n - 1]);
+    size_t i = *next;
+
+    for (; i + 32 <= starts; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(h + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(h + i + n - 1));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(
+            _mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        while (mask) {
+            size_t pos = i + __builtin_ctz(mask);
+            if (memcmp(h + pos + 1, needle + 1, n - 2) == 0)
+                return h + pos;
+            mask &= mask - 1;
+        }
+    }
+    *next = i;
+    return NULL;
+}
+
+static const char *searcher_scan_sse2(
+        const char *needle,
+        size_t n,
+        const char *h,
+        size_t starts,
+        size_t *next)
+{
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[n - 1]);
+    size_t i = *next;
+
+    for (; i + 16 <= starts; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(h + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(h + i + n - 1));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask) {
+            size_t pos = i + __builtin_ctz(mask);
+            if (memcmp(h + pos + 1, needle + 1, n - 2) == 0)
+                return h + pos;
+            mask &= mask - 1;
+        }
+    }
+    *next = i;
+    return NULL;
+}
+#endif
+
+/* Find needle of n >= 2 bytes in h of sz >= n bytes. */
+static const char *searcher_scan(
+        const char *needle,
+        size_t n,
+        const char *h,
+        size_t sz)
+{
+    /* Number of positions where a match can start. */
+    size_t starts = sz - n + 1;
+    size_t i = 0;
+    const char *p;
+
+#ifdef TURBO_X86_SIMD
+    static int have_avx2 = -1;
+    if (have_avx2 == -1) {
+        __builtin_cpu_init();
+        have_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    if (starts >= 32 && have_avx2) {
+        p = searcher_scan_avx2(needle, n, h, starts, &i);
+        if (p)
+            return p;
+    }
+    p = searcher_scan_sse2(needle, n, h, starts, &i);
+    if (p)
+        return p;
+#endif
+    while (i < starts) {
+        p = memchr(h + i, needle[0], starts - i);
+        if (!p)
+            return NULL;
+        if (p[n - 1] == needle[n - 1] &&
+                memcmp(p + 1, needle + 1, n - 2) == 0)
+            return p;
+        i = p - h + 1;
+    }
+    return NULL;
+}
+
+int32_t turbo_searcher_find(
+        struct turbo_searcher *s,
+        const char *buf,
+        size_t sz,
+        size_t *pos)
+{
+    size_t n = s->len;
+    size_t off = s->offset;
+    const char *p;
+
+    if (n > sz || off > sz - n)
+        return 0;
+    if (n == 0)
+        p = buf + off;
+    else if (n == 1)
+        p = memchr(buf + off, s->needle[0], sz - off);
+    else
+        p = searcher_scan(s->needle, n, buf + off, sz - off);
+    if (!p) {
+        /* A match can only start in the last n - 1 bytes or later. */
+        s->offset = sz - n + 1;
+        return 0;
+    }
+    *pos = p - buf;
+    s->offset = 0;
+    return 1;
+}
+
+#ifdef __linux__
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#define BUS_RING_HDR 192
+#define BUS_WRAP 0xffffffffU
+
+struct turbo_bus_ring {
+    /* Written by publishers. Robust, so a worker killed while holding it
+     * does not block the others for good. */
+    pthread_mutex_t lock;
+    uint64_t head;
+    uint64_t dropped;
+    int32_t waiting;
+    /* Written by the owner. */
+    uint64_t tail __attribute__((aligned(64)));
+    int32_t owner;
+    int32_t efd;
+};
+
+typedef char bus_ring_fits[
+    sizeof(struct turbo_bus_ring) <= BUS_RING_HDR ? 1 : -1];
+
+struct turbo_bus {
+    int32_t rings;
+    uint64_t ring_size;
+    uint64_t map_size;
+};
+
+struct turbo_bus_rec {
+    uint32_t topic_len;
+    uint32_t data_len;
+};
+
+static inline struct turbo_bus_ring *bus_ring(struct turbo_bus *bus, int32_t i)
+{
+    return (struct turbo_bus_ring *)((char *)bus + BUS_RING_HDR +
+        (size_t)i * (BUS_RING_HDR + bus->ring_size));
+}
+
+static inline char *bus_data(struct turbo_bus *bus, int32_t i)
+{
+    return (char *)bus_ring(bus, i) + BUS_RING_HDR;
+}
+
+struct turbo_bus *turbo_bus_create(int32_t rings, uint64_t ring_size)
+{
+    struct turbo_bus *bus;
+    pthread_mutexattr_t attr;
+    size_t map_size;
+    int32_t i;
+
+    if (rings < 1 || ring_size < 64 || (ring_size & (ring_size - 1)))
+        return NULL;
+    map_size = BUS_RING_HDR + (size_t)rings * (BUS_RING_HDR + ring_size);
+    bus = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (bus == MAP_FAILED)
+        return NULL;
+    bus->rings = rings;
+    bus->ring_size = ring_size;
+    bus->map_size = map_size;
+    if (pthread_mutexattr_init(&attr) != 0) {
+        munmap(bus, map_size);
+        return NULL;
+    }
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    for (i = 0; i < rings; i++) {
+        struct turbo_bus_ring *r = bus_ring(bus, i);
+        r->efd = eventfd(0, EFD_NONBLOCK);
+        if (r->efd == -1 || pthread_mutex_init(&r->lock, &attr) != 0) {
+            if (r->efd != -1)
+                close(r->efd);
+            while (i--) {
+                pthread_mutex_destroy(&bus_ring(bus, i)->lock);
+                close(bus_ring(bus, i)->efd);
+            }
+            pthread_mutexattr_destroy(&attr);
+            munmap(bus, map_size);
+            return NULL;
+        }
+        r->waiting = 1;
+    }
+    pthread_mutexattr_destroy(&attr);
+    return bus;
+}
+
+int32_t turbo_bus_claim(struct turbo_bus *bus, int32_t ring, int32_t pid)
+{
+    int32_t i;
+
+    for (i = ring == -1 ? 0 : ring; i < bus->rings; i++) {
+        if (__sync_bool_compare_and_swap(&bus_ring(bus, i)->owner, 0, pid))
+            return i;
+        if (ring != -1)
+            break;
+    }
+    return -1;
+}
+
+int32_t turbo_bus_eventfd(struct turbo_bus *bus, int32_t ring)
+{
+    return bus_ring(bus, ring)->efd;
+}
+
+int32_t turbo_bus_publish(
+        struct turbo_bus *bus,
+        int32_t ring,
+        const char *topic,
+        size_t topic_len,
+        const char *data,
+        size_t data_len)
+{
+    struct turbo_bus_ring *r = bus_ring(bus, ring);
+    char *base = bus_data(bus, ring);
+    uint64_t size = bus->ring_size;
+    uint64_t rec = (sizeof(struct turbo_bus_rec) + topic_len + data_len + 7) &
+        ~(uint64_t)7;
+    uint64_t head, pos, contig, need;
+    struct turbo_bus_rec *hdr;
+    static const uint64_t one = 1;
+    int rc;
+
+    if (rec > size / 2) {
+        __atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    rc = pthread_mutex_lock(&r->lock);
+    if (rc == EOWNERDEAD) {
+        /* The holder died. head only moves once a record is complete, so a
+         * half written one is not seen and is overwritten by this one. */
+        pthread_mutex_consistent(&r->lock);
+    } else if (rc != 0) {
+        __atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    head = r->head;
+    pos = head & (size - 1);
+    contig = size - pos;
+    need = rec > contig ? contig + rec : rec;
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) + need > size) {
+        __atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&r->lock);
+        return 0;
+    }
+    /* Records are never split, skip the end of the ring instead. */
+    if (rec > contig) {
+        ((struct turbo_bus_rec *)(base + pos))->topic_len = BUS_WRAP;
+        head += contig;
+        pos = 0;
+    }
+    hdr = (struct turbo_bus_rec *)(base + pos);
+    hdr->topic_len = (uint32_t)topic_len;
+    hdr->data_len = (uint32_t)data_len;
+    memcpy(hdr + 1, topic, topic_len);
+    memcpy((char *)(hdr + 1) + topic_len, data, data_len);
+    __atomic_store_n(&r->head, head + rec, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&r->lock);
+    /* Only pay for the wakeup when the owner went back to its poll. */
+    if (__atomic_exchange_n(&r->waiting, 0, __ATOMIC_SEQ_CST)) {
+        if (write(r->efd, &one, sizeof(one)) == -1) {
+            /* Counter overflow, the owner is signaled already. */
+        }
+    }
+    return 1;
+}
+
+uint64_t turbo_bus_next(
+        struct turbo_bus *bus,
+        int32_t ring,
+        const char **topic,
+        size_t *topic_len,
+        const char **data,
+        size_t *data_len)
+{
+    struct turbo_bus_ring *r = bus_ring(bus, ring);
+    uint64_t size = bus->ring_size;
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = r->tail;
+    struct turbo_bus_rec *hdr;
+
+    if (tail == head)
+        return 0;
+    hdr = (struct turbo_bus_rec *)(bus_data(bus, ring) + (tail & (size - 1)));
+    if (hdr->topic_len == BUS_WRAP) {
+        tail += size - (tail & (size - 1));
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+        if (tail == head)
+            return 0;
+        hdr = (struct turbo_bus_rec *)bus_data(bus, ring);
+    }
+    *topic = (const char *)(hdr + 1);
+    *topic_len = hdr->topic_len;
+    *data = *topic + hdr->topic_len;
+    *data_len = hdr->data_len;
+    return (sizeof(struct turbo_bus_rec) + hdr->topic_len + hdr->data_len +
+        7) & ~(uint64_t)7;
+}
+
+void turbo_bus_consume(struct turbo_bus *bus, int32_t ring, uint64_t rec)
+{
+    struct turbo_bus_ring *r = bus_ring(bus, ring);
+
+    __atomic_store_n(&r->tail, r->tail + rec, __ATOMIC_RELEASE);
+}
+
+int32_t turbo_bus_wait(struct turbo_bus *bus, int32_t ring)
+{
+    struct turbo_bus_ring *r = bus_ring(bus, ring);
+
+    __atomic_store_n(&r->waiting, 1, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&r->head, __ATOMIC_SEQ_CST) != r->tail;
+}
+
+uint64_t turbo_bus_dropped(struct turbo_bus *bus, int32_t ring)
+{
+    return __atomic_load_n(&bus_ring(bus, ring)->dropped, __ATOMIC_RELAXED);
+}
+#endif
@@ -81,8 +81,135 @@ char *url_field(
 bool turbo_parser_check(struct turbo_parser_wrapper *s);
 
 char* turbo_websocket_mask(const char *mask32, const char* in, size_t sz);
+/** XOR sz bytes of buf in place with the 4 byte WebSocket mask. */
+void turbo_websocket_mask_inplace(char *buf, const char *mask32, size_t sz);
+/** A WebSocket frame found by turbo_websocket_parse_frames. */
+struct turbo_ws_frame {
+    uint8_t flags;      /* FIN, RSV1-3 and opcode, first header byte. */
+    uint8_t masked;
+    uint64_t offset;    /* Payload offset from start of buffer. */
+    uint64_t len;       /* Payload length. */
+};
+
+/** Parse every complete WebSocket frame in buf, up to max_frames, and unmask
+ * their payloads in place. *consumed is set to the bytes used by the returned
+ * frames. If the next frame is incomplete *need is set to the number of bytes
+ * buf must hold to complete it. Returns number of frames, or -1 on a invalid
+ * frame length. */
+int32_t turbo_websocket_parse_frames(
+        char *buf,
+        size_t sz,
+        struct turbo_ws_frame *frames,
+        int32_t max_frames,
+        size_t *consumed,
+        uint64_t *need);
+/** Characters split between calls to turbo_utf8_validate. */
+struct turbo_utf8_state {
+    uint8_t len;
+    uint8_t bytes[4];
+};
+/** Validate the next piece of a UTF-8 text. A character may be split between
+ * pieces, state must be zeroed before the first. Returns 1 if the text is
+ * valid so far, else 0. The text is complete and valid if the last call
+ * returns 1 and leaves state->len at 0. */
+int32_t turbo_utf8_validate(
+        const char *buf,
+        size_t sz,
+        struct turbo_utf8_state *state);
 uint64_t turbo_bswap_u64(uint64_t swap);
 
+/** Size classed allocator for turbo.structs.bufferpool. Sizes up to 64KB
+ * are rounded up to a power of two and served from slabs, larger ones by
+ * malloc. The rounded size is stored in got and must be passed back when
+ * the block is freed or reallocated. */
+struct turbo_slab_stats {
+    /* Bytes in slab chunks, never given back. */
+    uint64_t slab_bytes;
+    /* Bytes of slab blocks in use. */
+    uint64_t used_bytes;
+    /* Bytes in use above the largest size class. */
+    uint64_t large_bytes;
+};
+void *turbo_slab_alloc(size_t sz, size_t *got);
+void turbo_slab_free(void *p, size_t sz);
+void *turbo_slab_realloc(void *p, size_t old_sz, size_t sz, size_t *got);
+void turbo_slab_get_stats(struct turbo_slab_stats *stats);
+
+/** Position of a match found by turbo_pattern_find. */
+struct turbo_pattern_match {
+    size_t start;
+    size_t end;
+    /* Where the next search should begin after more data is appended. */
+    size_t resume;
+};
+/** Find the first match of a Lua pattern in buf, searching from offset init,
+ * like string.find. Unlike string.find, a pattern anchored with '^' ignores
+ * init and only matches at the start of buf. pat must be NUL terminated.
+ * Returns 1 and sets m->start and m->end (exclusive) on a match, 0 if there
+ * is none yet, or -1 if the pattern is malformed or too complex. */
+int32_t turbo_pattern_find(
+        const char *pat,
+        size_t pat_len,
+        const char *buf,
+        size_t sz,
+        size_t init,
+        struct turbo_pattern_match *m);
+
+/** Prepared plain text delimiter, see util.searcher. */
+struct turbo_searcher {
+    /* Where the next scan starts. Kept after a failed scan so that only
+     * data appended since is scanned again, reset to 0 by a match. */
+    size_t offset;
+    size_t len;
+    char needle[];
+};
+/** Find the delimiter in buf, starting at s->offset. Returns 1 and sets pos
+ * to the offset of the match, or 0 if there is none yet. */
+int32_t turbo_searcher_find(
+        struct turbo_searcher *s,
+        const char *buf,
+        size_t sz,
+        size_t *pos);
+
+/** Message rings in shared memory, one per worker process. Created before
+ * fork so every worker maps the same rings and inherits their eventfd's.
+ * Any worker may publish to a ring, only its owner consumes from it. */
+struct turbo_bus;
+/** Map rings with ring_size bytes each, ring_size must be a power of two.
+ * Returns NULL on failure. */
+struct turbo_bus *turbo_bus_create(int32_t rings, uint64_t ring_size);
+/** Claim ring for the process pid, or the first free ring if ring is -1.
+ * Returns the claimed ring or -1. */
+int32_t turbo_bus_claim(struct turbo_bus *bus, int32_t ring, int32_t pid);
+/** eventfd signaled when a message is published to a waiting ring. */
+int32_t turbo_bus_eventfd(struct turbo_bus *bus, int32_t ring);
+/** Copy a message into ring. Returns 1 on success or 0 if the ring is
+ * full. */
+int32_t turbo_bus_publish(
+        struct turbo_bus *bus,
+        int32_t ring,
+        const char *topic,
+        size_t topic_len,
+        const char *data,
+        size_t data_len);
+/** Get the oldest message in ring. The pointers are valid until
+ * turbo_bus_consume is called with the returned record size. Returns 0 if
+ * the ring is empty. */
+uint64_t turbo_bus_next(
+        struct turbo_bus *bus,
+        int32_t ring,
+        const char **topic,
+        size_t *topic_len,
+        const char **data,
+        size_t *data_len);
+void turbo_bus_consume(struct turbo_bus *bus, int32_t ring, uint64_t rec);
+/** Ask publishers to signal the eventfd of ring on the next message.
+ * Returns 1 if messages arrived in the meantime and the ring should be
+ * drained again. */
+int32_t turbo_bus_wait(struct turbo_bus *bus, int32_t ring);
+/** Number of messages dropped because ring was full. */
+uint64_t turbo_bus_dropped(struct turbo_bus *bus, int32_t ring);
+
 // OpenSSL wrapper functions.
 #ifndef TURBO_NO_SSL
 #define MatchFound 0
@@ -25,14 +25,15 @@ function ChatRoom:initialize()
 end
 
 function ChatRoom:broadcast(package)
-    local time = turbo.util.gettimeofday()
+    local sockets = {}
     for i = 1, #self.subscribers do
-        local sub = self.subscribers[i]
-        sub.socket:write_message(turbo.escape.json_encode {
-            package = package,
-            time = time
-        })
+        sockets[i] = self.subscribers[i].socket
     end
+    -- Encoded and framed once for all subscribers.
+    turbo.websocket.broadcast(sockets, {
+        package = package,
+        time = turbo.util.gettimeofday()
+    })
 end
 
 function ChatRoom:add(nick)
@@ -19,6 +19,12 @@ _G.__TURBO_USE_LUASOCKET__ = os.getenv("TURBO_USE_LUASOCKET") and true or false
 local turbo = require "turbo"
 
 describe("turbo.async Namespace", function()
+    -- For turbo.async.task, resumes after ms msec.
+    local function sleep(ms, cb, arg)
+        turbo.ioloop.instance():add_timeout(
+            turbo.util.gettimemonotonic() + ms, cb, arg)
+    end
+
     it("async.task", function()
         local io = turbo.ioloop.instance()
 
@@ -67,6 +73,551 @@ describe("turbo.async Namespace", function()
         io:wait(5)
     end)
 
+    it("gzip response decoding", function()
+        local port = math.random(10000,40000)
+        local io = turbo.ioloop.instance()
+        local body = string.rep("Hello compressed World! ", 1000)
+        local accept_encoding
+        local GzipHandler = class("GzipHandler", turbo.web.RequestHandler)
+        function GzipHandler:get()
+            accept_encoding = self.request.headers:get("Accept-Encoding")
+            self:add_header("Content-Encoding", "gzip")
+            self:write(turbo.zlib.compress(body, turbo.zlib.GZIP))
+        end
+        local DeflateHandler = class("DeflateHandler", turbo.web.RequestHandler)
+        function DeflateHandler:get()
+            self:set_chunked_write()
+            self:add_header("Content-Encoding", "deflate")
+            local compressed = turbo.zlib.compress(body,
+                self:get_argument("raw", "") ~= "" and turbo.zlib.RAW or
+                    turbo.zlib.ZLIB)
+            -- Split the stream over several chunks, the first may be a
+            -- single byte.
+            local third = self:get_argument("first", "") ~= "" and 1 or
+                math.floor(compressed:len() / 3)
+            self:write(compressed:sub(1, third))
+            self:flush()
+            self:write(compressed:sub(third + 1))
+            self:flush()
+        end
+        local BombHandler = class("BombHandler", turbo.web.RequestHandler)
+        function BombHandler:get()
+            self:set_chunked_write()
+            self:add_header("Content-Encoding", "gzip")
+            local compressed = turbo.zlib.compress(
+                string.rep("a", 1024*1024), turbo.zlib.GZIP)
+            -- Each chunk decodes to much less than the limit.
+            for i = 1, compressed:len(), 8 do
+                self:write(compressed:sub(i, i + 7))
+                self:flush()
+            end
+        end
+        turbo.web.Application({
+            {"^/gzip$", GzipHandler},
+            {"^/deflate$", DeflateHandler},
+            {"^/bomb$", BombHandler}}):listen(port)
+
+        io:add_callback(function()
+            local url = "http://127.0.0.1:"..tostring(port)
+            local res = coroutine.yield(
+                turbo.async.HTTPClient():fetch(url.."/gzip"))
+            assert.falsy(res.error)
+            assert.equal(res.body, body)
+            assert.truthy(accept_encoding:find("gzip"))
+
+            local chunks = {}
+            res = coroutine.yield(
+                turbo.async.HTTPClient():fetch(url.."/deflate", {
+                    streaming_callback = function(chunk)
+                        chunks[#chunks+1] = chunk
+                    end}))
+            assert.falsy(res.error)
+            assert.equal(table.concat(chunks), body)
+
+            -- A single byte is not enough to tell zlib from raw deflate.
+            for _, query in ipairs({"?first=1", "?first=1&raw=1"}) do
+                res = coroutine.yield(
+                    turbo.async.HTTPClient():fetch(url.."/deflate"..query))
+                assert.falsy(res.error)
+                assert.equal(res.body, body)
+            end
+
+            -- Opting out leaves the body untouched.
+            res = coroutine.yield(
+                turbo.async.HTTPClient():fetch(url.."/gzip", {
+                    use_gzip = false}))
+            assert.falsy(res.error)
+            assert.falsy(accept_encoding)
+            assert.equal(turbo.zlib.decompress(res.body), body)
+
+            -- The decoded body counts against max_buffer_size as a whole.
+            res = coroutine.yield(
+                turbo.async.HTTPClient(nil, nil, 1024*100):fetch(
+                    url.."/bomb"))
+            assert.truthy(res.error)
+            assert.equal(res.error.code, turbo.async.errors.DECOMPRESS_ERROR)
+            io:close()
+        end)
+        io:wait(5)
+    end)
+
+    it("gather and fetch_many", function()
+        local port = math.random(10000,40000)
+        local io = turbo.ioloop.instance()
+        local active = 0
+        local max_active = 0
+        local SlowHandler = class("SlowHandler", turbo.web.RequestHandler)
+        function SlowHandler:get(n)
+            active = active + 1
+            max_active = math.max(max_active, active)
+            local ms = tonumber(self:get_argument("ms", "50"))
+            coroutine.yield(turbo.async.task(sleep, ms))
+            active = active - 1
+            self:write("n" .. n)
+        end
+        turbo.web.Application({{"^/(%d+)$", SlowHandler}}):listen(port)
+        local base = "http://127.0.0.1:" .. tostring(port) .. "/"
+
+        io:add_callback(function()
+            -- Plain functions, results in order and errors by position.
+            local results, errs = coroutine.yield(turbo.async.gather({
+                function()
+                    coroutine.yield(turbo.async.task(sleep, 30))
+                    return "a"
+                end,
+                function() return "b" end,
+                function() error("fail") end
+            }))
+            assert.equal("a", results[1])
+            assert.equal("b", results[2])
+            assert.falsy(results[3])
+            assert.truthy(errs[3]:find("fail"))
+
+            -- A timed out function holds its slot until it returns.
+            local running, max_running = 0, 0
+            local function tracked(ms, value)
+                return function()
+                    running = running + 1
+                    max_running = math.max(max_running, running)
+                    coroutine.yield(turbo.async.task(sleep, ms))
+                    running = running - 1
+                    return value
+                end
+            end
+            local expired = {}
+            results, errs = coroutine.yield(turbo.async.gather({
+                tracked(300, "late"), tracked(10, "b")
+            }, {
+                concurrency = 1,
+                task_timeout = 0.1,
+                on_task_timeout = function(i)
+                    expired[#expired + 1] = i
+                end
+            }))
+            assert.equal(1, max_running)
+            assert.falsy(results[1])
+            assert.equal("timeout", errs[1])
+            assert.equal("b", results[2])
+            assert.same({1}, expired)
+
+            -- Concurrency cap.
+            local reqs = {}
+            for i = 1, 6 do
+                reqs[i] = base .. tostring(i)
+            end
+            local responses = coroutine.yield(
+                turbo.async.fetch_many(reqs, {concurrency = 2}))
+            assert.equal(6, #responses)
+            for i = 1, 6 do
+                assert.falsy(responses[i].error)
+                assert.equal("n" .. i, responses[i].body)
+            end
+            assert.equal(2, max_active)
+
+            -- Per request and overall deadlines.
+            responses = coroutine.yield(turbo.async.fetch_many({
+                base .. "1",
+                {url = base .. "2?ms=3000", request_timeout = 1},
+                base .. "3?ms=3000",
+                base .. "4"
+            }, {concurrency = 3, timeout = 1.5}))
+            assert.falsy(responses[1].error)
+            assert.equal("n1", responses[1].body)
+            assert.equal(turbo.async.errors.REQUEST_TIMEOUT,
+                         responses[2].error.code)
+            assert.equal(turbo.async.errors.REQUEST_TIMEOUT,
+                         responses[3].error.code)
+            assert.falsy(responses[4].error)
+            assert.equal("n4", responses[4].body)
+
+            -- The deadline also cancels hedged requests.
+            local hedge_client
+            local fetch = turbo.async.HTTPClient.fetch
+            turbo.async.HTTPClient.fetch = function(client, ...)
+                hedge_client = hedge_client or client
+                return fetch(client, ...)
+            end
+            responses = coroutine.yield(turbo.async.fetch_many({
+                {url = base .. "5?ms=500", hedge_delay = 0.05}
+            }, {timeout = 0.2}))
+            turbo.async.HTTPClient.fetch = fetch
+            assert.equal(turbo.async.errors.REQUEST_TIMEOUT,
+                         responses[1].error.code)
+            assert.truthy(hedge_client._hedge.done)
+            for _, attempt in pairs(hedge_client._hedge.attempts) do
+                -- Aborted, the result is delivered later.
+                assert.truthy(attempt.s_error)
+                assert.falsy(attempt.iostream)
+            end
+            io:close()
+        end)
+        io:wait(10)
+    end)
+
+    it("HTTPCache", function()
+        local port = math.random(10000,40000)
+        local io = turbo.ioloop.instance()
+        local requests = {}
+        local not_modified = 0
+        local CacheHandler = class("CacheHandler", turbo.web.RequestHandler)
+        function CacheHandler:get(kind)
+            requests[kind] = (requests[kind] or 0) + 1
+            if kind == "fresh" then
+                self:set_header("Cache-Control", "max-age=60")
+            elseif kind == "etag" then
+                self:set_header("Cache-Control", "no-cache")
+                self:set_header("ETag", '"v1"')
+                if self.request.headers:get("If-None-Match") == '"v1"' then
+                    not_modified = not_modified + 1
+                    self:set_status(304)
+                    return
+                end
+            elseif kind == "slow" then
+                coroutine.yield(turbo.async.task(sleep, 100))
+                self:set_header("Expires",
+                    turbo.util.time_format_http_header(
+                        turbo.util.gettimeofday() + 60000))
+            elseif kind == "update" then
+                self:set_header("ETag", '"v1"')
+                if self.request.headers:get("If-None-Match") == '"v1"' then
+                    self:set_header("Cache-Control", "max-age=60")
+                    self:set_header("X-Version", "2")
+                    self:set_status(304)
+                    return
+                end
+                self:set_header("Cache-Control", "no-cache")
+                self:set_header("X-Version", "1")
+            elseif kind == "nostore" then
+                self:set_header("Cache-Control", "no-store")
+            elseif kind == "private" then
+                coroutine.yield(turbo.async.task(sleep, 50))
+                self:set_header("Cache-Control", "max-age=60")
+                self:write(self.request.headers:get("Authorization"))
+                return
+            end
+            self:write(kind .. " body")
+        end
+        function CacheHandler:head(kind) end
+        function CacheHandler:post(kind)
+            self:write("posted")
+        end
+        turbo.web.Application({{"^/(%a+)$", CacheHandler}}):listen(port)
+        local base = "http://127.0.0.1:" .. tostring(port) .. "/"
+
+        io:add_callback(function()
+            local cache = turbo.async.HTTPCache()
+            local function fetch(kind)
+                return coroutine.yield(turbo.async.HTTPClient():fetch(
+                    base .. kind, {cache = cache}))
+            end
+            -- Fresh responses are served from cache.
+            for _ = 1, 3 do
+                local res = fetch("fresh")
+                assert.falsy(res.error)
+                assert.equal(200, res.code)
+                assert.equal("fresh body", res.body)
+            end
+            assert.equal(1, requests.fresh)
+            assert.equal(2, cache.hits)
+
+            -- HEAD leaves the stored response alone, POST invalidates it.
+            coroutine.yield(turbo.async.HTTPClient():fetch(base .. "fresh",
+                {cache = cache, method = "HEAD"}))
+            fetch("fresh")
+            assert.equal(1, requests.fresh)
+            coroutine.yield(turbo.async.HTTPClient():fetch(base .. "fresh",
+                {cache = cache, method = "POST", body = "x"}))
+            fetch("fresh")
+            assert.equal(2, requests.fresh)
+
+            -- Revalidation with ETag.
+            for i = 1, 3 do
+                local res = fetch("etag")
+                assert.falsy(res.error)
+                assert.equal(200, res.code)
+                assert.equal("etag body", res.body)
+                assert.equal(i > 1, res.cached == true)
+            end
+            assert.equal(3, requests.etag)
+            assert.equal(2, not_modified)
+            assert.equal(2, cache.revalidations)
+
+            -- A 304 replaces the stored header fields it carries.
+            fetch("update")
+            local res = fetch("update")
+            assert.equal("update body", res.body)
+            assert.equal("max-age=60", res.headers:get("Cache-Control"))
+            assert.equal("2", res.headers:get("X-Version"))
+            assert.equal('"v1"', res.headers:get("ETag"))
+            res = fetch("update")
+            assert.equal("2", res.headers:get("X-Version"))
+            assert.equal(2, requests.update)
+
+            -- Not stored.
+            fetch("nostore")
+            fetch("nostore")
+            assert.equal(2, requests.nostore)
+
+            -- Requests with credentials do not use the cache, not even
+            -- when they are concurrent.
+            local function private(user)
+                return function()
+                    return turbo.async.HTTPClient():fetch(base .. "private", {
+                        cache = cache,
+                        on_headers = function(h)
+                            h:add("Authorization", user)
+                        end
+                    })
+                end
+            end
+            local results = coroutine.yield(turbo.async.gather({
+                private("Basic a"), private("Basic b")
+            }))
+            assert.equal("Basic a", results[1].body)
+            assert.equal("Basic b", results[2].body)
+            res = coroutine.yield(private("Basic c")())
+            assert.equal("Basic c", res.body)
+            assert.equal(3, requests.private)
+            assert.falsy(cache:get("http://127.0.0.1:" .. tostring(port) ..
+                "/private"))
+            coroutine.yield(turbo.async.HTTPClient():fetch(base .. "fresh", {
+                cache = cache,
+                cookie = {session = "a"}
+            }))
+            coroutine.yield(turbo.async.HTTPClient():fetch(base .. "fresh", {
+                cache = cache,
+                on_headers = function(h)
+                    h:add("Cache-Control", "no-cache")
+                end
+            }))
+            assert.equal(4, requests.fresh)
+
+            -- Concurrent misses are coalesced.
+            local funcs = {}
+            for i = 1, 5 do
+                funcs[i] = function()
+                    return turbo.async.HTTPClient():fetch(base .. "slow",
+                                                          {cache = cache})
+                end
+            end
+            results = coroutine.yield(turbo.async.gather(funcs))
+            for i = 1, 5 do
+                assert.equal("slow body", results[i].body)
+            end
+            assert.equal(1, requests.slow)
+
+            -- Memory budget.
+            local small = turbo.async.HTTPCache(700, 700)
+            coroutine.yield(turbo.async.HTTPClient():fetch(base .. "fresh",
+                                                           {cache = small}))
+            coroutine.yield(turbo.async.HTTPClient():fetch(base .. "slow",
+                                                           {cache = small}))
+            assert.equal(1, small.count)
+            assert.truthy(small.size <= 700)
+            io:close()
+        end)
+        io:wait(10)
+    end)
+
+    it("Hedged requests", function()
+        local port = math.random(10000,40000)
+        local io = turbo.ioloop.instance()
+        local served = {}
+        -- Stand-in replicas, with a injected delay.
+        local ReplicaHandler = class("ReplicaHandler",
+                                     turbo.web.RequestHandler)
+        function ReplicaHandler:get(name)
+            local ms = tonumber(self:get_argument("ms", "0"))
+            if ms > 0 then
+                coroutine.yield(turbo.async.task(sleep, ms))
+            end
+            served[name] = (served[name] or 0) + 1
+            self:write(name)
+        end
+        turbo.web.Application({{"^/(%a+)$", ReplicaHandler}}):listen(port)
+        local base = "http://127.0.0.1:" .. tostring(port) .. "/"
+
+        io:add_callback(function()
+            -- Slow primary, the hedged request wins.
+            local start = turbo.util.gettimemonotonic()
+            local res = coroutine.yield(turbo.async.HTTPClient():fetch(
+                base .. "slow?ms=2000", {
+                    hedge_delay = 0.1,
+                    hedge_urls = {base .. "fast"}
+                }))
+            assert.falsy(res.error)
+            assert.equal("fast", res.body)
+            assert.truthy(res.hedged)
+            assert.truthy(turbo.util.gettimemonotonic() - start < 1000)
+
+            -- Fast primary, no hedged request sent.
+            res = coroutine.yield(turbo.async.HTTPClient():fetch(
+                base .. "primary?ms=10", {
+                    hedge_delay = 0.5,
+                    hedge_urls = {base .. "fast"}
+                }))
+            assert.equal("primary", res.body)
+            assert.falsy(res.hedged)
+            assert.equal(1, served.fast)
+
+            -- Retry budget exhausted, wait for the primary.
+            local budget = turbo.async.RetryBudget(0, 0, 0)
+            res = coroutine.yield(turbo.async.HTTPClient():fetch(
+                base .. "primary?ms=300", {
+                    hedge_delay = 0.05,
+                    hedge_urls = {base .. "fast"},
+                    retry_budget = budget
+                }))
+            assert.equal("primary", res.body)
+            assert.falsy(res.hedged)
+            assert.equal(1, budget.rejected)
+            assert.equal(1, served.fast)
+
+            -- Failed primary is hedged right away.
+            res = coroutine.yield(turbo.async.HTTPClient():fetch(
+                "http://127.0.0.1:1/", {
+                    hedge_delay = 5,
+                    hedge_urls = {base .. "fast"}
+                }))
+            assert.falsy(res.error)
+            assert.equal("fast", res.body)
+
+            -- Cancel.
+            local client = turbo.async.HTTPClient()
+            io:add_callback(function() client:cancel() end)
+            res = coroutine.yield(client:fetch(base .. "slow?ms=500"))
+            assert.equal(turbo.async.errors.CANCELLED, res.error.code)
+            io:close()
+        end)
+        io:wait(10)
+    end)
+
+    it("Streaming request bodies", function()
+        local port = math.random(10000,40000)
+        local io = turbo.ioloop.instance()
+        local task = turbo.async.task
+        local chunked_requests = 0
+        -- Echo server that also understands chunked request bodies.
+        local Server = class("EchoServer", turbo.tcpserver.TCPServer)
+        function Server:handle_stream(stream)
+            io:add_callback(function()
+                local hdr = coroutine.yield(task(stream.read_until, stream,
+                                                 "\r\n\r\n"))
+                local body
+                local len = hdr:match("[Cc]ontent%-[Ll]ength: (%d+)")
+                if len then
+                    body = coroutine.yield(task(stream.read_bytes, stream,
+                                                tonumber(len)))
+                else
+                    assert.truthy(hdr:find("Transfer-Encoding: chunked",
+                                           1, true))
+                    chunked_requests = chunked_requests + 1
+                    local parts = {}
+                    while true do
+                        local sz = tonumber(coroutine.yield(task(
+                            stream.read_until, stream, "\r\n")), 16)
+                        local data = coroutine.yield(task(
+                            stream.read_bytes, stream, sz + 2))
+                        if sz == 0 then
+                            break
+                        end
+                        parts[#parts + 1] = data:sub(1, -3)
+                    end
+                    body = table.concat(parts)
+                end
+                stream:write(string.format(
+                    "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n" ..
+                    "Connection: close\r\n\r\n", body:len()) .. body)
+            end)
+        end
+        Server(io):listen(port)
+        local url = "http://127.0.0.1:" .. tostring(port) .. "/"
+
+        local parts = {}
+        for i = 1, 4096 do
+            parts[i] = string.format("%08d ", i * 7)
+        end
+        local content = table.concat(parts):rep(10)
+        local path = os.tmpname()
+        local f = _G.io.open(path, "wb")
+        f:write(content)
+        f:close()
+
+        io:add_callback(function()
+            -- File path, sent with sendfile.
+            local res = coroutine.yield(turbo.async.HTTPClient():fetch(url,
+                {method = "PUT", body = {file = path}}))
+            assert.falsy(res.error)
+            assert.truthy(res.body == content)
+
+            -- Part of a file.
+            res = coroutine.yield(turbo.async.HTTPClient():fetch(url,
+                {method = "PUT", body = {file = path, offset = 9,
+                                         length = 18}}))
+            assert.equal(content:sub(10, 27), res.body)
+
+            -- Buffer.
+            local buf = turbo.structs.buffer()
+            buf:append_luastr_right("buffer body")
+            res = coroutine.yield(turbo.async.HTTPClient():fetch(url,
+                {method = "POST", body = buf}))
+            assert.equal("buffer body", res.body)
+
+            -- Producer function, yielding to the IOLoop between chunks.
+            local n = 0
+            res = coroutine.yield(turbo.async.HTTPClient():fetch(url, {
+                method = "POST",
+                body = function()
+                    n = n + 1
+                    if n > 3 then
+                        return nil
+                    end
+                    coroutine.yield()
+                    return "part" .. n
+                end}))
+            assert.equal("part1part2part3", res.body)
+
+            -- Producer coroutine.
+            res = coroutine.yield(turbo.async.HTTPClient():fetch(url, {
+                method = "POST",
+                body = coroutine.create(function()
+                    for i = 1, 100 do
+                        coroutine.yield(content:sub(i * 100, i * 100 + 99))
+                    end
+                end)}))
+            assert.truthy(res.body == content:sub(100, 10099))
+            assert.equal(2, chunked_requests)
+
+            -- Invalid body.
+            res = coroutine.yield(turbo.async.HTTPClient():fetch(url,
+                {method = "POST", body = {file = path .. ".missing"}}))
+            assert.equal(turbo.async.errors.INVALID_BODY, res.error.code)
+            os.remove(path)
+            io:close()
+        end)
+        io:wait(10)
+    end)
+
     -- it("HEAD redirect", function()
     --     local port = math.random(10000,40000)
     --     local io = turbo.ioloop.instance()
@@ -246,6 +246,215 @@ describe("turbo.iostream Namespace", function()
             assert.truthy(data)
         end)
 
+        it("IOStream:read_until_pattern, match split between reads",
+            function()
+            local io = turbo.ioloop.instance()
+            local port = math.random(10000,40000)
+            local connected, failed = false, false
+            local res
+
+            -- Server
+            local Server = class("TestServer", turbo.tcpserver.TCPServer)
+            function Server:handle_stream(stream)
+                io:add_callback(function()
+                    coroutine.yield (turbo.async.task(stream.write, stream,
+                                                      "HTTP/1.1 200 OK\r\n\r"))
+                    coroutine.yield (turbo.async.task(function(cb, arg)
+                        io:add_timeout(turbo.util.gettimemonotonic() + 100,
+                                       cb, arg)
+                    end))
+                    coroutine.yield (turbo.async.task(stream.write, stream,
+                                                      "\n\r\nbody"))
+                    stream:close()
+                end)
+            end
+            local srv = Server(io)
+            srv:listen(port)
+
+            io:add_callback(function()
+                -- Client
+                local fd = turbo.socket.new_nonblock_socket(turbo.socket.AF_INET,
+                    turbo.socket.SOCK_STREAM,
+                    0)
+                local stream = turbo.iostream.IOStream(fd, io)
+                stream:connect("127.0.0.1",
+                    port,
+                    turbo.socket.AF_INET,
+                    function()
+                        connected = true
+                        res = coroutine.yield (turbo.async.task(
+                            stream.read_until_pattern, stream, "\r?\n\r?\n"))
+                        stream:close()
+                        io:close()
+                    end,
+                    function(err)
+                        failed = true
+                        io:close()
+                        error("Could not connect.")
+                    end)
+            end)
+
+            io:wait(5)
+            srv:stop()
+            assert.falsy(failed)
+            assert.truthy(connected)
+            assert.equal("HTTP/1.1 200 OK\r\n\r\n", res)
+        end)
+
+        it("IOStream write watermarks", function()
+            local io = turbo.ioloop.instance()
+            local port = math.random(10000,40000)
+            local connected, failed = false, false
+            local events = {}
+            local writable_before, waited, pending_after
+            local data = string.rep("x", 1024*1024)
+
+            -- Server
+            local Server = class("TestServer", turbo.tcpserver.TCPServer)
+            function Server:handle_stream(stream)
+                stream:set_write_watermarks(64*1024, 16*1024)
+                stream:set_pressure_callback(function()
+                    events[#events + 1] = "pressure"
+                end)
+                stream:set_drain_callback(function()
+                    events[#events + 1] = "drain"
+                end)
+                io:add_callback(function()
+                    stream:write(data)
+                    writable_before = stream:writable()
+                    waited = stream:wait_writable()
+                    pending_after = stream:pending_write_bytes()
+                    stream:close()
+                end)
+            end
+            local srv = Server(io)
+            srv:listen(port)
+
+            io:add_callback(function()
+                -- Client
+                local fd = turbo.socket.new_nonblock_socket(turbo.socket.AF_INET,
+                    turbo.socket.SOCK_STREAM,
+                    0)
+                local stream = turbo.iostream.IOStream(fd, io)
+                stream:connect("127.0.0.1",
+                    port,
+                    turbo.socket.AF_INET,
+                    function()
+                        connected = true
+                        -- Let the server fill the socket before reading.
+                        coroutine.yield (turbo.async.task(function(cb, arg)
+                            io:add_timeout(
+                                turbo.util.gettimemonotonic() + 100, cb, arg)
+                        end))
+                        coroutine.yield (turbo.async.task(
+                            stream.read_until_close, stream))
+                        stream:close()
+                        io:close()
+                    end,
+                    function(err)
+                        failed = true
+                        io:close()
+                        error("Could not connect.")
+                    end)
+            end)
+
+            io:wait(10)
+            srv:stop()
+            assert.falsy(failed)
+            assert.truthy(connected)
+            assert.equal(false, writable_before)
+            assert.equal(true, waited)
+            assert.truthy(pending_after <= 16*1024)
+            assert.same({"pressure", "drain"}, events)
+        end)
+
+        for _, splice in ipairs({true, false}) do
+            it("IOStream:pipe_to, " .. (splice and "splice" or "copy"),
+                function()
+                local io = turbo.ioloop.instance()
+                local port = math.random(10000,40000)
+                local connected, failed = false, false
+                local request, piped
+                local res
+                local data = {}
+                for i = 1, 4096 do
+                    data[i] = string.char(math.random(0, 255))
+                end
+                data = string.rep(table.concat(data), 1024)
+
+                -- Upstream, answers a line with 4MB and closes.
+                local Upstream = class("TestUpstream", turbo.tcpserver.TCPServer)
+                function Upstream:handle_stream(stream)
+                    io:add_callback(function()
+                        request = coroutine.yield (turbo.async.task(
+                            stream.read_until, stream, "\n"))
+                        stream:write(data, stream.close, stream)
+                    end)
+                end
+                local upstream = Upstream(io)
+                upstream:listen(port + 1)
+
+                -- Proxy, tunnels between client and upstream.
+                local Proxy = class("TestProxy", turbo.tcpserver.TCPServer)
+                function Proxy:handle_stream(stream)
+                    io:add_callback(function()
+                        local fd = turbo.socket.new_nonblock_socket(
+                            turbo.socket.AF_INET,
+                            turbo.socket.SOCK_STREAM,
+                            0)
+                        local up = turbo.iostream.IOStream(fd, io)
+                        coroutine.yield (turbo.async.task(function(cb, arg)
+                            up:connect("127.0.0.1", port + 1,
+                                turbo.socket.AF_INET,
+                                function() cb(arg) end)
+                        end))
+                        up:pipe_to(stream, {
+                            splice = splice,
+                            callback = function(_, n) piped = n end
+                        })
+                        stream:pipe_to(up, {splice = splice})
+                    end)
+                end
+                local proxy = Proxy(io)
+                proxy:listen(port)
+
+                io:add_callback(function()
+                    -- Client
+                    local fd = turbo.socket.new_nonblock_socket(
+                        turbo.socket.AF_INET,
+                        turbo.socket.SOCK_STREAM,
+                        0)
+                    local stream = turbo.iostream.IOStream(fd, io)
+                    stream:connect("127.0.0.1",
+                        port,
+                        turbo.socket.AF_INET,
+                        function()
+                            connected = true
+                            stream:write("GET\n")
+                            res = coroutine.yield (turbo.async.task(
+                                stream.read_until_close, stream))
+                            stream:close()
+                            io:close()
+                        end,
+                        function(err)
+                            failed = true
+                            io:close()
+                            error("Could not connect.")
+                        end)
+                end)
+
+                io:wait(30)
+                proxy:stop()
+                upstream:stop()
+                assert.falsy(failed)
+                assert.truthy(connected)
+                assert.equal("GET\n", request)
+                assert.equal(#data, #res)
+                assert.truthy(res == data)
+                assert.equal(#data, piped)
+            end)
+        end
+
         it("IOStream:read_until_close", function()
             local io = turbo.ioloop.instance()
             local port = math.random(10000,40000)
@@ -573,6 +782,124 @@ describe("turbo.iostream Namespace", function()
             assert.truthy(streamed > 1)
         end)
 
+        it("IOStream releases the read buffer after a burst", function()
+            local io = turbo.ioloop.instance()
+            local port = math.random(10000,40000)
+            local connected, failed = false, false
+            local burst, idle
+            local bytes = string.rep("x", 1024*1024)
+
+            -- Server
+            local Server = class("TestServer", turbo.tcpserver.TCPServer)
+            function Server:handle_stream(stream)
+                io:add_callback(function()
+                    coroutine.yield (turbo.async.task(stream.write, stream,
+                                                      bytes))
+                end)
+            end
+            local srv = Server(io)
+            srv:listen(port)
+
+            io:add_callback(function()
+                -- Client
+                local fd = turbo.socket.new_nonblock_socket(turbo.socket.AF_INET,
+                    turbo.socket.SOCK_STREAM,
+                    0)
+                local stream = turbo.iostream.IOStream(fd, io)
+                stream:connect("127.0.0.1",
+                    port,
+                    turbo.socket.AF_INET,
+                    function()
+                        connected = true
+                        local res = coroutine.yield (turbo.async.task(
+                            stream.read_bytes, stream, 1024*1024))
+                        assert.equal(bytes, res)
+                        burst = stream:buffer_memory()
+                        coroutine.yield (turbo.async.task(function(cb, arg)
+                            io:add_timeout(
+                                turbo.util.gettimemonotonic() + 2500, cb, arg)
+                        end))
+                        idle = stream:buffer_memory()
+                        stream:close()
+                        io:close()
+                    end,
+                    function(err)
+                        failed = true
+                        io:close()
+                        error("Could not connect.")
+                    end)
+            end)
+
+            io:wait(5)
+            srv:stop()
+            assert.falsy(failed)
+            assert.truthy(connected)
+            assert.truthy(burst > 64*1024)
+            assert.truthy(idle <= 4096)
+        end)
+
+        it("IOStream raw buffer reads return slices", function()
+            local io = turbo.ioloop.instance()
+            local port = math.random(10000,40000)
+            local connected, failed = false, false
+            local head, body
+            local streamed = {}
+            local bytes = string.rep("y", 256*1024)
+
+            -- Server
+            local Server = class("TestServer", turbo.tcpserver.TCPServer)
+            function Server:handle_stream(stream)
+                io:add_callback(function()
+                    coroutine.yield (turbo.async.task(stream.write, stream,
+                                                      "head\r\n" .. bytes))
+                    stream:close()
+                end)
+            end
+            local srv = Server(io)
+            srv:listen(port)
+
+            io:add_callback(function()
+                -- Client
+                local fd = turbo.socket.new_nonblock_socket(turbo.socket.AF_INET,
+                    turbo.socket.SOCK_STREAM,
+                    0)
+                local stream = turbo.iostream.IOStream(fd, io)
+                stream:connect("127.0.0.1",
+                    port,
+                    turbo.socket.AF_INET,
+                    function()
+                        connected = true
+                        local res = coroutine.yield (turbo.async.task(
+                            stream.read_until_raw_buffer, stream, "\r\n"))
+                        assert.truthy(instanceOf(turbo.structs.bufferptr, res))
+                        head = tostring(res)
+                        res = coroutine.yield (turbo.async.task(
+                            function(cb, arg)
+                                stream:read_until_close_raw_buffer(cb, arg,
+                                    function(_, chunk)
+                                        streamed[#streamed + 1] =
+                                            tostring(chunk)
+                                    end)
+                            end))
+                        streamed[#streamed + 1] = tostring(res)
+                        body = table.concat(streamed)
+                        io:close()
+                    end,
+                    function(err)
+                        failed = true
+                        io:close()
+                        error("Could not connect.")
+                    end)
+            end)
+
+            io:wait(10)
+            srv:stop()
+            assert.falsy(failed)
+            assert.truthy(connected)
+            assert.equal("head\r\n", head)
+            assert.equal(bytes, body)
+        end)
+
         -- Regression: a zero-length write_zero_copy buffer (e.g. serving a
         -- zero-length static file) used to never complete, because send()/
         -- SSL_write() legitimately return 0 for an empty buffer, which the
@@ -680,5 +1007,63 @@ describe("turbo.iostream Namespace", function()
             assert.truthy(completed)
         end)
 
+        it("IOStream:set_cork", function()
+            local io = turbo.ioloop.instance()
+            local port = math.random(10000,40000)
+            local connected, failed = false, false
+            local data
+            local corked, again, uncorked
+            local body = string.rep("b", 10000)
+            local buf = turbo.structs.buffer():append_luastr_right(body)
+
+            -- Server
+            local Server = class("TestServer", turbo.tcpserver.TCPServer)
+            function Server:handle_stream(stream)
+                corked = stream:set_cork(true)
+                again = stream:set_cork(true)
+                stream:write("head\r\n", function()
+                    stream:write_zero_copy(buf, function()
+                        uncorked = stream:set_cork(false)
+                        stream:close()
+                    end)
+                end)
+            end
+            local srv = Server(io)
+            srv:listen(port)
+
+            io:add_callback(function()
+                -- Client
+                local fd = turbo.socket.new_nonblock_socket(turbo.socket.AF_INET,
+                    turbo.socket.SOCK_STREAM,
+                    0)
+                local stream = turbo.iostream.IOStream(fd, io)
+                assert.equal(stream:connect("127.0.0.1",
+                    port,
+                    turbo.socket.AF_INET,
+                    function()
+                        connected = true
+                        data = coroutine.yield (turbo.async.task(
+                            stream.read_until_close, stream))
+                        io:close()
+                    end,
+                    function(err)
+                        failed = true
+                        io:close()
+                        error("Could not connect.")
+                    end), 0)
+            end)
+
+            io:wait(5)
+            srv:stop()
+            assert.falsy(failed)
+            assert.truthy(connected)
+            assert.equal("head\r\n" .. body, data)
+            if not _G.__TURBO_USE_LUASOCKET__ then
+                assert.truthy(corked)
+                assert.falsy(again)
+                assert.truthy(uncorked)
+            end
+        end)
+
     end)
 end)
\ No newline at end of file
@@ -0,0 +1,129 @@
+--- Turbo.lua Unit test
+--
+-- Copyright 2026 John Abrahamsen
+--
+-- Licensed under the Apache License, Version 2.0 (the "License");
+-- you may not use this file except in compliance with the License.
+-- You may obtain a copy of the License at
+--
+-- http://www.apache.org/licenses/LICENSE-2.0
+--
+-- Unless required by applicable law or agreed to in writing, software
+-- distributed under the License is distributed on an "AS IS" BASIS,
+-- WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+-- See the License for the specific language governing permissions and
+-- limitations under the License.
+
+_G.__TURBO_USE_LUASOCKET__ = os.getenv("TURBO_USE_LUASOCKET") and true or false
+_G.TURBO_SSL = true
+
+local turbo = require "turbo"
+local ffi = require "ffi"
+
+describe("turbo.pubsub Namespace", function()
+
+    -- Stand in for a WebSocketHandler in processes without connections.
+    local function fake_handler(on_frame)
+        return {
+            stream = {
+                closed = function() return false end,
+                pending_write_bytes = function() return 0 end,
+                write_shared = function(_, frame)
+                    -- Unmasked frames with payloads shorter than 126 bytes
+                    -- have a 2 byte header.
+                    on_frame(tostring(frame):sub(3))
+                end
+            }
+        }
+    end
+
+    it("delivers messages between worker processes", function()
+        local port = math.random(10000, 40000)
+        local io = turbo.ioloop.instance()
+        local bus = turbo.pubsub.Bus(2, 4096)
+        local handlers = {}
+        local SubHandler = class("SubHandler", turbo.websocket.WebSocketHandler)
+        function SubHandler:open()
+            bus:subscribe("news", self)
+            handlers[#handlers + 1] = self
+        end
+        turbo.web.Application({{"^/sub$", SubHandler}}):listen(port)
+
+        local pid = ffi.C.fork()
+        if pid == 0 then
+            -- The other worker answers "ready" messages on "news".
+            local child_io = turbo.ioloop.IOLoop()
+            bus:attach(child_io, 1)
+            bus:subscribe("ready", fake_handler(function(msg)
+                bus:publish("news", "hello " .. msg)
+                child_io:close()
+            end))
+            child_io:add_timeout(turbo.util.gettimemonotonic() + 5000,
+                                 function() child_io:close() end)
+            child_io:start()
+            os.exit(0)
+        end
+
+        bus:attach(io, 0)
+        io:add_callback(function()
+            local got = {}
+            local client
+            coroutine.yield(turbo.async.task(function(cb, arg)
+                turbo.websocket.WebSocketClient(
+                    "ws://127.0.0.1:" .. tostring(port) .. "/sub", {
+                    on_connect = function(self)
+                        client = self
+                        -- Local subscribers get the message directly.
+                        assert.equal(1, (bus:publish("news", "local")))
+                        bus:publish("ready", "worker")
+                    end,
+                    on_message = function(self, msg)
+                        got[#got + 1] = msg
+                        if #got == 2 then
+                            cb(arg)
+                        end
+                    end
+                })
+            end))
+            assert.same({"local", "hello worker"}, got)
+            assert.equal(1, bus:subscribers("news"))
+            assert.equal(0, bus:dropped())
+            client:close()
+            coroutine.yield(turbo.async.task(function(cb, arg)
+                io:add_timeout(turbo.util.gettimemonotonic() + 50, cb, arg)
+            end))
+            -- Closed connections are unsubscribed.
+            assert.equal(0, bus:subscribers("news"))
+            bus:detach()
+            io:close()
+        end)
+        io:wait(10)
+        local status = ffi.new("int[1]")
+        ffi.C.waitpid(pid, status, 0)
+        assert.equal(0, status[0])
+    end)
+
+    it("drops messages when a ring is full", function()
+        local io = turbo.ioloop.IOLoop()
+        local bus = turbo.pubsub.Bus(2, 256)
+        bus:attach(io, 0)
+        local got = {}
+        local sub = fake_handler(function(msg) got[#got + 1] = msg end)
+        bus:subscribe("t", sub)
+        bus:subscribe("t", sub)
+        assert.equal(1, bus:subscribers("t"))
+        local msg = string.rep("x", 60)
+        -- Ring 1 is never drained, 256 bytes fit three 72 byte records.
+        for i = 1, 3 do
+            assert.same({1, 0}, {bus:publish("t", msg)})
+        end
+        assert.same({1, 1}, {bus:publish("t", msg)})
+        -- Larger than half the ring.
+        assert.same({1, 1}, {bus:publish("t", string.rep("x", 200))})
+        assert.equal(5, #got)
+        bus:unsubscribe("t", sub)
+        assert.equal(0, bus:subscribers("t"))
+        bus:detach()
+    end)
+
+end)
@@ -16,6 +16,7 @@
 
 
 local turbo = require "turbo"
+local ffi = require "ffi"
 math.randomseed(turbo.util.gettimeofday())
 
 describe("turbo.structs Namespace", function()
@@ -103,6 +104,45 @@ describe("turbo.structs Namespace", function()
             -- Every byte must still be "A" -- no garbage from a bad realloc.
             assert.is_nil(s:find("[^A]"))
         end)
+        it("should write in place through reserve and commit", function()
+            local buf = turbo.structs.buffer(4)
+            buf:append_luastr_right("ab")
+            local ptr, avail = buf:reserve(100)
+            assert.truthy(avail >= 100)
+            ffi.copy(ptr, "cdef", 4)
+            -- Reserved space is not part of the buffer until committed.
+            assert.equal("ab", tostring(buf))
+            buf:commit(4)
+            assert.equal("abcdef", tostring(buf))
+            assert.has_error(function() buf:commit(buf:mem()) end)
+        end)
+    end)
+
+    describe("bufferpool", function()
+        local bufferpool = turbo.structs.bufferpool
+
+        it("should hand out released buffers again", function()
+            local buf = bufferpool.acquire(3000)
+            assert.equal(4096, buf:mem())
+            -- Grow past the slab size classes and back.
+            local chunk = string.rep("B", 50 * 1024)
+            buf:append_luastr_right(chunk):append_luastr_right(chunk)
+            assert.equal(chunk .. chunk, tostring(buf))
+            bufferpool.release(buf)
+            assert.has_error(function() bufferpool.release(buf) end)
+            assert.equal(0, buf:len())
+            assert.equal(4096, buf:mem())
+            assert.equal(buf, bufferpool.acquire(4096))
+            bufferpool.release(buf)
+            -- A steady state of acquire and release allocates nothing new.
+            local stats = bufferpool.stats()
+            for _ = 1, 100 do
+                local a = bufferpool.acquire(4096)
+                a:append_luastr_right(chunk)
+                bufferpool.release(a)
+            end
+            assert.same(stats, bufferpool.stats())
+        end)
     end)
 
     describe("Deque class", function()
@@ -40,4 +40,30 @@ describe("turbo.util Namespace", function()
             assert.equal(turbo.util.str_find(h_str, n_str, h_len, n_len) - h_str, 51000051)
         end)
     end)
+
+    describe("util.searcher", function()
+        it("should find delimiters like string.find", function()
+            local haystack = "GET / HTTP/1.1\r\nHost: a\r\nX: \r\r\n\r\nbody\r\n"
+            for _, d in ipairs({"\r\n\r\n", "\r\n", "b", "", "body\r\n",
+                                "nope", haystack, haystack .. "x"}) do
+                local s = turbo.util.searcher(d)
+                local loc = haystack:find(d, 1, true)
+                assert.equal(loc and loc - 1, s:find(haystack, #haystack))
+            end
+        end)
+        it("should continue a failed search", function()
+            local s = turbo.util.searcher("\r\n\r\n")
+            local data = string.rep("Header: value\r\n", 100) .. "\r\nbody"
+            local buf = ffi.new("char[?]", #data)
+            ffi.copy(buf, data, #data)
+            -- Partial reads, the delimiter is split between two of them.
+            local split = #data - 5
+            assert.is_nil(s:find(buf, 100))
+            assert.equal(100 - 3, s.offset)
+            assert.is_nil(s:find(buf, split))
+            assert.equal(split - 3, s:find(buf, #data))
+            assert.equal(0, s.offset)
+            s:reset()
+        end)
+    end)
 end)
\ No newline at end of file
@@ -360,6 +360,294 @@ describe("turbo.web Namespace", function()
         end)
         end
 
+        it("Proxy requests to upstream group.", function()
+            local port = math.random(10000,40000)
+            local up_port = port + 1
+            -- Nothing listens here, the group must fail over.
+            local dead_port = port + 2
+            local io = turbo.ioloop.instance()
+            local UpstreamHandler = class("UpstreamHandler",
+                turbo.web.RequestHandler)
+            function UpstreamHandler:get()
+                self:set_header("X-Got-For", self.request.headers:get(
+                    "X-Forwarded-For"))
+                self:write(string.rep("x", 100000))
+            end
+            function UpstreamHandler:post()
+                self:write(self.request.body)
+            end
+            turbo.web.Application({{"^/$", UpstreamHandler}}):listen(up_port)
+            local group = turbo.web.UpstreamGroup({
+                "127.0.0.1:" .. tostring(dead_port),
+                "127.0.0.1:" .. tostring(up_port)
+            }, {max_fails = 1})
+            turbo.web.Application({
+                {"^/$", turbo.web.ProxyHandler, group}
+            }):listen(port)
+
+            io:add_callback(function()
+                local url = "http://127.0.0.1:"..tostring(port).."/"
+                for _ = 1, 3 do
+                    local res = coroutine.yield(
+                        turbo.async.HTTPClient():fetch(url))
+                    assert.falsy(res.error)
+                    assert.equal(res.code, 200)
+                    assert.equal(res.body, string.rep("x", 100000))
+                    assert.truthy(res.headers:get("X-Got-For"))
+                end
+                assert.equal(group.servers[1].fails, 1)
+                -- Connections to the live server are reused.
+                assert.equal(#group.servers[2].idle, 1)
+                local body = string.rep("y", 1024*1024)
+                local res = coroutine.yield(turbo.async.HTTPClient():fetch(
+                    url, {method = "POST", body = body}))
+                assert.falsy(res.error)
+                assert.equal(res.body, body)
+                io:close()
+            end)
+            io:wait(10)
+        end)
+
+        it("Proxy to the upstream with the least active requests.", function()
+            local port = math.random(10000,40000)
+            local io = turbo.ioloop.instance()
+            local task = turbo.async.task
+            local function upstream(name, up_port)
+                local SlowHandler = class("SlowHandler",
+                    turbo.web.RequestHandler)
+                function SlowHandler:get()
+                    coroutine.yield(task(io.add_timeout, io,
+                        turbo.util.gettimemonotonic() + 2000))
+                    self:write(name)
+                end
+                local FastHandler = class("FastHandler",
+                    turbo.web.RequestHandler)
+                function FastHandler:get()
+                    self:write(name)
+                end
+                turbo.web.Application({
+                    {"^/slow$", SlowHandler},
+                    {"^/$", FastHandler}
+                }):listen(up_port)
+            end
+            upstream("1", port + 1)
+            upstream("2", port + 2)
+            local group = turbo.web.UpstreamGroup({
+                "127.0.0.1:" .. tostring(port + 1),
+                "127.0.0.1:" .. tostring(port + 2)
+            }, {balance = "least_conn"})
+            turbo.web.Application({
+                {"^/.*$", turbo.web.ProxyHandler, group}
+            }):listen(port)
+
+            local url = "http://127.0.0.1:"..tostring(port)
+            local slow
+            io:add_callback(function()
+                slow = coroutine.yield(
+                    turbo.async.HTTPClient():fetch(url .. "/slow"))
+            end)
+            io:add_callback(function()
+                -- Wait for the slow request to reach server 1.
+                while group.servers[1].active == 0 do
+                    coroutine.yield(task(io.add_timeout, io,
+                        turbo.util.gettimemonotonic() + 20))
+                end
+                -- Round robin would send every other one to server 1.
+                for _ = 1, 4 do
+                    local res = coroutine.yield(
+                        turbo.async.HTTPClient():fetch(url .. "/"))
+                    assert.falsy(res.error)
+                    assert.equal(res.body, "2")
+                end
+                while not slow do
+                    coroutine.yield(task(io.add_timeout, io,
+                        turbo.util.gettimemonotonic() + 50))
+                end
+                assert.falsy(slow.error)
+                assert.equal(slow.body, "1")
+                assert.equal(group.servers[1].active, 0)
+                assert.equal(group.servers[2].active, 0)
+                io:close()
+            end)
+            io:wait(10)
+        end)
+
+        it("Proxy does not forward hop-by-hop fields.", function()
+            local port = math.random(10000,40000)
+            local up_port = port + 1
+            local io = turbo.ioloop.instance()
+            local UpstreamHandler = class("UpstreamHandler",
+                turbo.web.RequestHandler)
+            function UpstreamHandler:get()
+                local h = self.request.headers
+                local got = {}
+                for _, name in ipairs({"X-Secret", "Keep-Alive", "X-Pass"}) do
+                    if h:get(name) then
+                        got[#got + 1] = name
+                    end
+                end
+                self:set_header("X-Got", table.concat(got, ","))
+                self:set_header("Keep-Alive", "timeout=5")
+                self:write("ok")
+            end
+            turbo.web.Application({{"^/$", UpstreamHandler}}):listen(up_port)
+            local group = turbo.web.UpstreamGroup({
+                "127.0.0.1:" .. tostring(up_port)
+            })
+            turbo.web.Application({
+                {"^/$", turbo.web.ProxyHandler, group}
+            }):listen(port)
+
+            io:add_callback(function()
+                local res = coroutine.yield(turbo.async.HTTPClient():fetch(
+                    "http://127.0.0.1:"..tostring(port).."/", {
+                        on_headers = function(h)
+                            h:add("Connection", "X-Secret")
+                            h:add("X-Secret", "hidden")
+                            h:add("Keep-Alive", "timeout=5")
+                            h:add("X-Pass", "1")
+                        end
+                    }))
+                assert.falsy(res.error)
+                assert.equal(res.body, "ok")
+                assert.equal(res.headers:get("X-Got"), "X-Pass")
+                assert.falsy(res.headers:get("Keep-Alive"))
+                io:close()
+            end)
+            io:wait(10)
+        end)
+
+        it("Proxy chunked response to HTTP/1.0 client.", function()
+            local port = math.random(10000,40000)
+            local up_port = port + 1
+            local io = turbo.ioloop.instance()
+            local UpstreamHandler = class("UpstreamHandler",
+                turbo.web.RequestHandler)
+            function UpstreamHandler:get()
+                self:set_chunked_write()
+                self:write("hello ")
+                self:flush()
+                self:write("world")
+            end
+            turbo.web.Application({{"^/$", UpstreamHandler}}):listen(up_port)
+            local group = turbo.web.UpstreamGroup({
+                "127.0.0.1:" .. tostring(up_port)
+            })
+            turbo.web.Application({
+                {"^/$", turbo.web.ProxyHandler, group}
+            }):listen(port)
+
+            local response
+            io:add_callback(function()
+                local fd = turbo.socket.new_nonblock_socket(
+                    turbo.socket.AF_INET,
+                    turbo.socket.SOCK_STREAM,
+                    0)
+                local stream = turbo.iostream.IOStream(fd, io)
+                stream:connect("127.0.0.1",
+                    port,
+                    turbo.socket.AF_INET,
+                    function()
+                        stream:write("GET / HTTP/1.0\r\n\r\n")
+                        stream:read_until_close(function(data)
+                            response = data
+                            io:close()
+                        end)
+                    end,
+                    function(err)
+                        error("Could not connect.")
+                    end)
+            end)
+            io:wait(10)
+            assert.truthy(response)
+            local head, body = response:match("^(.-\r\n)\r\n(.*)$")
+            assert.truthy(head:find("^HTTP/1.1 200"))
+            assert.falsy(head:lower():find("transfer-encoding", 1, true))
+            assert.truthy(head:find("Connection: close\r\n", 1, true))
+            assert.equal(body, "hello world")
+        end)
+
+        it("Proxy uses a failed upstream again after fail_timeout.", function()
+            local port = math.random(10000,40000)
+            local io = turbo.ioloop.instance()
+            local task = turbo.async.task
+            local function upstream(name, up_port)
+                local UpstreamHandler = class("UpstreamHandler",
+                    turbo.web.RequestHandler)
+                function UpstreamHandler:get()
+                    self:write(name)
+                end
+                turbo.web.Application({
+                    {"^/$", UpstreamHandler}
+                }):listen(up_port)
+            end
+            -- Server 1 is not listening yet.
+            upstream("2", port + 2)
+            local group = turbo.web.UpstreamGroup({
+                "127.0.0.1:" .. tostring(port + 1),
+                "127.0.0.1:" .. tostring(port + 2)
+            }, {max_fails = 1, fail_timeout = 0.3})
+            turbo.web.Application({
+                {"^/$", turbo.web.ProxyHandler, group}
+            }):listen(port)
+
+            io:add_callback(function()
+                local url = "http://127.0.0.1:"..tostring(port).."/"
+                local res = coroutine.yield(
+                    turbo.async.HTTPClient():fetch(url))
+                assert.falsy(res.error)
+                assert.equal(res.body, "2")
+                assert.equal(group.servers[1].fails, 1)
+                upstream("1", port + 1)
+                coroutine.yield(task(io.add_timeout, io,
+                    turbo.util.gettimemonotonic() + 400))
+                res = coroutine.yield(turbo.async.HTTPClient():fetch(url))
+                assert.falsy(res.error)
+                assert.equal(res.body, "1")
+                assert.equal(group.servers[1].fails, 0)
+                io:close()
+            end)
+            io:wait(10)
+        end)
+
+        it("Proxy times out a stalled upstream body.", function()
+            local port = math.random(10000,40000)
+            local up_port = port + 1
+            local io = turbo.ioloop.instance()
+            local task = turbo.async.task
+            -- Sends part of the body and then nothing more.
+            local Server = class("StallServer", turbo.tcpserver.TCPServer)
+            function Server:handle_stream(stream)
+                io:add_callback(function()
+                    coroutine.yield(task(stream.read_until, stream,
+                                         "\r\n\r\n"))
+                    stream:write("HTTP/1.1 200 OK\r\n" ..
+                                 "Content-Length: 100\r\n\r\nabc")
+                end)
+            end
+            local srv = Server(io)
+            srv:listen(up_port)
+            local group = turbo.web.UpstreamGroup({
+                "127.0.0.1:" .. tostring(up_port)
+            }, {read_timeout = 0.3})
+            turbo.web.Application({
+                {"^/$", turbo.web.ProxyHandler, group}
+            }):listen(port)
+
+            io:add_callback(function()
+                -- HTTPClient does not notice the close in the middle of
+                -- the body, its request_timeout ends the fetch.
+                local res = coroutine.yield(turbo.async.HTTPClient():fetch(
+                    "http://127.0.0.1:"..tostring(port).."/",
+                    {request_timeout = 2}))
+                assert.truthy(res.error)
+                assert.equal(group.servers[1].active, 0)
+                assert.equal(#group.servers[1].idle, 0)
+                io:close()
+            end)
+            io:wait(10)
+            srv:stop()
+        end)
 
     end)
 
@@ -24,7 +24,9 @@ describe("turbo.websocket Namespace", function()
     local function make_handler(url_args)
         local stream = {
             set_close_callback = function() end,
-            read_bytes = function() end,
+            set_pressure_callback = function() end,
+            set_drain_callback = function() end,
+            read_decoded = function() end,
         }
         local opened_with
         local handler = setmetatable({
@@ -76,4 +78,570 @@ describe("turbo.websocket Namespace", function()
         assert.same({}, opened_with())
     end)
 
+    -- Connect to path, send messages and call callback(arg, client,
+    -- received) once all echoes arrived or the connection closed. Messages
+    -- are sent as binary if messages.binary is set.
+    local function echo_session(url, kwargs, messages, callback, arg)
+        local received = {}
+        local done = false
+        local function finish(client)
+            if not done then
+                done = true
+                callback(arg, client, received)
+            end
+        end
+        kwargs.on_connect = function(self)
+            for i = 1, #messages do
+                self:write_message(messages[i], messages.binary)
+            end
+        end
+        kwargs.on_message = function(self, msg)
+            received[#received + 1] = msg
+            if #received == #messages then
+                finish(self)
+                self:close()
+            end
+        end
+        kwargs.on_close = finish
+        kwargs.on_error = finish
+        turbo.ioloop.instance():add_callback(function()
+            turbo.websocket.WebSocketClient(url, kwargs)
+        end)
+    end
+
+    it("permessage-deflate", function()
+        local port = math.random(10000, 40000)
+        local io = turbo.ioloop.instance()
+        local task = turbo.async.task
+        local handlers = {}
+        local inflated = {}
+        local EchoHandler = class("DeflateEcho",
+                                  turbo.websocket.WebSocketHandler)
+        function EchoHandler:open()
+            handlers[#handlers + 1] = self
+        end
+        function EchoHandler:on_message(msg)
+            self:write_message(msg)
+        end
+        function EchoHandler:_decompress_message(data)
+            inflated[#inflated + 1] = data:len()
+            return turbo.websocket.WebSocketHandler._decompress_message(
+                self, data)
+        end
+        turbo.web.Application({
+            {"^/deflate$", EchoHandler,
+                {compression = {threshold = 64, server_max_window_bits = 12}}},
+            {"^/small$", EchoHandler,
+                {compression = {max_message_size = 1024}}},
+            {"^/plain$", EchoHandler}
+        }):listen(port)
+        local url = "ws://127.0.0.1:" .. tostring(port)
+
+        local rows = {}
+        for i = 1, 200 do
+            rows[i] = string.format(
+                '{"id":%d,"name":"sensor","value":%d,"unit":"C"}', i, i % 7)
+        end
+        local big = "[" .. table.concat(rows, ",") .. "]"
+
+        io:add_callback(function()
+            -- Compressed in both directions, client resets its context.
+            local client, received = coroutine.yield(task(echo_session,
+                url .. "/deflate",
+                {compression = {client_no_context_takeover = true}},
+                {big, "short", big}))
+            assert.equal(3, #received)
+            assert.truthy(received[1] == big)
+            assert.equal("short", received[2])
+            assert.truthy(received[3] == big)
+            -- Only the large messages were compressed, and well.
+            assert.equal(2, #inflated)
+            assert.truthy(inflated[1] < big:len() / 4)
+            local server = handlers[1]
+            assert.equal(12, server._compression.window_bits)
+            assert.truthy(server._compression.inflate_no_context)
+            assert.falsy(server._compression.deflate_no_context)
+            assert.truthy(client._compression.deflate_no_context)
+
+            -- Server without compression declines the offer.
+            client, received = coroutine.yield(task(echo_session,
+                url .. "/plain", {compression = true}, {big}))
+            assert.truthy(received[1] == big)
+            assert.falsy(client._compression)
+            assert.falsy(handlers[2]._compression)
+
+            -- Inflated size is capped per message.
+            client, received = coroutine.yield(task(echo_session,
+                url .. "/small", {compression = true}, {big}))
+            assert.equal(0, #received)
+            io:close()
+        end)
+        io:wait(10)
+    end)
+
+    it("masks payloads in place", function()
+        local ffi = require "ffi"
+        local lib = turbo.util.load_libtffi()
+        local mask = "\1\128\255\42"
+        -- Cover the byte, word and vector paths at odd offsets.
+        local src = {}
+        for i = 1, 203 do
+            src[i] = string.char((i * 37) % 256)
+        end
+        src = table.concat(src)
+        for offset = 0, 3 do
+            for sz = 0, 200, 7 do
+                local buf = ffi.new("char[?]", 204)
+                ffi.copy(buf, src, 203)
+                lib.turbo_websocket_mask_inplace(buf + offset, mask, sz)
+                local expected = {}
+                for i = 1, sz do
+                    expected[i] = string.char(bit.bxor(
+                        src:byte(offset + i), mask:byte((i - 1) % 4 + 1)))
+                end
+                assert.equal(src:sub(1, offset) .. table.concat(expected) ..
+                             src:sub(offset + sz + 1, 203),
+                             ffi.string(buf, 203))
+            end
+        end
+    end)
+
+    it("echoes masked frames of all length encodings", function()
+        local port = math.random(10000, 40000)
+        local io = turbo.ioloop.instance()
+        local EchoHandler = class("MaskEcho", turbo.websocket.WebSocketHandler)
+        function EchoHandler:on_message(msg)
+            self:write_message(msg, true)
+        end
+        turbo.web.Application({{"^/echo$", EchoHandler}}):listen(port)
+        local messages = {}
+        for i, sz in ipairs({0, 1, 125, 126, 4099, 65535, 65536, 200003}) do
+            local parts = {}
+            for j = 1, sz do
+                parts[j] = string.char((j * i) % 256)
+            end
+            messages[i] = table.concat(parts)
+        end
+        messages.binary = true
+        io:add_callback(function()
+            local _, received = coroutine.yield(turbo.async.task(echo_session,
+                "ws://127.0.0.1:" .. tostring(port) .. "/echo", {}, messages))
+            assert.equal(#messages, #received)
+            for i = 1, #messages do
+                assert.truthy(received[i] == messages[i])
+            end
+            io:close()
+        end)
+        io:wait(10)
+    end)
+
+    it("parses bursts of frames in one pass", function()
+        local port = math.random(10000, 40000)
+        local io = turbo.ioloop.instance()
+        local passes = 0
+        local got = {}
+        local BurstHandler = class("BurstHandler",
+                                   turbo.websocket.WebSocketHandler)
+        function BurstHandler:_handle_frames(count)
+            passes = passes + 1
+            return turbo.websocket.WebSocketHandler._handle_frames(self, count)
+        end
+        function BurstHandler:on_message(msg)
+            got[#got + 1] = msg
+            if msg == "last" then
+                self:write_message(tostring(#got))
+            end
+        end
+        turbo.web.Application({{"^/burst$", BurstHandler}}):listen(port)
+        io:add_callback(function()
+            local client = coroutine.yield(turbo.async.task(function(cb, arg)
+                turbo.websocket.WebSocketClient(
+                    "ws://127.0.0.1:" .. tostring(port) .. "/burst", {
+                    on_connect = function(self)
+                        for i = 1, 500 do
+                            self:write_message(tostring(i))
+                        end
+                        -- Fragmented message with a control frame between.
+                        self:_send_frame(false, turbo.websocket.opcode.TEXT,
+                                         "frag")
+                        self:ping("p")
+                        self:_send_frame(true,
+                                         turbo.websocket.opcode.CONTINUE,
+                                         "ment")
+                        self:write_message("last")
+                    end,
+                    on_message = function(self, msg)
+                        cb(arg, msg)
+                    end
+                })
+            end))
+            assert.equal("502", client)
+            assert.equal("1", got[1])
+            assert.equal("500", got[500])
+            assert.equal("fragment", got[501])
+            -- 503 frames, at most 64 per pass.
+            assert.truthy(passes < 20)
+            io:close()
+        end)
+        io:wait(10)
+    end)
+
+    it("streams large messages in chunks", function()
+        local port = math.random(10000, 40000)
+        local io = turbo.ioloop.instance()
+        local server_chunks = 0
+        local StreamHandler = class("StreamHandler",
+                                    turbo.websocket.WebSocketHandler)
+        function StreamHandler:on_message_chunk(chunk, last, binary)
+            -- Echo each piece as it arrives.
+            server_chunks = server_chunks + 1
+            if not self._echoing then
+                self._echoing = true
+                self:begin_message(binary)
+            end
+            if last then
+                self._echoing = false
+                self:end_message(chunk)
+            else
+                self:write_fragment(chunk)
+            end
+        end
+        turbo.web.Application({
+            {"^/stream$", StreamHandler, {compression = true}}
+        }):listen(port)
+        local url = "ws://127.0.0.1:" .. tostring(port) .. "/stream"
+        local piece = string.rep("0123456789abcdef", 1024*16)
+        local whole = string.rep("x", 1024*300) .. "y"
+
+        local function session(compression)
+            return turbo.async.task(function(cb, arg)
+                local messages = {}
+                local parts = {}
+                local largest = 0
+                turbo.websocket.WebSocketClient(url, {
+                    compression = compression,
+                    on_connect = function(self)
+                        self:begin_message(true)
+                        for i = 1, 4 do
+                            self:write_fragment(piece)
+                        end
+                        self:end_message()
+                        self:write_message(whole)
+                    end,
+                    on_message_chunk = function(self, chunk, last, binary)
+                        parts[#parts + 1] = chunk
+                        largest = math.max(largest, chunk:len())
+                        if last then
+                            messages[#messages + 1] = {table.concat(parts),
+                                                       binary}
+                            parts = {}
+                            if #messages == 2 then
+                                cb(arg, {messages = messages,
+                                         largest = largest})
+                                self:close()
+                            end
+                        end
+                    end
+                })
+            end)
+        end
+
+        io:add_callback(function()
+            for _, compression in ipairs({false, true}) do
+                server_chunks = 0
+                local res = coroutine.yield(session(compression or nil))
+                assert.equal(string.rep(piece, 4), res.messages[1][1])
+                assert.truthy(res.messages[1][2])
+                assert.equal(whole, res.messages[2][1])
+                assert.falsy(res.messages[2][2])
+                if not compression then
+                    -- Neither side had to hold a whole message.
+                    assert.truthy(server_chunks > 6)
+                    assert.truthy(res.largest < whole:len())
+                end
+            end
+            io:close()
+        end)
+        io:wait(20)
+    end)
+
+    it("validates UTF-8 across fragments", function()
+        local v = setmetatable({}, {__index = turbo.websocket.WebSocketStream})
+        assert.truthy(v:_valid_utf8("plain ascii", true))
+        assert.truthy(v:_valid_utf8(string.rep("h\195\169llo ", 100), true))
+        -- A euro sign and a 4 byte character split between fragments.
+        assert.truthy(v:_valid_utf8("price: \226\130", false))
+        assert.truthy(v:_valid_utf8("\172 \240\157", false))
+        assert.truthy(v:_valid_utf8("\132", false))
+        assert.truthy(v:_valid_utf8("\158", true))
+        -- Truncated at the end of the message.
+        assert.truthy(v:_valid_utf8(string.rep("x", 40) .. "\226\130", false))
+        assert.falsy(v:_valid_utf8("", true))
+        for _, bad in ipairs({"\255", "\192\175", "\237\160\128",
+                              "\244\144\128\128", "\224\128\128",
+                              "\128"}) do
+            assert.falsy(v:_valid_utf8(bad, true))
+            assert.falsy(v:_valid_utf8(string.rep("a", 50) .. bad ..
+                                       string.rep("b", 50), true))
+        end
+        assert.truthy(v:_valid_utf8("still usable", true))
+    end)
+
+    it("closes with 1007 on invalid UTF-8", function()
+        local port = math.random(10000, 40000)
+        local io = turbo.ioloop.instance()
+        local got = {}
+        local errors = 0
+        local Utf8Handler = class("Utf8Handler",
+                                  turbo.websocket.WebSocketHandler)
+        function Utf8Handler:on_message(msg)
+            got[#got + 1] = msg
+        end
+        function Utf8Handler:on_error(msg)
+            errors = errors + 1
+        end
+        turbo.web.Application({{"^/utf8$", Utf8Handler}}):listen(port)
+        local handle_opcode = turbo.websocket.WebSocketClient._handle_opcode
+        io:add_callback(function()
+            local close_payload
+            turbo.websocket.WebSocketClient._handle_opcode =
+                function(self, opcode, data)
+                if opcode == turbo.websocket.opcode.CLOSE then
+                    close_payload = data
+                end
+                return handle_opcode(self, opcode, data)
+            end
+            coroutine.yield(turbo.async.task(function(cb, arg)
+                turbo.websocket.WebSocketClient(
+                    "ws://127.0.0.1:" .. tostring(port) .. "/utf8", {
+                    on_connect = function(self)
+                        self:_send_frame(false, turbo.websocket.opcode.TEXT,
+                                         "\226\130")
+                        self:_send_frame(true,
+                                         turbo.websocket.opcode.CONTINUE,
+                                         "\172")
+                        self:write_message("\255 not text")
+                        self:write_message("never delivered")
+                    end,
+                    on_close = function(self)
+                        cb(arg)
+                    end
+                })
+            end))
+            turbo.websocket.WebSocketClient._handle_opcode = handle_opcode
+            assert.same({"\226\130\172"}, got)
+            assert.equal(1, errors)
+            assert.equal("\003\239", close_payload:sub(1, 2))
+            io:close()
+        end)
+        io:wait(10)
+    end)
+
+    it("keepalive", function()
+        local port = math.random(10000, 40000)
+        local io = turbo.ioloop.instance()
+        local ka = {interval = 40, tick = 10, max_missed = 2}
+        local handlers = {}
+        local KaHandler = class("KaHandler", turbo.websocket.WebSocketHandler)
+        function KaHandler:open()
+            handlers[#handlers + 1] = self
+        end
+        turbo.web.Application({
+            {"^/ka$", KaHandler, {keepalive = ka}}
+        }):listen(port)
+        local url = "ws://127.0.0.1:" .. tostring(port) .. "/ka"
+        local manager = turbo.websocket.keepalive_manager(ka, io)
+
+        io:add_callback(function()
+            -- A client that answers pings stays connected and gets a RTT.
+            -- One that does not is closed after two missed pings.
+            local clients = {}
+            local closed = coroutine.yield(turbo.async.task(function(cb, arg)
+                for i = 1, 2 do
+                    turbo.websocket.WebSocketClient(url, {
+                        keepalive = {interval = 40, tick = 10},
+                        on_connect = function(self)
+                            clients[i] = self
+                        end,
+                        on_ping = i == 2 and function(self) end or nil,
+                        on_close = function(self)
+                            cb(arg, i)
+                        end
+                    })
+                end
+            end))
+            assert.equal(2, closed)
+            assert.equal(2, #handlers)
+            assert.truthy(handlers[1]:rtt() >= 0)
+            assert.falsy(handlers[2]:rtt())
+            assert.truthy(clients[1]:rtt() >= 0)
+            -- Same settings and IOLoop, so the live client shares the
+            -- manager with the live handler.
+            assert.equal(2, manager:count())
+            handlers[1]:close()
+            coroutine.yield(turbo.async.task(function(cb, arg)
+                io:add_timeout(turbo.util.gettimemonotonic() + 50, cb, arg)
+            end))
+            assert.equal(0, manager:count())
+            io:close()
+        end)
+        io:wait(10)
+    end)
+
+    it("coalesces small frames", function()
+        local port = math.random(10000, 40000)
+        local io = turbo.ioloop.instance()
+        local writevs = 0
+        local writev = turbo.iostream.IOStream.writev
+        local CoalesceHandler = class("CoalesceHandler",
+                                      turbo.websocket.WebSocketHandler)
+        function CoalesceHandler:open()
+            self:set_coalescing(0)
+        end
+        function CoalesceHandler:on_message(msg)
+            self:write_message(msg)
+        end
+        turbo.web.Application({{"^/co$", CoalesceHandler}}):listen(port)
+        io:add_callback(function()
+            turbo.iostream.IOStream.writev = function(...)
+                writevs = writevs + 1
+                return writev(...)
+            end
+            local depth
+            local received = coroutine.yield(turbo.async.task(
+                function(cb, arg)
+                local got = {}
+                turbo.websocket.WebSocketClient(
+                    "ws://127.0.0.1:" .. tostring(port) .. "/co", {
+                    on_connect = function(self)
+                        self:set_coalescing(5)
+                        for i = 1, 1000 do
+                            self:write_message(tostring(i))
+                        end
+                        depth = {self:send_queue_depth()}
+                    end,
+                    on_message = function(self, msg)
+                        got[#got + 1] = msg
+                        if #got == 1000 then
+                            cb(arg, got)
+                        end
+                    end
+                })
+            end))
+            turbo.iostream.IOStream.writev = writev
+            assert.equal(1000, depth[1])
+            assert.truthy(depth[2] > 1000 * 6)
+            for i = 1, 1000 do
+                assert.equal(tostring(i), received[i])
+            end
+            -- One flush from the client, few from the server.
+            assert.truthy(writevs < 100)
+            io:close()
+        end)
+        io:wait(10)
+    end)
+
+    it("broadcast", function()
+        local port = math.random(10000, 40000)
+        local io = turbo.ioloop.instance()
+        local handlers = {}
+        local SubHandler = class("SubHandler",
+                                 turbo.websocket.WebSocketHandler)
+        function SubHandler:on_message(msg)
+            handlers[#handlers + 1] = self
+        end
+        turbo.web.Application({
+            {"^/sub$", SubHandler,
+                {compression = {server_no_context_takeover = true,
+                                threshold = 16}}}
+        }):listen(port)
+        local url = "ws://127.0.0.1:" .. tostring(port) .. "/sub"
+        local big = string.rep("broadcast message ", 1000)
+
+        io:add_callback(function()
+            local received = {}
+            local closed = 0
+            local subscribed = coroutine.yield(turbo.async.task(
+                function(cb, arg)
+                for i = 1, 4 do
+                    local compression = (i % 2 == 0) and true or nil
+                    io:add_callback(function()
+                        turbo.websocket.WebSocketClient(url, {
+                            compression = compression,
+                            on_connect = function(self)
+                                self:write_message("subscribe")
+                            end,
+                            on_message = function(self, msg)
+                                received[#received + 1] = msg
+                            end,
+                            on_close = function(self)
+                                closed = closed + 1
+                            end
+                        })
+                    end)
+                end
+                local function check()
+                    if #handlers == 4 then
+                        cb(arg, true)
+                    else
+                        io:add_timeout(turbo.util.gettimemonotonic() + 10,
+                                       check)
+                    end
+                end
+                check()
+            end))
+            assert.truthy(subscribed)
+
+            local sent, slow = turbo.websocket.broadcast(handlers, big)
+            assert.equal(4, sent)
+            assert.equal(0, #slow)
+            sent = turbo.websocket.broadcast(handlers, {small = true})
+            assert.equal(4, sent)
+            coroutine.yield(turbo.async.task(function(cb, arg)
+                local function check()
+                    if #received == 8 then
+                        cb(arg)
+                    else
+                        io:add_timeout(turbo.util.gettimemonotonic() + 10,
+                                       check)
+                    end
+                end
+                check()
+            end))
+            local bigs = 0
+            for i = 1, #received do
+                if received[i] == big then
+                    bigs = bigs + 1
+                else
+                    assert.equal('{"small":true}', received[i])
+                end
+            end
+            assert.equal(4, bigs)
+
+            -- Everyone is a slow consumer.
+            sent, slow = turbo.websocket.broadcast(handlers, "x", false,
+                                                   {max_pending = -1})
+            assert.equal(0, sent)
+            assert.equal(4, #slow)
+            sent, slow = turbo.websocket.broadcast(handlers, "x", false,
+                {max_pending = -1, slow = "close"})
+            assert.equal(4, #slow)
+            coroutine.yield(turbo.async.task(function(cb, arg)
+                local function check()
+                    if closed == 4 then
+                        cb(arg)
+                    else
+                        io:add_timeout(turbo.util.gettimemonotonic() + 10,
+                                       check)
+                    end
+                end
+                check()
+            end))
+            assert.equal(8, #received)
+            assert.equal(0, turbo.websocket.broadcast(handlers, "x"))
+            io:close()
+        end)
+        io:wait(10)
+    end)
+
 end)
@@ -114,15 +114,19 @@ turbo.websocket =       require "turbo.websocket"
 turbo.socket =          require "turbo.socket_ffi"
 turbo.sockutil =        require "turbo.sockutil"
 turbo.hash =            require "turbo.hash"
+turbo.zlib =            require "turbo.zlib"
 if turbo.platform.__LINUX__ then
     turbo.inotify =         require "turbo.inotify"
     turbo.fs =              require "turbo.fs"
     turbo.signal =          require "turbo.signal"
     turbo.syscall =         require "turbo.syscall"
     turbo.thread =          require "turbo.thread"
+    turbo.pubsub =          require "turbo.pubsub"
 end
 turbo.structs =         {}
 turbo.structs.deque =   require "turbo.structs.deque"
 turbo.structs.buffer =  require "turbo.structs.buffer"
+turbo.structs.bufferptr = require "turbo.structs.bufferptr"
+turbo.structs.bufferpool = require "turbo.structs.bufferpool"
 
 return turbo
@@ -17,6 +17,7 @@
 -- limitations under the License.
 
 local iostream =            require "turbo.iostream"
+local ffi =                 require "ffi"
 local platform =            require "turbo.platform"
 local ioloop =              require "turbo.ioloop"
 local httputil =            require "turbo.httputil"
@@ -29,9 +30,11 @@ local deque =               require "turbo.structs.deque"
 local buffer =              require "turbo.structs.buffer"
 local escape =              require "turbo.escape"
 local crypto =              require "turbo.crypto"
+local zlib =                require "turbo.zlib"
 require "turbo.3rdparty.middleclass"
 
 local unpack = util.funpack
+local bit = jit and require "bit" or require "bit32"
 local AF_INET
 if platform.__LINUX__ then
     AF_INET = socket.AF_INET
@@ -147,14 +150,21 @@ local errors = {
     ,REQUEST_TIMEOUT = -6 -- Request timed out.
     ,NO_HEADERS = -7 -- Shouldnt happen.
     ,REQUIRES_BODY = -8 -- Expected a HTTP body, but none set.
-    ,INVALID_BODY = -9 -- Request body is not a string.
+    ,INVALID_BODY = -9 -- Invalid request body, or body producer failed.
     ,SOCKET_ERROR = -10 -- Socket error, check message.
     ,SSL_ERROR = -11 -- SSL error, check message.
     ,BUSY = -12 -- Operation in progress.
     ,REDIRECT_MAX = -13 -- Redirect maximum reached.
+    ,DECOMPRESS_ERROR = -14 -- Response body could not be decompressed.
+    ,CANCELLED = -15 -- Request cancelled with HTTPClient:cancel().
 }
 async.errors = errors
 
+local _idempotent_methods = {
+    GET = true, HEAD = true, OPTIONS = true, TRACE = true, PUT = true,
+    DELETE = true
+}
+
 --- Fetch a URL.
 -- @param url (String) URL to fetch.
 -- @param kwargs (table) Optional keyword arguments
@@ -164,12 +174,17 @@ async.errors = errors
 -- ``keep_alive`` = Reuse connection if the scenario supports it.
 -- ``cookie`` = (Table) The cookie(s) to use.
 -- ``http_version`` = Set HTTP version. Default is HTTP1.1
--- ``use_gzip`` = Use gzip compression. Default is true.
+-- ``use_gzip`` = Use gzip compression. Default is true. Sends
+-- Accept-Encoding and transparently decompresses gzip and deflate encoded
+-- response bodies. The Content-Encoding header is left as received.
 -- ``allow_redirects`` = Allow or disallow redirects. Default is true.
 -- ``max_redirects`` = Maximum redirections allowed. Default is 4.
 -- ``on_headers`` = Callback to be called when assembling request headers. Called
 --  with headers as argument.-- Default to port 80 if not specified in URL.
--- ``body`` = Request HTTP body in plain form.
+-- ``body`` = Request HTTP body. A Lua string, a Buffer instance, a table
+-- {file=path} or {fd=fd} with optional offset and length members, or a
+-- producer function or coroutine returning string or Buffer chunks and nil
+-- at the end. Producer bodies are sent with chunked encoding.
 -- ``request_timeout`` = Total timeout in seconds (including connect) for
 -- request. Default is 60 seconds.
 -- ``connect_timeout`` = Timeout in seconds for connect. Default is 20 secs.
@@ -177,6 +192,21 @@ async.errors = errors
 -- ``auth_password`` = Basic Auth password.
 -- ``user_agent`` = User Agent string used in request headers. Default
 -- is ``Turbo Client vx.x.x``
+-- ``streaming_callback`` = Function called with each (decompressed) piece of
+-- the response body as it arrives, instead of collecting it in the body of
+-- the response.
+-- ``cache`` = HTTPCache instance to use for the request, or true to use the
+-- shared instance. See async.HTTPCache. Not used with streaming_callback.
+-- ``hedge_delay`` = Seconds, or function returning seconds, to wait for a
+-- response before sending the same request again on another connection.
+-- The first response is used and the other request is cancelled. Only used
+-- for idempotent methods and not together with streaming_callback. The
+-- request is also sent again right away if the first one fails before the
+-- delay has passed.
+-- ``hedge_urls`` = List of alternative URLs, e.g other replicas, to send
+-- the hedged request to in turn. Default is the same URL.
+-- ``retry_budget`` = RetryBudget instance limiting the rate of hedged
+-- requests, or true to use the shared instance.
 function async.HTTPClient:fetch(url, kwargs)
     if self.in_progress then
         self:_throw_error(errors.BUSY, "HTTPClient is busy.")
@@ -196,54 +226,86 @@ function async.HTTPClient:fetch(url, kwargs)
     self.kwargs.user_agent = self.kwargs.user_agent or "Turbo Client v2.0.0"
     self.kwargs.connect_timeout = self.kwargs.connect_timeout or 30
     self.kwargs.request_timeout = self.kwargs.request_timeout or 60
+    if self.kwargs.use_gzip == nil then
+        self.kwargs.use_gzip = true
+    end
+    self._hedge = nil
+    if self.kwargs.hedge_delay and not self.kwargs.streaming_callback and
+        _idempotent_methods[self.kwargs.method:upper()] and
+        type(self.kwargs.body) ~= "function" and
+        type(self.kwargs.body) ~= "thread" then
+        self:_fetch_hedged(url)
+        return self.coctx
+    end
     -- Store away old hostname and port if keep-alive and this is a
     -- 2nd run.
-    local re_use_connection = false
-    local kept_alive = self:_is_kept_alive()
-    if kept_alive and self.hostname and self.port then
+    if self:_is_kept_alive() and self.hostname and self.port then
         self.prev_hostname = self.hostname
         self.prev_port = self.port
         self.prev_schema = self.schema
     end
-    if self:_set_url(url) == -1 then
-        return self.coctx
-    end
-    if kept_alive and self.prev_hostname == self.hostname and
-        (self.port ~= nil and self.prev_port == self.port) and
-        self.prev_schema == self.schema then
-        re_use_connection = true
-
-    else
-        if self.iostream then self.iostream:close() end
-
-        local sock, msg = socket.new_nonblock_socket(self.family,
-            socket.SOCK_STREAM,
-            0)
-        if sock == -1 then
-            -- Could not create a new socket. Highly unlikely case.
-            self:_throw_error(errors.SOCKET_ERROR, msg)
-            return self.coctx
-        end
-        self.sock = sock
-    end
     -- Reset states from previous fetch.
     self.redirect = 0
     self.s_connecting = false
     self.s_error = false
     self.error_str = ""
     self.error_code = 0
-    if not re_use_connection then
-        self:_connect() -- No point to check return, as this is the last thing to happen.
-        -- Assuming the method is yielded the returned context is placed in the
-        -- IOLoop, awaiting further work, or returning error being set.
-        self.coctx:set_state(coctx.states.WAIT_COND)
-    else
+    self.payload = nil
+    self._cache_key = nil
+    self._cache_hit = nil
+    self._cache_entry = nil
+    self._cache_leader = false
+    self._cache = nil
+    if self.kwargs.cache and not self.kwargs.streaming_callback then
+        self._cache = self.kwargs.cache == true and async.HTTPCache.shared() or
+            self.kwargs.cache
+    end
+    if self:_set_url(url) == -1 then
+        return self.coctx
+    end
+    if self._cache_hit then
+        self.io_loop:add_callback(self._finalize_cached, self)
+        return self.coctx
+    end
+    if self._cache_key and self.kwargs.method:upper() == "GET" then
+        if self._cache:_join(self._cache_key, self) then
+            -- Another client is already fetching this resource. Wait for
+            -- its response instead of sending a identical request.
+            self.coctx:set_state(coctx.states.WAIT_COND)
+            return self.coctx
+        end
+        self._cache_leader = true
+    end
+    self:_start_fetch()
+    return self.coctx
+end
+
+--- Connect, or reuse the kept alive connection, and send the prepared
+-- request.
+function async.HTTPClient:_start_fetch()
+    if self:_is_kept_alive() and self.prev_hostname == self.hostname and
+        (self.port ~= nil and self.prev_port == self.port) and
+        self.prev_schema == self.schema then
         -- Reusing connection
         self.headers = httputil.HTTPHeaders()
         self.req = nil
         self:_handle_connect()
+        return
     end
-    return self.coctx
+    if self.iostream then self.iostream:close() end
+    local sock, msg = socket.new_nonblock_socket(self.family,
+        socket.SOCK_STREAM,
+        0)
+    if sock == -1 then
+        -- Could not create a new socket. Highly unlikely case.
+        self:_throw_error(errors.SOCKET_ERROR, msg)
+        return
+    end
+    self.sock = sock
+    self:_connect() -- No point to check return, as this is the last thing to happen.
+    -- Assuming the method is yielded the returned context is placed in the
+    -- IOLoop, awaiting further work, or returning error being set.
+    self.coctx:set_state(coctx.states.WAIT_COND)
 end
 
 local function _parse_url_error_handler(err)
@@ -440,6 +502,10 @@ end
 function async.HTTPClient:_prepare_http_request()
     self.headers:add("Host", self.hostname)
     self.headers:add("User-Agent", self.kwargs.user_agent)
+    if self.kwargs.use_gzip and zlib.available and
+        (self.schema == "http" or self.schema == "https") then
+        self.headers:add("Accept-Encoding", "gzip, deflate")
+    end
     self.headers:set_method(self.kwargs.method:upper())
     self.headers:set_version(self.kwargs.http_version or "HTTP/1.1")
     if self.kwargs.cookie then
@@ -465,15 +531,24 @@ function async.HTTPClient:_prepare_http_request()
         self.headers:set_uri(self.path)
     end
     local write_buf = ""
+    self:_close_body_source()
     if self.kwargs.body then
         if type(self.kwargs.body) == "string" then
             local len = self.kwargs.body:len()
             self.headers:add("Content-Length", len)
             write_buf = write_buf .. self.kwargs.body .. "\r\n\r\n"
         else
-            self:_throw_error(errors.INVALID_BODY,
-                "Request body is not a string.")
-            return -1
+            local src, err = self:_create_body_source(self.kwargs.body)
+            if not src then
+                self:_throw_error(errors.INVALID_BODY, err)
+                return -1
+            end
+            self._body_source = src
+            if src.length then
+                self.headers:add("Content-Length", src.length)
+            else
+                self.headers:add("Transfer-Encoding", "chunked")
+            end
         end
     elseif type(self.kwargs.params) == "table" then
         if self.kwargs.method == "POST" or self.kwargs.method == "PUT" or
@@ -511,11 +586,142 @@ function async.HTTPClient:_prepare_http_request()
             self.headers:set_uri(self.headers:get_uri() .. get_url_params)
         end
     end
+    if self._cache then
+        if not self._cache_key then
+            self:_cache_lookup()
+        end
+        local entry = self._cache_entry
+        if entry and self.redirect == 0 then
+            -- Stale entry, ask the server to validate it.
+            if entry.etag and not self.headers:get("If-None-Match") then
+                self.headers:add("If-None-Match", entry.etag)
+            end
+            if entry.last_modified and
+                not self.headers:get("If-Modified-Since") then
+                self.headers:add("If-Modified-Since", entry.last_modified)
+            end
+        end
+    end
     local stringifed_headers = self.headers:stringify_as_request()
     write_buf = stringifed_headers .. write_buf
     return write_buf
 end
 
+--- Should a request not use the cache? The response to a request with
+-- credentials may be for that user only, and a request with no-cache or
+-- no-store in Cache-Control asks for a response from the server.
+local function _cache_bypass(headers)
+    if headers:get("Authorization") or headers:get("Cookie") then
+        return true
+    end
+    local cc = headers:get("Cache-Control")
+    if type(cc) == "table" then
+        cc = table.concat(cc, ",")
+    end
+    cc = cc and cc:lower()
+    return cc ~= nil and (cc:find("no-cache", 1, true) ~= nil or
+        cc:find("no-store", 1, true) ~= nil)
+end
+
+--- Find the cache entry for the prepared request. A fresh entry is used as
+-- is, a stale one with validators is revalidated.
+function async.HTTPClient:_cache_lookup()
+    self._cache_key = string.format("%s://%s:%d%s",
+        self.schema,
+        self.hostname,
+        self.port or 0,
+        self.headers:get_uri())
+    if self.kwargs.method:upper() ~= "GET" then
+        -- Only to invalidate the stored response.
+        return
+    end
+    if _cache_bypass(self.headers) then
+        -- Not looked up, joined or stored.
+        self._cache_key = nil
+        self._cache = nil
+        return
+    end
+    local entry = self._cache:get(self._cache_key)
+    if not entry then
+        self._cache.misses = self._cache.misses + 1
+        return
+    end
+    if entry:is_fresh() then
+        self._cache.hits = self._cache.hits + 1
+        self._cache_hit = entry
+    else
+        self._cache_entry = entry
+    end
+end
+
+-- Methods that do not change the resource, so do not invalidate it.
+local _safe_methods = {GET = true, HEAD = true, OPTIONS = true, TRACE = true}
+
+--- Store or invalidate the response in the cache and hand the result to
+-- clients waiting for it.
+-- @return (HTTPCacheEntry) Entry to respond with if the response validated
+-- a stale entry.
+function async.HTTPClient:_cache_response()
+    local cache = self._cache
+    local key = self._cache_key
+    local entry, revalidated
+    if not self.s_error and self.redirect == 0 then
+        local code = self.response_headers:get_status_code()
+        local method = self.kwargs.method:upper()
+        if method ~= "GET" then
+            -- Unsafe methods invalidate the stored response (RFC 7234 4.4).
+            if not _safe_methods[method] and code < 400 then
+                cache:remove(key)
+            end
+        elseif code == 304 and self._cache_entry then
+            entry = self._cache_entry
+            -- Before its size changes.
+            cache:remove(key)
+            entry:freshen(self.response_headers)
+            cache:put(key, entry)
+            cache.revalidations = cache.revalidations + 1
+            revalidated = entry
+        else
+            entry = async.HTTPCacheEntry(self.response_headers,
+                                         self.payload,
+                                         self.url)
+            if entry:is_storable() then
+                cache:put(key, entry)
+            else
+                entry = nil
+                cache:remove(key)
+            end
+        end
+    end
+    if self._cache_leader then
+        self._cache_leader = false
+        cache:_release(key, entry)
+    end
+    return revalidated
+end
+
+--- Continue a fetch that waited for another client to fetch the same
+-- resource.
+function async.HTTPClient:_cache_resume()
+    if self._cache_hit then
+        self:_finalize_cached()
+    else
+        self:_start_fetch()
+    end
+end
+
+--- Complete a fetch with a cached response.
+function async.HTTPClient:_finalize_cached()
+    local entry = self._cache_hit
+    self._cache_hit = nil
+    self.in_progress = false
+    local res = entry:response()
+    res.request_time = util.gettimemonotonic() - self.start_time
+    self.coctx:set_state(coctx.states.DEAD)
+    self.coctx:set_arguments({res})
+    self.coctx:finalize_context()
+end
+
 function async.HTTPClient:_send_http_request()
     local req = self.req
     if not req then
@@ -524,10 +730,182 @@ function async.HTTPClient:_send_http_request()
             return -1
         end
     end
-    self.iostream:write(req, self._headers_written_cb, self)
+    if self._body_source then
+        self.iostream:write(req, self._write_body, self)
+    else
+        self.iostream:write(req, self._headers_written_cb, self)
+    end
+end
+
+local O_RDONLY = 0
+local SEEK_SET, SEEK_CUR, SEEK_END = 0, 1, 2
+local BODY_CHUNK_SZ = 1024*64
+
+--- Create a body source for a request body that is not a Lua string.
+-- @return Table describing the source, or nil and error message.
+function async.HTTPClient:_create_body_source(body)
+    if instanceOf(buffer, body) then
+        return {kind = "buffer", buf = body, length = tonumber(body:len())}
+    elseif type(body) == "function" then
+        return {kind = "producer", next = body}
+    elseif type(body) == "thread" then
+        return {kind = "producer", next = function()
+            if coroutine.status(body) == "dead" then
+                return nil
+            end
+            local ok, chunk = coroutine.resume(body)
+            if not ok then
+                error(chunk)
+            end
+            return chunk
+        end}
+    elseif type(body) ~= "table" or not (body.file or body.fd) then
+        return nil, "Request body is not a string, buffer, file or producer."
+    end
+    local offset = body.offset or 0
+    if not platform.__LINUX__ or _G.__TURBO_USE_LUASOCKET__ then
+        -- No sendfile, read the file with the Lua io library instead.
+        if not body.file then
+            return nil, "File descriptor bodies are not supported."
+        end
+        local f, err = io.open(body.file, "rb")
+        if not f then
+            return nil, err
+        end
+        local length = body.length or (f:seek("end") - offset)
+        f:seek("set", offset)
+        local remaining = length
+        return {kind = "producer", length = length, file = f, next = function()
+            if remaining == 0 then
+                return nil
+            end
+            local chunk = f:read(math.min(remaining, BODY_CHUNK_SZ))
+            if not chunk then
+                error("Unexpected end of file.")
+            end
+            remaining = remaining - chunk:len()
+            return chunk
+        end}
+    end
+    local fd = body.fd
+    local own = false
+    if body.file then
+        fd = ffi.C.open(body.file, O_RDONLY)
+        if fd == -1 then
+            return nil, string.format("Could not open %s. %s",
+                body.file,
+                socket.strerror(ffi.errno()))
+        end
+        own = true
+    end
+    local length = body.length
+    if not length then
+        -- Find size without moving the file position of the caller's fd.
+        local cur = ffi.C.lseek64(fd, 0, SEEK_CUR)
+        local size = ffi.C.lseek64(fd, 0, SEEK_END)
+        ffi.C.lseek64(fd, cur, SEEK_SET)
+        if size == -1 then
+            if own then
+                ffi.C.close(fd)
+            end
+            return nil, "Could not get size of request body file."
+        end
+        length = tonumber(size) - offset
+    end
+    return {kind = "file", fd = fd, own = own, offset = offset,
+            length = length}
+end
+
+--- Release resources held by the current body source.
+function async.HTTPClient:_close_body_source()
+    local src = self._body_source
+    if not src then
+        return
+    end
+    if src.own then
+        ffi.C.close(src.fd)
+    elseif src.file then
+        src.file:close()
+    end
+    self._body_source = nil
+end
+
+--- Write the request body after the request headers have been written.
+function async.HTTPClient:_write_body()
+    if self.s_error then
+        return
+    end
+    local src = self._body_source
+    if src.kind == "buffer" then
+        self.iostream:write_zero_copy(src.buf, self._headers_written_cb, self)
+    elseif src.kind == "file" then
+        self.iostream:write_file(src.fd,
+                                 src.offset,
+                                 src.length,
+                                 self._headers_written_cb,
+                                 self)
+    else
+        self:_write_body_chunks()
+    end
+end
+
+--- Pull chunks from a producer and write them, with chunked encoding
+-- unless the length is known. The next chunk is not produced until the
+-- previous has been written to the socket, so memory use is bounded by the
+-- chunk size.
+function async.HTTPClient:_write_body_chunks()
+    local src = self._body_source
+    local stream = self.iostream
+    while true do
+        if self.s_error then
+            return
+        end
+        local ok, chunk = pcall(src.next)
+        if self.s_error then
+            -- Aborted while the producer yielded.
+            return
+        end
+        if not ok then
+            stream:close()
+            self:_throw_error(errors.INVALID_BODY,
+                "Request body producer failed: " .. tostring(chunk))
+            return
+        end
+        if chunk == nil then
+            if src.length then
+                stream:write("", self._headers_written_cb, self)
+            else
+                stream:write("0\r\n\r\n", self._headers_written_cb, self)
+            end
+            return
+        end
+        local len = tonumber(chunk:len())
+        if len > 0 then
+            if not src.length then
+                stream:write(string.format("%x\r\n", len))
+            end
+            if type(chunk) == "string" then
+                stream:write(chunk)
+            else
+                stream:write_buffer(chunk)
+            end
+            if not src.length then
+                stream:write("\r\n")
+            end
+            if stream:writing() then
+                -- Wait for the chunk to be written before producing more.
+                stream:write("", self._write_body_chunks, self)
+                return
+            end
+        end
+    end
 end
 
 function async.HTTPClient:_handle_connect()
+    if self.s_error then
+        -- Request was aborted while connecting.
+        return
+    end
     self.s_connecting = false
     self.io_loop:remove_timeout(self.connect_timeout_ref)
     self.connect_timeout_ref = nil
@@ -539,6 +917,9 @@ function async.HTTPClient:_handle_connect()
 end
 
 function async.HTTPClient:_headers_written_cb()
+    if self.s_error then
+        return
+    end
     self.iostream:read_until_pattern("\r?\n\r?\n", self._handle_headers, self)
 end
 
@@ -565,6 +946,9 @@ local function _on_headers_error_handler(err)
 end
 
 function async.HTTPClient:_handle_headers(data)
+    if self.s_error then
+        return
+    end
     if not data then
         self:_throw_error(errors.NO_HEADERS,
             "No data receive after connect. Expected HTTP headers.")
@@ -587,6 +971,8 @@ function async.HTTPClient:_handle_headers(data)
         self:_handle_1xx_code(code)
         return
     end
+    self._read_buffer = nil
+    self:_set_content_encoding()
     local content_length = self.response_headers:get("Content-Length", true)
     if not content_length or content_length == 0 or self.kwargs.method == "HEAD" then
         if self.response_headers:get("Transfer-Encoding", true) ==
@@ -602,12 +988,115 @@ function async.HTTPClient:_handle_headers(data)
         end
         return
     end
-    self.iostream:read_bytes(tonumber(content_length),
-        self._handle_body,
-        self)
+    if self.kwargs.streaming_callback or self._content_encoding then
+        self._read_buffer = buffer()
+        self.iostream:read_bytes(tonumber(content_length),
+            self._handle_body,
+            self,
+            self._handle_body_chunk,
+            self)
+    else
+        self.iostream:read_bytes(tonumber(content_length),
+            self._handle_body,
+            self)
+    end
+end
+
+--- Content-Encoding: deflate is meant to be zlib wrapped (RFC 7230 4.2.2),
+-- but some servers send raw deflate data. Sniff the zlib header, the first
+-- two bytes of data, to tell the two apart.
+local function _deflate_window_bits(data)
+    local b0, b1 = data:byte(1, 2)
+    if b0 and b1 and bit.band(b0, 0x0f) == 8 and (b0 * 256 + b1) % 31 == 0 then
+        return zlib.ZLIB
+    end
+    return zlib.RAW
+end
+
+function async.HTTPClient:_set_content_encoding()
+    self._content_encoding = nil
+    if not self.kwargs.use_gzip or not zlib.available or
+        self.kwargs.method == "HEAD" then
+        return
+    end
+    local encoding = self.response_headers:get("Content-Encoding", true)
+    if type(encoding) ~= "string" then
+        return
+    end
+    encoding = encoding:lower()
+    if encoding == "gzip" or encoding == "x-gzip" or encoding == "deflate" then
+        self._content_encoding = encoding
+    end
+end
+
+--- Decompress a piece of the response body if the response is encoded.
+-- The inflate stream is taken from the shared pool on first use and returned
+-- when the request is finalized. A buffered body may not decode to more than
+-- max_buffer_size bytes in total.
+-- @return Decoded data, or nil on failure in which case the request has been
+-- failed.
+function async.HTTPClient:_decode_body(data)
+    if not self._content_encoding or data:len() == 0 then
+        return data
+    end
+    if not self._inflate then
+        if self._content_encoding == "deflate" then
+            -- The zlib header is two bytes, hold on to a lone first one.
+            if self._deflate_head then
+                data = self._deflate_head .. data
+                self._deflate_head = nil
+            end
+            if data:len() < 2 then
+                self._deflate_head = data
+                return ""
+            end
+        end
+        self._inflate = zlib.acquire_inflate(
+            self._content_encoding == "deflate" and
+                _deflate_window_bits(data) or zlib.GZIP)
+        self._inflate.max_output = self.max_buffer_size
+        self._decoded_bytes = 0
+    end
+    local decoded, err = self._inflate:inflate(data)
+    if decoded and not self.kwargs.streaming_callback then
+        -- max_output only limits each call, the pieces add up in the
+        -- read buffer.
+        local limit = self.iostream.max_buffer_size
+        self._decoded_bytes = self._decoded_bytes + decoded:len()
+        if self._decoded_bytes > limit then
+            decoded, err = nil, string.format(
+                "Decoded body exceeds %d bytes.", limit)
+        end
+    end
+    if not decoded then
+        -- The connection is in a unknown state, it can not be kept alive.
+        self.iostream:close()
+        self:_throw_error(errors.DECOMPRESS_ERROR,
+            "Could not decompress response body. " .. err)
+        return nil
+    end
+    return decoded
+end
+
+function async.HTTPClient:_handle_body_chunk(data)
+    if self.s_error then
+        return
+    end
+    data = self:_decode_body(data)
+    if not data or data:len() == 0 then
+        return
+    end
+    if self.kwargs.streaming_callback then
+        self.kwargs.streaming_callback(data)
+    else
+        self._read_buffer:append_luastr_right(data)
+    end
 end
 
 function async.HTTPClient:_handle_chunked_encoding(data)
+    if self.s_error then
+        return
+    end
     local next_len = tonumber(data, 16)
     if next_len and next_len > 0 then
         self.iostream:read_bytes(next_len + 2, self._chunked_data, self)
@@ -620,15 +1109,35 @@ function async.HTTPClient:_handle_chunked_encoding(data)
 end
 
 function async.HTTPClient:_chunked_data(data)
+    if self.s_error then
+        return
+    end
     if data and data:len() > 0 then
-        -- Skip appending of ending CRLF.
-        self._read_buffer:append_right(data, data:len() - 2)
+        if self.kwargs.streaming_callback or self._content_encoding then
+            -- Skip ending CRLF.
+            self:_handle_body_chunk(data:sub(1, -3))
+            if self.s_error then
+                return
+            end
+        else
+            -- Skip appending of ending CRLF.
+            self._read_buffer:append_right(data, data:len() - 2)
+        end
     end
     self.iostream:read_until("\r\n", self._handle_chunked_encoding, self)
 end
 
 function async.HTTPClient:_handle_body(data)
-    self.payload = data
+    if self.s_error then
+        return
+    end
+    if self._read_buffer then
+        -- Body has been delivered through _handle_body_chunk.
+        self.payload = tostring(self._read_buffer)
+        self._read_buffer = nil
+    else
+        self.payload = data
+    end
     self:_finalize_request()
 end
 
@@ -678,13 +1187,176 @@ function async.HTTPClient:_throw_error(code, msg)
     self.io_loop:add_callback(self._finalize_request, self)
 end
 
+--- Cancel the request in progress. The fetch is resumed with a error
+-- response with code async.errors.CANCELLED. Does nothing if there is no
+-- request in progress.
+-- @param code (Number) Optional error code to use instead.
+-- @param msg (String) Optional error message.
+function async.HTTPClient:cancel(code, msg)
+    code = code or errors.CANCELLED
+    msg = msg or "Request cancelled."
+    if self._hedge then
+        if not self._hedge.done then
+            local res = async.HTTPResponse()
+            res.error = {
+                code = code,
+                message = msg
+            }
+            self:_hedge_finish(res)
+        end
+        return
+    end
+    self:_abort(code, msg)
+end
+
+--- Send the request, and a hedged request if there is no response within
+-- hedge_delay.
+function async.HTTPClient:_fetch_hedged(url)
+    local kwargs = self.kwargs
+    local budget = kwargs.retry_budget
+    if budget == true then
+        budget = async.RetryBudget.shared()
+    end
+    if budget then
+        budget:deposit()
+    end
+    local delay = kwargs.hedge_delay
+    if type(delay) == "function" then
+        delay = delay()
+    end
+    self._hedge = {
+        url = url,
+        budget = budget,
+        attempts = {},
+        pending = 0,
+        hedged = false,
+        done = false
+    }
+    self._hedge_clients = self._hedge_clients or {}
+    self:_hedge_attempt(url, 1)
+    local _self = self
+    self._hedge.timeout_ref = self.io_loop:add_timeout(
+        util.gettimemonotonic() + delay * 1000,
+        function()
+            _self._hedge.timeout_ref = nil
+            _self:_hedge_send()
+        end)
+end
+
+--- Start attempt n of a hedged request on its own HTTPClient.
+function async.HTTPClient:_hedge_attempt(url, n)
+    local hedge = self._hedge
+    local client = self._hedge_clients[n]
+    if not client then
+        client = async.HTTPClient(self.ssl_options,
+                                  self.io_loop,
+                                  self.max_buffer_size)
+        self._hedge_clients[n] = client
+    end
+    local kwargs = {}
+    for k, v in pairs(self.kwargs) do
+        kwargs[k] = v
+    end
+    kwargs.hedge_delay = nil
+    kwargs.hedge_urls = nil
+    kwargs.retry_budget = nil
+    if n ~= 1 then
+        -- Do not let the hedged request wait on the first one in the cache.
+        kwargs.cache = nil
+    end
+    hedge.attempts[n] = client
+    hedge.pending = hedge.pending + 1
+    local _self = self
+    self.io_loop:add_callback(function()
+        local res = coroutine.yield(client:fetch(url, kwargs))
+        hedge.pending = hedge.pending - 1
+        if hedge.done then
+            return
+        end
+        if res.error then
+            if hedge.pending > 0 or _self:_hedge_send() then
+                -- Let the other request complete.
+                return
+            end
+        end
+        _self:_hedge_finish(res, n)
+    end)
+end
+
+--- Send the hedged request, if it has not been sent already and the retry
+-- budget allows it.
+-- @return (Boolean) True if sent.
+function async.HTTPClient:_hedge_send()
+    local hedge = self._hedge
+    if hedge.done or hedge.hedged then
+        return false
+    end
+    hedge.hedged = true
+    if hedge.budget and not hedge.budget:withdraw() then
+        return false
+    end
+    local url = hedge.url
+    local urls = self.kwargs.hedge_urls
+    if urls and #urls > 0 then
+        self._hedge_next = (self._hedge_next or 0) % #urls + 1
+        url = urls[self._hedge_next]
+    end
+    self:_hedge_attempt(url, 2)
+    return true
+end
+
+--- Complete a hedged request with res, and cancel the other attempts.
+-- @param n (Number) The attempt res is from.
+function async.HTTPClient:_hedge_finish(res, n)
+    local hedge = self._hedge
+    hedge.done = true
+    if hedge.timeout_ref then
+        self.io_loop:remove_timeout(hedge.timeout_ref)
+        hedge.timeout_ref = nil
+    end
+    for i, client in pairs(hedge.attempts) do
+        if i ~= n then
+            client:cancel()
+        end
+    end
+    res.hedged = n == 2
+    self.in_progress = false
+    self.coctx:set_state(coctx.states.DEAD)
+    self.coctx:set_arguments({res})
+    self.coctx:finalize_context()
+end
+
+--- Abort a request in progress. The fetch is resumed with a error response.
+function async.HTTPClient:_abort(code, msg)
+    if not self.in_progress or self.s_error then
+        return
+    end
+    if self._cache_key and not self._cache_leader then
+        -- May be waiting for the response of another client.
+        self._cache:_leave(self._cache_key, self)
+    end
+    if self.iostream then
+        self.iostream:close()
+        self.iostream = nil
+    end
+    self:_throw_error(code, msg)
+end
+
 function async.HTTPClient:_finalize_request()
     self.in_progress = false
+    self:_close_body_source()
+    if self._inflate then
+        zlib.release_inflate(self._inflate)
+        self._inflate = nil
+    end
+    self._deflate_head = nil
     if self.request_timeout_ref then
         self.io_loop:remove_timeout(self.request_timeout_ref)
+        self.request_timeout_ref = nil
     end
     if self.connect_timeout_ref then
         self.io_loop:remove_timeout(self.connect_timeout_ref)
+        self.connect_timeout_ref = nil
     end
     if not self.s_error then
         self.finish_time = util.gettimemonotonic()
@@ -729,12 +1401,21 @@ function async.HTTPClient:_finalize_request()
             end
         end
     end
-    if self.iostream and self.kwargs.keep_alive ~= true then
+    if self.iostream and (self.kwargs.keep_alive ~= true or self.s_error) then
+        -- A failed request may leave unread data on the connection, never
+        -- keep it around.
         self.iostream:close()
         self.iostream = nil
     end
+    local cached
+    if self._cache_key then
+        cached = self:_cache_response()
+    end
     local res = async.HTTPResponse()
-    if self.s_error == true then
+    if cached then
+        res = cached:response()
+        res.request_time = self.finish_time - self.start_time
+    elseif self.s_error == true then
         log.error(string.format("[async.lua] Error code %d. %s",
             self.error_code,
             self.error_str))
@@ -758,5 +1439,715 @@ end
 
 async.HTTPResponse = class("HTTPResponse")
 
+--- RetryBudget class
+-- Token bucket limiting the rate of hedged and retried requests, so that a
+-- slow or failing upstream does not cause a retry storm. Each request
+-- deposits ``ratio`` tokens, and the bucket also refills with ``rate``
+-- tokens per second, up to ``burst`` tokens. Every extra request withdraws
+-- one token. With the defaults extra requests are limited to 10% of the
+-- requests, plus 10 per second.
+async.RetryBudget = class("RetryBudget")
+
+--- Create a new RetryBudget instance.
+-- @param ratio (Number) Tokens deposited per request. Default is 0.1.
+-- @param rate (Number) Tokens added per second. Default is 10.
+-- @param burst (Number) Maximum number of tokens. Default is 100.
+function async.RetryBudget:initialize(ratio, rate, burst)
+    self.ratio = ratio or 0.1
+    self.rate = rate or 10
+    self.burst = burst or 100
+    self.tokens = self.burst
+    self.withdrawn = 0
+    self.rejected = 0
+    self._last = util.gettimemonotonic()
+end
+
+local _shared_budget
+
+--- Get the RetryBudget used by HTTPClient:fetch with ``retry_budget = true``.
+function async.RetryBudget.shared()
+    if not _shared_budget then
+        _shared_budget = async.RetryBudget()
+    end
+    return _shared_budget
+end
+
+function async.RetryBudget:_refill()
+    local now = util.gettimemonotonic()
+    self.tokens = math.min(self.burst,
+                           self.tokens + (now - self._last) / 1000 * self.rate)
+    self._last = now
+end
+
+--- Deposit tokens for a request.
+function async.RetryBudget:deposit()
+    self:_refill()
+    self.tokens = math.min(self.burst, self.tokens + self.ratio)
+end
+
+--- Withdraw a token for a extra request.
+-- @return (Boolean) True if the request may be sent.
+function async.RetryBudget:withdraw()
+    self:_refill()
+    if self.tokens >= 1 then
+        self.tokens = self.tokens - 1
+        self.withdrawn = self.withdrawn + 1
+        return true
+    end
+    self.rejected = self.rejected + 1
+    return false
+end
+
+local _months = {
+    jan = 1, feb = 2, mar = 3, apr = 4, may = 5, jun = 6,
+    jul = 7, aug = 8, sep = 9, oct = 10, nov = 11, dec = 12
+}
+
+--- Parse a HTTP-date (RFC 7231 7.1.1.1) in any of the three allowed formats.
+-- @return (Number) Seconds since epoch, or nil if invalid.
+local function _parse_http_date(str)
+    if type(str) ~= "string" then
+        return nil
+    end
+    -- IMF-fixdate and the obsolete RFC 850 format.
+    local d, mon, y, hh, mm, ss = str:match(
+        "^%a+, (%d%d?)[ %-](%a%a%a)[ %-](%d+) (%d%d):(%d%d):(%d%d)")
+    if not d then
+        -- ANSI C asctime() format.
+        mon, d, hh, mm, ss, y = str:match(
+            "^%a+ (%a%a%a) +(%d%d?) (%d%d):(%d%d):(%d%d) (%d%d%d%d)")
+    end
+    local m = mon and _months[mon:lower()]
+    if not m then
+        return nil
+    end
+    y = tonumber(y)
+    if y < 100 then
+        y = y + (y < 70 and 2000 or 1900)
+    end
+    -- Days since epoch for the proleptic Gregorian calendar.
+    if m <= 2 then
+        y = y - 1
+    end
+    local era = math.floor(y / 400)
+    local yoe = y - era * 400
+    local doy = math.floor((153 * ((m + 9) % 12) + 2) / 5) + tonumber(d) - 1
+    local doe = yoe * 365 + math.floor(yoe / 4) - math.floor(yoe / 100) + doy
+    local days = era * 146097 + doe - 719468
+    return days * 86400 + tonumber(hh) * 3600 + tonumber(mm) * 60 +
+        tonumber(ss)
+end
+async._parse_http_date = _parse_http_date
+
+local function _header_value(headers, key)
+    local value = headers:get(key, true)
+    if type(value) == "table" then
+        return value[1]
+    end
+    return value
+end
+
+local function _header_list(headers, key)
+    local value = headers:get(key, true)
+    if type(value) == "table" then
+        return table.concat(value, ",")
+    end
+    return value
+end
+
+--- Parse Cache-Control directives into a table of lower case names. Values
+-- are strings, directives without a value are true.
+local function _parse_cache_control(value)
+    local directives = {}
+    if not value then
+        return directives
+    end
+    for directive in value:gmatch("[^,]+") do
+        local k, v = directive:match("^%s*([^=%s]+)%s*=?%s*(.-)%s*$")
+        if k then
+            v = v:gsub('^"(.*)"$', "%1")
+            directives[k:lower()] = v ~= "" and v or true
+        end
+    end
+    return directives
+end
+
+-- Status codes that are cacheable by default (RFC 7231 6.1), without those
+-- that HTTPClient would follow as redirect.
+local _cacheable_codes = {
+    [200] = true, [203] = true, [204] = true, [404] = true, [405] = true,
+    [410] = true, [414] = true, [501] = true
+}
+
+-- Upper limit for heuristic freshness, when the response only has a
+-- Last-Modified header.
+local HEURISTIC_MAX = 86400
+
+--- HTTPCacheEntry class
+-- A stored response and the metadata needed to calculate its freshness
+-- (RFC 7234 4.2).
+async.HTTPCacheEntry = class("HTTPCacheEntry")
+
+function async.HTTPCacheEntry:initialize(headers, body, url)
+    self.headers = headers
+    self.body = body
+    self.url = url
+    self.code = headers:get_status_code()
+    self:freshen(headers)
+end
+
+-- Fields of a 304 response that do not replace the stored ones, they
+-- describe that response or its connection, not the stored one.
+local _not_updated = {
+    ["connection"] = true,
+    ["keep-alive"] = true,
+    ["transfer-encoding"] = true,
+    ["content-length"] = true,
+    ["content-encoding"] = true,
+    ["trailer"] = true,
+    ["upgrade"] = true
+}
+
+--- Replace the fields of stored that the 304 response headers carry
+-- (RFC 7234 4.3.4).
+-- @return New HTTPParser instance, stored is left as is as it may be shared
+-- with earlier responses.
+local function _update_headers(stored, headers, code)
+    local fields = headers:get_fields()
+    local replaced = {}
+    for i = 1, #fields do
+        local key = fields[i][1]:lower()
+        if not _not_updated[key] then
+            replaced[key] = true
+        end
+    end
+    local t = {string.format("%s %d %s\r\n",
+                             stored:get_version(),
+                             code,
+                             http_response_codes[code] or "Unknown")}
+    local stored_fields = stored:get_fields()
+    for i = 1, #stored_fields do
+        if not replaced[stored_fields[i][1]:lower()] then
+            t[#t + 1] = stored_fields[i][1] .. ": " .. stored_fields[i][2] ..
+                "\r\n"
+        end
+    end
+    for i = 1, #fields do
+        if replaced[fields[i][1]:lower()] then
+            t[#t + 1] = fields[i][1] .. ": " .. fields[i][2] .. "\r\n"
+        end
+    end
+    t[#t + 1] = "\r\n"
+    return httputil.HTTPParser(table.concat(t),
+                               httputil.hdr_t["HTTP_RESPONSE"])
+end
+
+--- Update freshness metadata from response headers. Used both for new
+-- responses and for 304 Not Modified responses validating the entry, whose
+-- header fields then replace the stored ones.
+function async.HTTPCacheEntry:freshen(headers)
+    local now = os.time()
+    if self.headers ~= headers then
+        self.headers = _update_headers(self.headers, headers, self.code)
+    end
+    local stored = self.headers
+    self.size = (self.body and self.body:len() or 0) +
+        (stored.hdr_str and stored.hdr_str:len() or 0) + 256
+    local cc = _parse_cache_control(_header_list(stored, "Cache-Control"))
+    local expires = _header_value(stored, "Expires")
+    local date = _parse_http_date(_header_value(headers, "Date")) or now
+    local age = tonumber(_header_value(headers, "Age")) or 0
+    self.response_time = now
+    -- Corrected initial age, assuming negligible response delay.
+    self.initial_age = math.max(0, now - date, age)
+    self.no_store = cc["no-store"] and true or false
+    self.no_cache = cc["no-cache"] and true or false
+    self.explicit = true
+    if cc["max-age"] then
+        self.lifetime = tonumber(cc["max-age"]) or 0
+    elseif expires then
+        -- Invalid dates, e.g "0", mean already expired.
+        expires = _parse_http_date(expires)
+        self.lifetime = expires and math.max(0, expires - date) or 0
+    else
+        self.explicit = false
+        self.lifetime = 0
+    end
+    self.etag = _header_value(stored, "ETag")
+    self.last_modified = _header_value(stored, "Last-Modified")
+    if not self.explicit and self.last_modified then
+        local lm = _parse_http_date(self.last_modified)
+        if lm and lm < date then
+            self.lifetime = math.min(HEURISTIC_MAX,
+                                     math.floor((date - lm) / 10))
+        end
+    end
+    self.vary = _header_list(self.headers, "Vary")
+end
+
+--- Is the response allowed in cache, and useful to keep?
+function async.HTTPCacheEntry:is_storable()
+    if self.no_store or not _cacheable_codes[self.code] then
+        return false
+    end
+    if self.vary then
+        -- The body is always stored decoded, so Vary on Accept-Encoding is
+        -- harmless. Other request headers are not part of the cache key.
+        for field in self.vary:gmatch("[^,%s]+") do
+            if field:lower() ~= "accept-encoding" then
+                return false
+            end
+        end
+    end
+    -- Entries that are stale on arrival are only useful if they can be
+    -- revalidated.
+    return self.lifetime > self.initial_age or
+        self.etag ~= nil or self.last_modified ~= nil
+end
+
+--- Can the entry be used without revalidation?
+function async.HTTPCacheEntry:is_fresh(now)
+    if self.no_cache then
+        return false
+    end
+    local age = self.initial_age + ((now or os.time()) - self.response_time)
+    return self.lifetime > age
+end
+
+--- Create a HTTPResponse from the entry.
+function async.HTTPCacheEntry:response()
+    local res = async.HTTPResponse()
+    res.code = self.code
+    res.reason = http_response_codes[self.code]
+    res.headers = self.headers
+    res.body = self.body
+    res.url = self.url
+    res.cached = true
+    return res
+end
+
+--- HTTPCache class
+-- Private in-memory HTTP cache (RFC 7234) for HTTPClient. Pass a instance to
+-- HTTPClient:fetch with the ``cache`` keyword argument, it may be shared by
+-- any number of HTTPClient instances. Fresh responses to GET requests are
+-- returned without contacting the server, stale responses are revalidated
+-- with If-None-Match and If-Modified-Since. Concurrent requests for the same
+-- resource are coalesced into one upstream request. The least recently used
+-- entries are evicted when the memory budget is exceeded.
+--
+-- Cached responses share the response headers and body between callers and
+-- have the ``cached`` member set to true. Responses with a Vary header other
+-- than Accept-Encoding are not stored. The cache key does not include
+-- credentials, so GET requests with a Authorization or Cookie header, e.g
+-- from the ``cookie`` keyword argument, do not use the cache. Neither do
+-- requests with no-cache or no-store in their Cache-Control header.
+async.HTTPCache = class("HTTPCache")
+
+--- Create a new HTTPCache instance.
+-- @param max_bytes (Number) Memory budget for stored responses. Default is
+-- 16MB.
+-- @param max_entry_size (Number) Largest response to store. Default is 1/8th
+-- of max_bytes.
+function async.HTTPCache:initialize(max_bytes, max_entry_size)
+    self.max_bytes = max_bytes or 1024*1024*16
+    self.max_entry_size = max_entry_size or math.floor(self.max_bytes / 8)
+    self.size = 0
+    self.count = 0
+    self.hits = 0
+    self.misses = 0
+    self.revalidations = 0
+    self._entries = {}
+    self._pending = {}
+    -- Doubly linked LRU list, most recently used first.
+    self._lru = {}
+    self._lru.next = self._lru
+    self._lru.prev = self._lru
+end
+
+local _shared_cache
+
+--- Get the cache used by HTTPClient:fetch with ``cache = true``.
+function async.HTTPCache.shared()
+    if not _shared_cache then
+        _shared_cache = async.HTTPCache()
+    end
+    return _shared_cache
+end
+
+local function _lru_unlink(node)
+    node.prev.next = node.next
+    node.next.prev = node.prev
+end
+
+local function _lru_push(head, node)
+    node.next = head.next
+    node.prev = head
+    head.next.prev = node
+    head.next = node
+end
+
+--- Get entry for key, and mark it as recently used.
+-- @return (HTTPCacheEntry) or nil.
+function async.HTTPCache:get(key)
+    local node = self._entries[key]
+    if not node then
+        return nil
+    end
+    _lru_unlink(node)
+    _lru_push(self._lru, node)
+    return node.entry
+end
+
+--- Store entry for key, evicting the least recently used entries to stay
+-- within the memory budget.
+-- @return (Boolean) True if stored.
+function async.HTTPCache:put(key, entry)
+    self:remove(key)
+    if entry.size > self.max_entry_size then
+        return false
+    end
+    while self.size + entry.size > self.max_bytes and self.count > 0 do
+        self:remove(self._lru.prev.key)
+    end
+    local node = {key = key, entry = entry}
+    self._entries[key] = node
+    _lru_push(self._lru, node)
+    self.size = self.size + entry.size
+    self.count = self.count + 1
+    return true
+end
+
+--- Remove entry for key.
+function async.HTTPCache:remove(key)
+    local node = self._entries[key]
+    if node then
+        _lru_unlink(node)
+        self._entries[key] = nil
+        self.size = self.size - node.entry.size
+        self.count = self.count - 1
+    end
+end
+
+--- Remove all entries.
+function async.HTTPCache:clear()
+    self._entries = {}
+    self._lru.next = self._lru
+    self._lru.prev = self._lru
+    self.size = 0
+    self.count = 0
+end
+
+--- Register client as fetching key.
+-- @return (Boolean) True if another client is already fetching key, and
+-- client has been queued to receive its result.
+function async.HTTPCache:_join(key, client)
+    local waiters = self._pending[key]
+    if waiters then
+        waiters[#waiters + 1] = client
+        return true
+    end
+    self._pending[key] = {}
+    return false
+end
+
+--- Remove client from the clients waiting for key.
+function async.HTTPCache:_leave(key, client)
+    local waiters = self._pending[key]
+    if waiters then
+        for i = 1, #waiters do
+            if waiters[i] == client then
+                table.remove(waiters, i)
+                return
+            end
+        end
+    end
+end
+
+--- Complete clients waiting for key. They are given entry if the response
+-- could be stored, or else they send their own request.
+function async.HTTPCache:_release(key, entry)
+    local waiters = self._pending[key]
+    self._pending[key] = nil
+    if not waiters then
+        return
+    end
+    for i = 1, #waiters do
+        local client = waiters[i]
+        if entry then
+            -- Just received from the server, so usable even if it must be
+            -- revalidated for later requests.
+            self.hits = self.hits + 1
+            client._cache_hit = entry
+        end
+        client.io_loop:add_callback(client._cache_resume, client)
+    end
+end
+
+--- Run functions concurrently on the IOLoop and collect their results.
+-- Each function is run in its own coroutine and may yield like any other
+-- IOLoop callback. If a function returns a CoroutineContext, e.g from
+-- HTTPClient:fetch, it is yielded and its result used. At most
+-- ``concurrency`` functions are running at any time, new ones are started as
+-- others complete, so there is no polling involved.
+--
+-- Usage:
+-- local results, errs = coroutine.yield(turbo.async.gather({
+--      function() return turbo.async.HTTPClient():fetch(url1) end,
+--      function() return turbo.async.HTTPClient():fetch(url2) end
+-- }, {concurrency = 2, timeout = 10}))
+--
+-- @param funcs (Table) List of functions to run.
+-- @param kwargs (Table) Optional keyword arguments
+-- ** Available options **
+-- ``concurrency`` = Maximum number of functions running at once. Default is
+-- all of them.
+-- ``task_timeout`` = Timeout in seconds for each function. A function that
+-- has not completed in time is given the error "timeout" and its eventual
+-- result is discarded. It keeps its slot until it returns, so abort it with
+-- ``on_task_timeout`` to let the next function start.
+-- ``on_task_timeout`` = Function called with the index of a function when
+-- ``task_timeout`` expires for it.
+-- ``timeout`` = Timeout in seconds for the whole operation. Functions that
+-- have not completed in time are given the error "timeout".
+-- ``on_timeout`` = Function called with a table of the indexes still
+-- running when ``timeout`` expires. Can be used to abort them.
+-- ``io_loop`` = IOLoop to use. Default is the global instance.
+-- @return (CoroutineContext) Resumes the yielding coroutine with a table of
+-- results in the same order as funcs, and a table of errors indexed by the
+-- same positions for functions that failed.
+function async.gather(funcs, kwargs)
+    kwargs = kwargs or {}
+    local io = kwargs.io_loop or ioloop.instance()
+    local ctx = coctx.CoroutineContext(io)
+    ctx:set_state(coctx.states.WORKING)
+    local n = #funcs
+    local results = {}
+    local errs = {}
+    local state = {
+        n = n,
+        next = 1,
+        done = 0,
+        slots = 0,
+        finished = false,
+        completed = {},
+        running = {}
+    }
+
+    local function _finish()
+        if state.finished then
+            return
+        end
+        state.finished = true
+        if state.timeout_ref then
+            io:remove_timeout(state.timeout_ref)
+            state.timeout_ref = nil
+        end
+        ctx:set_state(coctx.states.DEAD)
+        ctx:set_arguments({results, errs})
+        ctx:finalize_context()
+    end
+
+    local function _complete(i, res, err)
+        if state.completed[i] or state.finished then
+            return false
+        end
+        state.completed[i] = true
+        results[i] = res
+        errs[i] = err
+        state.done = state.done + 1
+        if state.done == n then
+            _finish()
+        end
+        return true
+    end
+
+    local _worker
+    _worker = function()
+        while not state.finished and state.next <= n do
+            local i = state.next
+            state.next = i + 1
+            state.running[i] = true
+            local task_ref
+            if kwargs.task_timeout then
+                task_ref = io:add_timeout(
+                    util.gettimemonotonic() + kwargs.task_timeout * 1000,
+                    function()
+                        -- The function still holds the slot, so no more
+                        -- than concurrency are ever running.
+                        if _complete(i, nil, "timeout") and
+                            kwargs.on_task_timeout then
+                            kwargs.on_task_timeout(i)
+                        end
+                    end)
+            end
+            local ok, res = pcall(funcs[i])
+            if ok and instanceOf(coctx.CoroutineContext, res) then
+                res = coroutine.yield(res)
+            end
+            if task_ref then
+                io:remove_timeout(task_ref)
+            end
+            -- Discarded if it timed out.
+            if ok then
+                _complete(i, res)
+            else
+                _complete(i, nil, res)
+            end
+            state.running[i] = nil
+        end
+    end
+
+    if n == 0 then
+        io:add_callback(_finish)
+        return ctx
+    end
+    if kwargs.timeout then
+        state.timeout_ref = io:add_timeout(
+            util.gettimemonotonic() + kwargs.timeout * 1000,
+            function()
+                state.timeout_ref = nil
+                for i = 1, n do
+                    if not state.completed[i] then
+                        errs[i] = "timeout"
+                    end
+                end
+                if kwargs.on_timeout then
+                    kwargs.on_timeout(state.running)
+                end
+                _finish()
+            end)
+    end
+    local concurrency = math.min(kwargs.concurrency or n, n)
+    for _ = 1, concurrency do
+        io:add_callback(_worker)
+    end
+    return ctx
+end
+
+--- Fetch multiple URLs concurrently.
+-- Requests are spread on a pool of at most ``concurrency`` HTTPClient
+-- instances. Unless disabled per request, connections are kept alive and
+-- reused for later requests to the same host.
+--
+-- Usage:
+-- local responses = coroutine.yield(turbo.async.fetch_many({
+--      "http://a.example/",
+--      {url = "http://b.example/", method = "POST", body = "hello"}
+-- }, {concurrency = 8, request_timeout = 5, timeout = 30}))
+--
+-- @param requests (Table) List of URL strings, or tables with a ``url``
+-- member and any HTTPClient:fetch keyword arguments.
+-- @param kwargs (Table) Optional keyword arguments
+-- ** Available options **
+-- ``concurrency`` = Maximum number of requests in flight. Default is 10.
+-- ``request_timeout`` = Default per request timeout in seconds.
+-- ``connect_timeout`` = Default connect timeout in seconds.
+-- ``timeout`` = Timeout in seconds for the whole operation. Requests still in
+-- flight are aborted and requests not started are not sent.
+-- ``ssl_options`` = SSL options for the HTTPClient instances.
+-- ``max_buffer_size`` = Maximum buffer size for the HTTPClient instances.
+-- ``io_loop`` = IOLoop to use. Default is the global instance.
+-- @return (CoroutineContext) Resumes the yielding coroutine with a table of
+-- HTTPResponse instances in the same order as requests. Failed requests have
+-- the error member set.
+function async.fetch_many(requests, kwargs)
+    kwargs = kwargs or {}
+    local io = kwargs.io_loop or ioloop.instance()
+    local ctx = coctx.CoroutineContext(io)
+    ctx:set_state(coctx.states.WORKING)
+    local n = #requests
+    local concurrency = math.min(kwargs.concurrency or 10, n)
+    local idle = {}
+    local busy = {}
+    local aborted = false
+
+    local function _client()
+        local client = table.remove(idle)
+        if not client then
+            client = async.HTTPClient(kwargs.ssl_options,
+                                      io,
+                                      kwargs.max_buffer_size)
+        end
+        return client
+    end
+
+    local funcs = {}
+    for i = 1, n do
+        local req = requests[i]
+        funcs[i] = function()
+            local url, fetch_kwargs = req, {}
+            if type(req) == "table" then
+                for k, v in pairs(req) do
+                    fetch_kwargs[k] = v
+                end
+                url = req.url
+                fetch_kwargs.url = nil
+            end
+            if fetch_kwargs.keep_alive == nil then
+                fetch_kwargs.keep_alive = true
+            end
+            fetch_kwargs.request_timeout =
+                fetch_kwargs.request_timeout or kwargs.request_timeout
+            fetch_kwargs.connect_timeout =
+                fetch_kwargs.connect_timeout or kwargs.connect_timeout
+            local client = _client()
+            busy[i] = client
+            local res = coroutine.yield(client:fetch(url, fetch_kwargs))
+            busy[i] = nil
+            if aborted then
+                if client.iostream then
+                    client.iostream:close()
+                end
+            else
+                idle[#idle + 1] = client
+            end
+            return res
+        end
+    end
+
+    io:add_callback(function()
+        local results, errs = coroutine.yield(async.gather(funcs, {
+            concurrency = concurrency,
+            timeout = kwargs.timeout,
+            io_loop = io,
+            on_timeout = function()
+                aborted = true
+                for _, client in pairs(busy) do
+                    client:cancel(errors.REQUEST_TIMEOUT,
+                                  "Aborted, fetch_many timed out.")
+                end
+            end
+        }))
+        aborted = true
+        for i = 1, n do
+            if errs[i] then
+                local res = async.HTTPResponse()
+                if errs[i] == "timeout" then
+                    res.error = {
+                        code = errors.REQUEST_TIMEOUT,
+                        message = "fetch_many timed out."
+                    }
+                else
+                    res.error = {
+                        code = errors.SOCKET_ERROR,
+                        message = tostring(errs[i])
+                    }
+                end
+                results[i] = res
+            end
+        end
+        for _, client in ipairs(idle) do
+            if client.iostream then
+                client.iostream:close()
+                client.iostream = nil
+            end
+        end
+        ctx:set_state(coctx.states.DEAD)
+        ctx:set_arguments({results})
+        ctx:finalize_context()
+    end)
+    return ctx
+end
+
 
 return async
@@ -404,6 +404,24 @@ if platform.__LINUX__ then
         int open(const char *pathname, int flags);
         int close(int fd);
         int fstat(int fd, struct stat *buf);
+        int64_t lseek64(int fd, int64_t offset, int whence);
+        ssize_t pread64(int fd, void *buf, size_t count, int64_t offset);
+        ssize_t sendfile64(int out_fd, int in_fd, int64_t *offset, size_t count);
+        int pipe2(int pipefd[2], int flags);
+        ssize_t splice(
+            int fd_in,
+            int64_t *off_in,
+            int fd_out,
+            int64_t *off_out,
+            size_t len,
+            unsigned int flags);
+        /* Same layout as struct iovec, with a const base so Lua strings can
+           be used directly. */
+        struct turbo_iovec {
+            const void *iov_base;
+            size_t iov_len;
+        };
+        ssize_t writev(int fd, const struct turbo_iovec *iov, int iovcnt);
     ]]
 
     -- stat structure is architecture dependent in Linux
@@ -762,6 +780,49 @@ if _G.TURBO_SSL then
 end
 
 
+--- ******* zlib *******
+ffi.cdef[[
+    typedef struct z_stream_s {
+        const unsigned char *next_in;
+        unsigned int avail_in;
+        unsigned long total_in;
+        unsigned char *next_out;
+        unsigned int avail_out;
+        unsigned long total_out;
+        const char *msg;
+        void *state;
+        void *zalloc;
+        void *zfree;
+        void *opaque;
+        int data_type;
+        unsigned long adler;
+        unsigned long reserved;
+    } z_stream;
+
+    const char *zlibVersion(void);
+    int inflateInit2_(
+        z_stream *strm,
+        int windowBits,
+        const char *version,
+        int stream_size);
+    int inflate(z_stream *strm, int flush);
+    int inflateReset(z_stream *strm);
+    int inflateEnd(z_stream *strm);
+    int deflateInit2_(
+        z_stream *strm,
+        int level,
+        int method,
+        int windowBits,
+        int memLevel,
+        int strategy,
+        const char *version,
+        int stream_size);
+    int deflate(z_stream *strm, int flush);
+    int deflateReset(z_stream *strm);
+    int deflateEnd(z_stream *strm);
+]]
+
+
 --- ******* HTTP parser and libtffi *******
 ffi.cdef[[
     enum http_parser_url_fields{
@@ -846,5 +907,82 @@ ffi.cdef[[
         const char *mask32,
         const char *in,
         size_t sz);
+    void turbo_websocket_mask_inplace(
+        char *buf,
+        const char *mask32,
+        size_t sz);
+    struct turbo_ws_frame {
+        uint8_t flags;
+        uint8_t masked;
+        uint64_t offset;
+        uint64_t len;
+    };
+    int32_t turbo_websocket_parse_frames(
+        char *buf,
+        size_t sz,
+        struct turbo_ws_frame *frames,
+        int32_t max_frames,
+        size_t *consumed,
+        uint64_t *need);
+    struct turbo_utf8_state {
+        uint8_t len;
+        uint8_t bytes[4];
+    };
+    int32_t turbo_utf8_validate(
+        const char *buf,
+        size_t sz,
+        struct turbo_utf8_state *state);
     uint64_t turbo_bswap_u64(uint64_t swap);
+    struct turbo_slab_stats {
+        uint64_t slab_bytes;
+        uint64_t used_bytes;
+        uint64_t large_bytes;
+    };
+    void *turbo_slab_alloc(size_t sz, size_t *got);
+    void turbo_slab_free(void *p, size_t sz);
+    void *turbo_slab_realloc(void *p, size_t old_sz, size_t sz, size_t *got);
+    void turbo_slab_get_stats(struct turbo_slab_stats *stats);
+    struct turbo_pattern_match {
+        size_t start;
+        size_t end;
+        size_t resume;
+    };
+    int32_t turbo_pattern_find(
+        const char *pat,
+        size_t pat_len,
+        const char *buf,
+        size_t sz,
+        size_t init,
+        struct turbo_pattern_match *m);
+    struct turbo_searcher {
+        size_t offset;
+        size_t len;
+        char needle[?];
+    };
+    int32_t turbo_searcher_find(
+        struct turbo_searcher *s,
+        const char *buf,
+        size_t sz,
+        size_t *pos);
+    struct turbo_bus;
+    struct turbo_bus *turbo_bus_create(int32_t rings, uint64_t ring_size);
+    int32_t turbo_bus_claim(struct turbo_bus *bus, int32_t ring, int32_t pid);
+    int32_t turbo_bus_eventfd(struct turbo_bus *bus, int32_t ring);
+    int32_t turbo_bus_publish(
+        struct turbo_bus *bus,
+        int32_t ring,
+        const char *topic,
+        size_t topic_len,
+        const char *data,
+        size_t data_len);
+    uint64_t turbo_bus_next(
+        struct turbo_bus *bus,
+        int32_t ring,
+        const char **topic,
+        size_t *topic_len,
+        const char **data,
+        size_t *data_len);
+    void turbo_bus_consume(struct turbo_bus *bus, int32_t ring, uint64_t rec);
+    int32_t turbo_bus_wait(struct turbo_bus *bus, int32_t ring);
+    uint64_t turbo_bus_dropped(struct turbo_bus *bus, int32_t ring);
 ]]
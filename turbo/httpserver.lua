@@ -71,7 +71,9 @@ httpserver.HTTPServer = class('HTTPServer', tcpserver.TCPServer)
 --      true. If set to false, the user must read the body from the connection
 --      himself. Not reading a body in the case of a keep-alive request may
 --      lead to undefined behaviour. The body should be read or connection
---      closed.
+--      closed. May also be a function, called with the HTTPRequest, that
+--      returns false for requests whose body is read by the request callback,
+--      e.g to stream it elsewhere.
 -- "max_header_size" = The maximum amount of bytes a header can be.
 --      If exceeded, request is dropped.
 -- "max_body_size" = The maxium amount of bytes a request body can be.
@@ -237,7 +239,11 @@ function httpserver.HTTPConnection:_on_headers(data)
             self.stream.close, self.stream)
         return
     end
-    if self.kwargs.read_body ~= false then
+    local read_body = self.kwargs.read_body
+    if type(read_body) == "function" then
+        read_body = read_body(self._request)
+    end
+    if read_body ~= false then
         local content_length = headers:get("Content-Length")
         if content_length then
             content_length = tonumber(content_length)
@@ -370,6 +370,21 @@ function httputil.HTTPParser:get(key, caseinsensitive)
     return value, c
 end
 
+--- Get all header fields, in the order they were received.
+-- @return (Table) List of {key, value} tables.
+function httputil.HTTPParser:get_fields()
+    local fields = {}
+    local hdr_sz = tonumber(self.tpw.hkv_sz)
+    for i = 0, hdr_sz - 1 do
+        local field = self.tpw.hkv[i]
+        fields[i + 1] = {
+            ffi.string(field.key, field.key_sz),
+            ffi.string(field.value, field.value_sz)
+        }
+    end
+    return fields
+end
+
 --- Parse HTTP request or response headers.
 -- Populates the class with all data in headers.
 -- @param hdr_str (String) HTTP header string.
@@ -599,7 +614,10 @@ function httputil.StreamingParser:initialize(serverhandle)
         self.close_boundary_ptr = ffi.cast("char*", close_boundary)
         self.next_boundary_size = #next_boundary
         self.close_boundary_size = #close_boundary
-
+        self.begin_boundary_searcher = util.searcher(begin_boundary)
+        self.next_boundary_searcher = util.searcher(next_boundary)
+        self.close_boundary_searcher = util.searcher(close_boundary)
+        self.headers_end_searcher = util.searcher("\r\n\r\n")
     end
 
     self.consumed_bytes = 0
@@ -626,7 +644,7 @@ function httputil.StreamingParser:initialize(serverhandle)
 end
 
 function httputil.StreamingParser:load_chunk(chunk)
-    self.streaming_buffer:append_right(chunk.ptr, chunk.len)
+    self.streaming_buffer:append_right(chunk:get())
     self._ptr, self._len = self.streaming_buffer:get()
     self._used = 0
     self._total_get = self._total_get + self._len
@@ -643,6 +661,13 @@ end
 function httputil.StreamingParser:shift(bytes)
     self._used = self._used + bytes
     self._total_used = self._total_used + bytes
+    -- Searches that failed were relative to the old start of unused data.
+    if self.boundary then
+        self.begin_boundary_searcher:reset()
+        self.next_boundary_searcher:reset()
+        self.close_boundary_searcher:reset()
+        self.headers_end_searcher:reset()
+    end
 end
 
 function httputil.StreamingParser:substrbytes(bytes)
@@ -658,6 +683,13 @@ function httputil.StreamingParser:strfind(fstr, flen)
     end
 end
 
+--- Find a delimiter in the unused data with a searcher prepared in the
+-- constructor. Data searched already is not scanned again when a search
+-- fails and is retried after the next chunk is loaded.
+function httputil.StreamingParser:find(searcher)
+    return searcher:find(self:unused(), self:unused_len())
+end
+
 function httputil.StreamingParser:possible_boundary()
     local boundary = self.next_boundary_ptr
     local boundary_size = self.next_boundary_size
@@ -713,7 +745,7 @@ function httputil.StreamingParser:parse_large_multipart_body(chunk)
 end
 
 function httputil.StreamingParser:_state_begin_boundary()
-    local start_offset = self:strfind(self.begin_boundary_ptr, self.next_boundary_size -2)
+    local start_offset = self:find(self.begin_boundary_searcher)
     if start_offset then
         -- ignore all data before begin boundary
         self:shift(self.next_boundary_size -2)
@@ -724,7 +756,7 @@ function httputil.StreamingParser:_state_begin_boundary()
 end
 
 function httputil.StreamingParser:_state_part_headers()
-    local start_offset = self:strfind(ffi.cast("char*", "\r\n\r\n"), 4)
+    local start_offset = self:find(self.headers_end_searcher)
     if start_offset ~= nil then
         if start_offset > 512 then error("part header too long") end
         self:_push_streaming_multipart_headers(self:substrbytes(start_offset))
@@ -751,8 +783,8 @@ end
 
 function httputil.StreamingParser:_state_part_body()
     local boundary_size = self.next_boundary_size
-    local nb_start_offset = self:strfind(self.next_boundary_ptr, self.next_boundary_size)
-    local cb_start_offset = self:strfind(self.close_boundary_ptr, self.close_boundary_size)
+    local nb_start_offset = self:find(self.next_boundary_searcher)
+    local cb_start_offset = self:find(self.close_boundary_searcher)
     local is_large_body = false
     if self:unused_len() >= self.large_body_bytes then
         if nb_start_offset then
@@ -799,8 +831,8 @@ end
 
 function httputil.StreamingParser:_state_part_large_body()
     local boundary_size = self.next_boundary_size
-    local nb_start_offset = self:strfind(self.next_boundary_ptr, self.next_boundary_size)
-    local cb_start_offset = self:strfind(self.close_boundary_ptr, self.close_boundary_size)
+    local nb_start_offset = self:find(self.next_boundary_searcher)
+    local cb_start_offset = self:find(self.close_boundary_searcher)
     local tmpname = self._tmpname
     if not tmpname then
         tmpname = os.tmpname()
@@ -122,7 +122,7 @@ function ioloop.IOLoop:add_handler(fd, events, handler, arg)
                 socket.strerror(errno)))
         return false
     end
-    self._handlers[fd] = {handler, arg}
+    self._handlers[fd] = {handler, arg, events}
     return true
 end
 
@@ -140,9 +140,28 @@ function ioloop.IOLoop:update_handler(fd, events)
                 socket.strerror(errno)))
         return false
     end
+    if self._handlers[fd] then
+        self._handlers[fd][3] = events
+    end
     return true
 end
 
+--- Give a forked child process its own poll instance. A epoll instance
+-- inherited over fork is shared with the parent, so events would be reported
+-- to whichever process polls first. Handlers added before fork are
+-- registered again with the new instance.
+function ioloop.IOLoop:reinit_poll()
+    if _poll_implementation ~= "epoll_ffi" then
+        return
+    end
+    local old = self._poll
+    self._poll = _EPoll_FFI()
+    ffi.C.close(old._epoll_fd)
+    for fd, handler in pairs(self._handlers) do
+        self._poll:register(fd, bit.bor(handler[3], ioloop.ERROR))
+    end
+end
+
 --- Remove a existing handler from the IO Loop.
 -- @param fd (Number) File descriptor to remove handler from.
 -- @return (Boolean) true if successfull else false.
@@ -521,6 +540,7 @@ function ioloop.IOLoop:_run_handler(fd, events)
     end
     -- handler[1] = function.
     -- handler[2] = optional first argument for function.
+    -- handler[3] = events registered for fd.
     -- If there is no optional argument, do not add it as parameter to the
     -- function as that creates a big nuisance for consumers of the API.
     local func = handler[1]
@@ -26,6 +26,8 @@ local log =         require "turbo.log"
 local ioloop =      require "turbo.ioloop"
 local deque =       require "turbo.structs.deque"
 local buffer =      require "turbo.structs.buffer"
+local bufferpool =  require "turbo.structs.bufferpool"
+local bufferptr =   require "turbo.structs.bufferptr"
 local socket =      require "turbo.socket_ffi"
 local sockutils =   require "turbo.sockutil"
 local util =        require "turbo.util"
@@ -63,16 +65,30 @@ end
 
 local bitor, bitand, min, max =  bit.bor, bit.band, math.min, math.max
 local C = ffi.C
+local libtffi = util.load_libtffi()
+local _pattern_match = ffi.new("struct turbo_pattern_match")
 
 -- __Global value__ _G.TURBO_SOCKET_BUFFER_SZ allows the user to set
 -- his own socket buffer size to be used by the module. Defaults to
 -- (16384+1024) bytes, which is the default max used by axTLS.
 _G.TURBO_SOCKET_BUFFER_SZ = _G.TURBO_SOCKET_BUFFER_SZ or (16384+1024)
 local TURBO_SOCKET_BUFFER_SZ =  _G.TURBO_SOCKET_BUFFER_SZ
-local buf
-if platform.__LINUX__  and not _G.__TURBO_USE_LUASOCKET__ then
-    buf = ffi.new("char[?]", TURBO_SOCKET_BUFFER_SZ)
-end
+-- Reads go straight into the tail of the read buffer. The size of each read
+-- starts at READ_SIZE_MIN and doubles up to READ_SIZE_MAX while reads fill
+-- it, so large transfers take fewer syscalls. It is halved again when reads
+-- come back mostly empty.
+local READ_SIZE_MIN = 1024*4
+local READ_SIZE_MAX = 1024*256
+-- Bytes read per readiness event before other streams get a turn.
+local READ_BUDGET = 1024*1024
+-- Read buffers that grew larger than READ_BUFFER_KEEP during a burst are
+-- released once the stream has had nothing to read for READ_BUFFER_IDLE
+-- msecs.
+local READ_BUFFER_KEEP = 1024*64
+local READ_BUFFER_IDLE = 1000
+-- Default write watermarks, see IOStream:set_write_watermarks.
+local WRITE_HIGH_WATERMARK = 1024*1024
+local WRITE_LOW_WATERMARK = 1024*256
 
 local iostream = {} -- iostream namespace
 
@@ -100,13 +116,17 @@ function iostream.IOStream:initialize(fd, io_loop, max_buffer_size, args)
     self.io_loop = io_loop or ioloop.instance()
     self.max_buffer_size = max_buffer_size or 1024*1024*128
     self.args = args or {}
-    self._read_buffer = buffer(1024)
+    self._read_buffer = bufferpool.acquire(1024)
+    self._read_size = READ_SIZE_MIN
+    self._reads = 0
     self._read_buffer_size = 0
     self._read_buffer_offset = 0
     self._read_scan_offset = 0
-    self._write_buffer = buffer(1024)
+    self._write_buffer = bufferpool.acquire(1024)
     self._write_buffer_size = 0
     self._write_buffer_offset = 0
+    self._write_high = WRITE_HIGH_WATERMARK
+    self._write_low = WRITE_LOW_WATERMARK
     self._pending_callbacks = 0
     self._read_until_close = false
     self._connecting = false
@@ -147,6 +167,10 @@ if platform.__LINUX__ and not _G.__TURBO_USE_LUASOCKET__ then
             self:_handle_connect_fail(err or "DNS resolv error")
             return
         end
+        if not self.socket then
+            -- Closed while resolving.
+            return
+        end
         local ai, err = sockutils.connect_addrinfo(
                 self.socket, servinfo)
         if not ai then
@@ -193,16 +217,46 @@ end
 -- be the first argument for the callback and the data will be the second.
 function iostream.IOStream:read_until(delimiter, callback, arg)
     assert((not self._read_callback), "Already reading.")
-    self._read_delimiter = delimiter
+    self:_set_read_delimiter(delimiter)
     self._read_callback = callback
     self._read_callback_arg = arg
-    self._read_scan_offset = 0
     self._raw_buffer = false
     self:_initial_read()
 end
 
+--- Like read_until, but the callback receives a BufferPtr slice of the read
+-- buffer instead of a string. Nothing is copied, the slice is valid until
+-- the next read on the stream. Use tostring() on it when a string is
+-- needed.
+-- @param delimiter (String) Delimiter sequence, text or binary.
+-- @param callback (Function) Callback function.
+-- @param arg Optional argument for callback.
+function iostream.IOStream:read_until_raw_buffer(delimiter, callback, arg)
+    assert((not self._read_callback), "Already reading.")
+    self:_set_read_delimiter(delimiter)
+    self._read_callback = callback
+    self._read_callback_arg = arg
+    self._raw_buffer = true
+    self:_initial_read()
+end
+
+--- Set the delimiter of a read_until. The searcher of the previous
+-- delimiter is reused when it is the same, which it mostly is.
+function iostream.IOStream:_set_read_delimiter(delimiter)
+    local searcher = self._read_searcher
+    if searcher and self._read_searcher_delimiter == delimiter then
+        searcher:reset()
+    else
+        self._read_searcher = util.searcher(delimiter)
+        self._read_searcher_delimiter = delimiter
+    end
+    self._read_delimiter = delimiter
+end
+
 --- Read until pattern is matched, then call callback with receive data.
--- The callback receives the data read as a parameter. If you only are
+-- The callback receives the data read as a parameter, up to and including
+-- the match. The pattern is matched on the read buffer as string.find
+-- would, "^" anchors it to the start of the unread data. If you only are
 -- doing plain text matching then using read_until is recommended for
 -- less overhead.
 -- @param pattern (String) Lua pattern string.
@@ -246,6 +300,17 @@ function iostream.IOStream:read_bytes(num_bytes, callback, arg,
     self:_initial_read()
 end
 
+--- Like read_bytes, but callbacks receive BufferPtr slices of the read buffer
+-- instead of strings. Nothing is copied. The slice given to callback is
+-- valid until the next read on the stream, those given to
+-- streaming_callback until it returns. Use tostring() on a slice when a
+-- string is needed.
+-- @param num_bytes (Number) The amount of bytes to read.
+-- @param callback (Function) Callback function.
+-- @param arg Optional argument for callback.
+-- @param streaming_callback (Function) Optional callback to be called as
+-- chunks become available.
+-- @param streaming_arg Optional argument for streaming_callback.
 function iostream.IOStream:read_bytes_raw_buffer(num_bytes, callback, arg,
     streaming_callback, streaming_arg)
     assert((not self._read_callback), "Already reading.")
@@ -260,8 +325,57 @@ function iostream.IOStream:read_bytes_raw_buffer(num_bytes, callback, arg,
     self:_initial_read()
 end
 
+--- Call callback when we read the given number of bytes, after letting
+-- transform modify them in place in the read buffer. This avoids a extra
+-- copy for data that must be decoded before use, e.g masked WebSocket frames.
+-- @param num_bytes (Number) The amount of bytes to read.
+-- @param transform (Function) Called as transform(transform_arg, ptr, len)
+-- with a char pointer to the bytes, before the string given to callback is
+-- created. The pointer must not be kept.
+-- @param transform_arg Argument for transform.
+-- @param callback (Function) Callback function.
+-- @param arg Optional argument for callback. If arg is given then it will
+-- be the first argument for the callback and the data will be the second.
+function iostream.IOStream:read_bytes_transform(num_bytes, transform,
+    transform_arg, callback, arg)
+    assert((not self._read_callback), "Already reading.")
+    assert(type(num_bytes) == 'number',
+        'argument #1, num_bytes, is not a number')
+    self._read_bytes = num_bytes
+    self._read_callback = callback
+    self._read_callback_arg = arg
+    self._read_transform = transform
+    self._read_transform_arg = transform_arg
+    self._raw_buffer = false
+    self:_initial_read()
+end
+
 
 
+--- Read with a custom decoder. Whenever data is available decoder is called
+-- with the buffered data, until it returns a result. Decoding is done
+-- synchronously on the read buffer, so many small messages can be parsed
+-- in one pass without a callback per message.
+-- @param decoder (Function) Called as decoder(decoder_arg, ptr, len) with a
+-- char pointer to the buffered data. Must return the number of bytes it
+-- consumed and a non-nil result when done. Otherwise return 0, nil and
+-- optionally the total number of buffered bytes needed before it should be
+-- called again. The pointer must not be kept.
+-- @param decoder_arg Argument for decoder.
+-- @param callback (Function) Called with the result.
+-- @param arg Optional argument for callback. If arg is given then it will
+-- be the first argument for the callback and the result will be the second.
+function iostream.IOStream:read_decoded(decoder, decoder_arg, callback, arg)
+    assert((not self._read_callback), "Already reading.")
+    self._read_decoder = decoder
+    self._read_decoder_arg = decoder_arg
+    self._read_decoder_need = 1
+    self._read_callback = callback
+    self._read_callback_arg = arg
+    self._raw_buffer = false
+    self:_initial_read()
+end
+
 --- Reads all data from the socket until it is closed.
 -- If a streaming_callback argument is given, it will be called with chunks of
 -- data as they become available, and the argument to the final call to
@@ -280,17 +394,44 @@ function iostream.IOStream:read_until_close(callback, arg, streaming_callback,
     if self._read_callback then
         error("Already reading.")
     end
+    self._raw_buffer = false
+    self:_start_read_until_close(callback, arg, streaming_callback,
+        streaming_arg)
+end
+
+--- Like read_until_close, but callbacks receive BufferPtr slices of the read
+-- buffer instead of strings. Nothing is copied. The slice given to callback
+-- is valid until the next read on the stream, those given to
+-- streaming_callback until it returns. Use tostring() on a slice when a
+-- string is needed.
+-- @param callback (Function) Callback function.
+-- @param arg Optional argument for callback.
+-- @param streaming_callback (Funcion) Optional callback to be called as
+-- chunks become available.
+-- @param streaming_arg Optional argument for streaming_callback.
+function iostream.IOStream:read_until_close_raw_buffer(callback, arg,
+    streaming_callback, streaming_arg)
+    if self._read_callback then
+        error("Already reading.")
+    end
+    self._raw_buffer = true
+    self:_start_read_until_close(callback, arg, streaming_callback,
+        streaming_arg)
+end
+
+function iostream.IOStream:_start_read_until_close(callback, arg,
+    streaming_callback, streaming_arg)
     if self:closed() then
         self:_run_callback(callback, arg,
             self:_consume(self._read_buffer_size))
         return
     end
+    self:_unpin_read_buffer()
     self._read_until_close = true
     self._read_callback = callback
     self._read_callback_arg = arg
     self._streaming_callback = streaming_callback
     self._streaming_callback_arg = streaming_arg
-    self._raw_buffer = false
     self:_add_io_state(ioloop.READ)
 end
 
@@ -303,13 +444,17 @@ end
 -- @param callback (Function) Optional callback to call when chunk is flushed.
 -- @param arg Optional argument for callback.
 function iostream.IOStream:write(data, callback, arg)
-    if self._const_write_buffer then
+    if self._const_write_buffer and not self._const_write_shared then
         error(string.format("\
             Can not perform write when there is a ongoing \
             zero copy write operation. At offset %d of %d bytes",
             tonumber(self._write_buffer_offset),
             tonumber(self._const_write_buffer:len())))
     end
+    if self._write_file then
+        error("Can not perform write when there is a ongoing \
+            write_file operation.")
+    end
     self:_check_closed()
     self._write_buffer:append_luastr_right(data)
     self._write_buffer_size = self._write_buffer_size + data:len()
@@ -317,6 +462,27 @@ function iostream.IOStream:write(data, callback, arg)
     self._write_callback_arg = arg
     self:_add_io_state(ioloop.WRITE)
     self:_maybe_add_error_listener()
+    self:_check_write_pressure()
+end
+
+--- Write the given data to the stream, letting transform modify the copy in
+-- the write buffer in place. E.g for WebSocket masking without a temporary
+-- string.
+-- @param data (String) Data to write to stream.
+-- @param transform (Function) Called as transform(transform_arg, ptr, len)
+-- with a char pointer to the buffered copy of data. The pointer must not be
+-- kept.
+-- @param transform_arg Argument for transform.
+-- @param callback (Function) Optional callback to call when chunk is flushed.
+-- @param arg Optional argument for callback.
+function iostream.IOStream:write_transform(data, transform, transform_arg,
+    callback, arg)
+    self:write(data, callback, arg)
+    local sz = data:len()
+    if sz ~= 0 then
+        local ptr, len = self._write_buffer:get()
+        transform(transform_arg, ptr + (len - sz), sz)
+    end
 end
 
 --- Write the given buffer class instance to the stream.
@@ -324,21 +490,26 @@ end
 -- @param callback (Function) Optional callback to call when chunk is flushed.
 -- @param arg Optional argument for callback.
 function iostream.IOStream:write_buffer(buf, callback, arg)
-    if self._const_write_buffer then
+    if self._const_write_buffer and not self._const_write_shared then
         error(string.format("\
             Can not perform write when there is a ongoing \
             zero copy write operation. At offset %d of %d bytes",
             tonumber(self._write_buffer_offset),
             tonumber(self._const_write_buffer:len())))
     end
+    if self._write_file then
+        error("Can not perform write when there is a ongoing \
+            write_file operation.")
+    end
     self:_check_closed()
     local ptr, sz = buf:get()
     self._write_buffer:append_right(ptr, sz)
-    self._write_buffer_size = self._write_buffer_size + sz
+    self._write_buffer_size = self._write_buffer_size + tonumber(sz)
     self._write_callback = callback
     self._write_callback_arg = arg
     self:_add_io_state(ioloop.WRITE)
     self:_maybe_add_error_listener()
+    self:_check_write_pressure()
 end
 
 --- Write the given buffer class instance to the stream without
@@ -369,6 +540,7 @@ if platform.__LINUX__ and not _G.__TURBO_USE_LUASOCKET__ then
         self._write_callback_arg = arg
         self:_add_io_state(ioloop.WRITE)
         self:_maybe_add_error_listener()
+        self:_check_write_pressure()
     end
 else
     -- write_zero_copy is not supported on LuaSocket. It gives no
@@ -389,6 +561,672 @@ else
     end
 end
 
+--- Write a list of strings to the stream. If the stream is idle they are
+-- sent right away with writev(2) without first being copied into the write
+-- buffer, and only what the socket does not accept is buffered. Otherwise they
+-- are appended to the write buffer.
+-- @param strs (Table) List of strings.
+-- @param callback (Function) Optional callback to call when all buffered
+-- write data is flushed.
+-- @param arg Optional argument for callback.
+function iostream.IOStream:writev(strs, callback, arg)
+    if self._const_write_buffer and not self._const_write_shared then
+        error("Can not perform write when there is a ongoing \
+            zero copy write operation.")
+    end
+    if self._write_file then
+        error("Can not perform write when there is a ongoing \
+            write_file operation.")
+    end
+    self:_check_closed()
+    local first = 1
+    if self._can_writev and not self:writing() then
+        first = self:_writev_direct(strs)
+        if not first then
+            -- Stream closed.
+            return
+        end
+    end
+    for i = first, #strs do
+        self._write_buffer:append_luastr_right(strs[i])
+        self._write_buffer_size = self._write_buffer_size + strs[i]:len()
+    end
+    self._write_callback = callback
+    self._write_callback_arg = arg
+    self:_add_io_state(ioloop.WRITE)
+    self:_maybe_add_error_listener()
+    self:_check_write_pressure()
+end
+
+--- Write a buffer that is shared with other streams, e.g a broadcast
+-- message. If the stream is idle the buffer is sent from directly without
+-- copying, and unlike write_zero_copy other writes can be queued behind it.
+-- A busy stream copies it into the write buffer like write_buffer.
+-- @param buf (Buffer class instance) Must not be modified until all streams
+-- are done with it.
+-- @param callback (Function) Optional callback to call when buffer is flushed.
+-- @param arg Optional argument for callback.
+function iostream.IOStream:write_shared(buf, callback, arg)
+    if self:writing() then
+        self:write_buffer(buf, callback, arg)
+        return
+    end
+    self:write_zero_copy(buf, callback, arg)
+    if self._const_write_buffer then
+        self._const_write_shared = true
+    end
+end
+
+--- Get the number of bytes waiting to be written to the stream.
+-- @return (Number) Bytes.
+function iostream.IOStream:pending_write_bytes()
+    local bytes = tonumber(self._write_buffer_size)
+    if self._const_write_buffer then
+        bytes = bytes + tonumber(self._const_write_buffer:len() -
+                                 self._write_buffer_offset)
+    end
+    return bytes
+end
+
+--- Get the memory held by the read and write buffers of the stream.
+-- They go back to turbo.structs.bufferpool once the stream is closed.
+-- Read buffers grown by a burst are released after the stream goes idle.
+-- @return (Number) Bytes allocated for the read buffer and for the write
+-- buffer.
+function iostream.IOStream:buffer_memory()
+    if not self._read_buffer then
+        return 0, 0
+    end
+    return tonumber(self._read_buffer:mem()), tonumber(self._write_buffer:mem())
+end
+
+--- Set the write watermarks of the stream. Writes are never refused, but
+-- once more than high bytes are waiting to be written the stream is under
+-- write pressure: writable() returns false and the pressure callback runs.
+-- When it has drained to low bytes or less, the drain callback runs and
+-- wait_writable() callers resume. Producers use these to pause instead of
+-- queueing without limit for a slow peer. Defaults are 1MB and 256KB.
+-- @param high (Number) High watermark in bytes.
+-- @param low (Number) Low watermark in bytes. Defaults to a quarter of high.
+function iostream.IOStream:set_write_watermarks(high, low)
+    assert(type(high) == "number" and high > 0,
+        "High watermark is not a positive number.")
+    low = low or math.floor(high / 4)
+    assert(type(low) == "number" and low >= 0 and low <= high,
+        "Low watermark is not a number between 0 and the high watermark.")
+    self._write_high = high
+    self._write_low = low
+    self:_check_write_pressure()
+end
+
+--- Set callback to be called when the stream comes under write pressure,
+-- see set_write_watermarks.
+-- @param callback (Function) Callback function.
+-- @param arg Optional argument for callback.
+function iostream.IOStream:set_pressure_callback(callback, arg)
+    self._pressure_callback = callback
+    self._pressure_callback_arg = arg
+end
+
+--- Set callback to be called when a stream under write pressure has
+-- drained to its low watermark, see set_write_watermarks.
+-- @param callback (Function) Callback function.
+-- @param arg Optional argument for callback.
+function iostream.IOStream:set_drain_callback(callback, arg)
+    self._drain_callback = callback
+    self._drain_callback_arg = arg
+end
+
+--- Is the stream open and not under write pressure?
+-- @return (Boolean) true or false
+function iostream.IOStream:writable()
+    return self.socket ~= nil and not self._write_pressure
+end
+
+local function _resume_write_waiter(ctx, writable)
+    ctx:set_arguments({writable})
+    ctx:finalize_context()
+end
+
+--- Wait until the stream is not under write pressure. Without a callback
+-- the running coroutine is suspended, e.g in a RequestHandler, and this
+-- returns when the stream is writable.
+-- @param callback (Function) Optional callback, called with true when the
+-- stream is writable or false if it was closed.
+-- @param arg Optional argument for callback.
+-- @return (Boolean) Without callback: true if the stream is writable, false
+-- if it was closed.
+function iostream.IOStream:wait_writable(callback, arg)
+    if not callback then
+        if not self._write_pressure or not self.socket then
+            return self.socket ~= nil
+        end
+        local ctx = coctx.CoroutineContext(self.io_loop)
+        self:wait_writable(_resume_write_waiter, ctx)
+        return coroutine.yield(ctx)
+    end
+    if not self._write_pressure or not self.socket then
+        self:_run_callback(callback, arg, self.socket ~= nil)
+        return
+    end
+    local waiters = self._write_waiters
+    if not waiters then
+        waiters = {}
+        self._write_waiters = waiters
+    end
+    waiters[#waiters + 1] = {callback, arg}
+end
+
+--- Run the write waiters.
+function iostream.IOStream:_wake_write_waiters(writable)
+    local waiters = self._write_waiters
+    self._write_waiters = nil
+    for i = 1, #waiters do
+        self:_run_callback(waiters[i][1], waiters[i][2], writable)
+    end
+end
+
+--- Enter or leave write pressure after data has been queued or written.
+function iostream.IOStream:_check_write_pressure()
+    if self._write_pressure then
+        if self:pending_write_bytes() <= self._write_low then
+            self._write_pressure = nil
+            if self._drain_callback then
+                self:_run_callback(self._drain_callback,
+                    self._drain_callback_arg)
+            end
+            if self._write_waiters then
+                self:_wake_write_waiters(true)
+            end
+        end
+    elseif self:pending_write_bytes() > self._write_high then
+        self._write_pressure = true
+        if self._pressure_callback then
+            self:_run_callback(self._pressure_callback,
+                self._pressure_callback_arg)
+        end
+    end
+end
+
+-- Bytes moved by a pipe per readiness event before other streams get a
+-- turn.
+local PIPE_BUDGET = 1024*1024
+local SPLICE_F_MOVE = 1
+local SPLICE_F_NONBLOCK = 2
+local O_CLOEXEC = 524288
+local F_GETPIPE_SZ = 1032
+
+--- Moves data from one stream to another, see IOStream:pipe_to. Plain
+-- sockets on Linux are spliced through a kernel pipe, otherwise data is
+-- copied through the read buffer of the source into the write buffer of the
+-- destination.
+local StreamPipe = class("StreamPipe")
+
+function StreamPipe:initialize(src, dst, opts)
+    self.src = src
+    self.dst = dst
+    self.callback = opts.callback
+    self.arg = opts.arg
+    self.remaining = opts.length
+    if opts.close == nil then
+        self.close_dst = opts.length == nil
+    else
+        self.close_dst = opts.close
+    end
+    self.timeout = opts.timeout
+    self.bytes = 0
+    self.pending = 0
+    if opts.splice ~= false and src._can_splice and dst._can_splice then
+        local fds = ffi.new("int[2]")
+        if C.pipe2(fds, bitor(socket.O_NONBLOCK, O_CLOEXEC)) == 0 then
+            self.fds = fds
+            self.capacity = C.fcntl(fds[0], F_GETPIPE_SZ, 0)
+            if self.capacity <= 0 then
+                self.capacity = 65536
+            end
+        end
+    end
+    self._chunk = bufferptr(ffi.cast("char *", ""), 0)
+end
+
+function StreamPipe:_start()
+    local src = self.src
+    src._pipe_out = self
+    self.dst._pipe_in = self
+    if self.timeout then
+        self:_arm_timeout()
+    end
+    -- Data that was read already goes first.
+    self:_forward_buffered()
+    if self.remaining == 0 then
+        self:_finish()
+        return
+    end
+    if src:closed() then
+        self:_source_closed()
+        return
+    end
+    self:_resume_source()
+end
+
+function StreamPipe:_arm_timeout()
+    self._timeout_bytes = self.bytes
+    self._timeout_ref = self.src.io_loop:add_timeout(
+        util.gettimemonotonic() + self.timeout, self._check_timeout, self)
+end
+
+--- Fail the pipe if nothing moved since the timeout was armed.
+function StreamPipe:_check_timeout()
+    self._timeout_ref = nil
+    if self.src._pipe_out ~= self then
+        return
+    end
+    if self.bytes == self._timeout_bytes then
+        self.timed_out = true
+        self:_finish(true)
+        return
+    end
+    self:_arm_timeout()
+end
+
+--- Copy what is in the read buffer of the source to the destination.
+function StreamPipe:_forward_buffered()
+    local src = self.src
+    local sz = src._read_buffer_size
+    if self.remaining then
+        sz = min(sz, self.remaining)
+        self.remaining = self.remaining - sz
+    end
+    if sz == 0 then
+        return
+    end
+    if not self.dst:closed() then
+        local chunk = self._chunk
+        chunk.ptr = src:_get_buffer_ptr()
+        chunk.size = sz
+        self.dst:write_buffer(chunk)
+        self.bytes = self.bytes + sz
+    end
+    src:_discard(sz)
+end
+
+--- Stop reading the source until the destination catches up.
+function StreamPipe:_stall_source()
+    self.src._read_stalled = true
+end
+
+function StreamPipe:_resume_source()
+    local src = self.src
+    src._read_stalled = nil
+    src:_add_io_state(ioloop.READ)
+end
+
+--- Called when the source is readable.
+function StreamPipe:_pump()
+    if self.fds then
+        self:_pump_splice()
+    else
+        self:_pump_copy()
+    end
+end
+
+function StreamPipe:_pump_copy()
+    local src, dst = self.src, self.dst
+    local budget = PIPE_BUDGET
+    while budget > 0 and self.src._pipe_out == self do
+        if not dst:writable() then
+            if not dst:closed() then
+                self:_stall_source()
+                dst:wait_writable(self._drained, self)
+            end
+            return
+        end
+        local sz = src:_read_to_buffer()
+        if self.src._pipe_out ~= self then
+            -- Source was closed and the pipe finished.
+            return
+        end
+        self:_forward_buffered()
+        if self.remaining == 0 then
+            self:_finish()
+            return
+        end
+        if not sz or sz == 0 then
+            return
+        end
+        budget = budget - sz
+    end
+end
+
+--- Called when the destination has drained after write pressure.
+function StreamPipe:_drained(writable)
+    if self.src._pipe_out ~= self then
+        return
+    end
+    if writable then
+        self:_resume_source()
+    else
+        self:_finish(true)
+    end
+end
+
+function StreamPipe:_pump_splice()
+    local src, dst, fds = self.src, self.dst, self.fds
+    local budget = PIPE_BUDGET
+    while budget > 0 do
+        if self.pending ~= 0 then
+            if dst._write_buffer_size ~= 0 or dst._const_write_buffer then
+                -- Buffered writes go first, the pipe resumes when they are
+                -- done.
+                self:_stall_source()
+                return
+            end
+            local n = tonumber(C.splice(fds[0], nil, dst.socket, nil,
+                self.pending, bitor(SPLICE_F_MOVE, SPLICE_F_NONBLOCK)))
+            if n == -1 then
+                local errno = ffi.errno()
+                if errno == EWOULDBLOCK or errno == EAGAIN then
+                    self:_stall_source()
+                    dst:_add_io_state(ioloop.WRITE)
+                    return
+                end
+                log.warning(string.format(
+                    "Pipe from fd %d to fd %d failed. %s",
+                    src.socket or -1, dst.socket, socket.strerror(errno)))
+                self:_finish(true)
+                return
+            end
+            self.pending = self.pending - n
+            self.bytes = self.bytes + n
+            budget = budget - n
+        end
+        if self.eof or self.remaining == 0 then
+            if self.pending == 0 then
+                self:_finish()
+            end
+            return
+        end
+        if self.pending >= self.capacity then
+            self:_stall_source()
+            dst:_add_io_state(ioloop.WRITE)
+            return
+        end
+        local len = self.capacity - self.pending
+        if self.remaining then
+            len = min(len, self.remaining)
+        end
+        local n = tonumber(C.splice(src.socket, nil, fds[1], nil, len,
+            bitor(SPLICE_F_MOVE, SPLICE_F_NONBLOCK)))
+        if n == -1 then
+            local errno = ffi.errno()
+            if errno == EWOULDBLOCK or errno == EAGAIN then
+                if self.pending ~= 0 then
+                    -- The pipe is full, wait for the destination.
+                    self:_stall_source()
+                else
+                    self:_resume_source()
+                end
+                return
+            elseif errno ~= ECONNRESET then
+                log.warning(string.format(
+                    "Pipe from fd %d failed. %s",
+                    src.socket, socket.strerror(errno)))
+            end
+            n = 0
+        end
+        if n == 0 then
+            -- End of stream. The rest of the pipe is written when the
+            -- destination is writable.
+            src:close()
+            return
+        end
+        self.pending = self.pending + n
+        if self.remaining then
+            self.remaining = self.remaining - n
+        end
+    end
+    -- Budget spent, the IOLoop calls again for the rest.
+    self:_resume_source()
+end
+
+--- Called when the destination is writable.
+function StreamPipe:_dst_writable()
+    if self.fds and self.src._pipe_out == self then
+        self:_pump_splice()
+    end
+end
+
+--- Called when the source stream is closed, by the peer or otherwise.
+function StreamPipe:_source_closed()
+    self:_forward_buffered()
+    if self.fds and self.pending ~= 0 and not self.dst:closed() then
+        -- The rest is spliced out when the destination is writable.
+        self.eof = true
+        self.dst:_add_io_state(ioloop.WRITE)
+        return
+    end
+    self:_finish()
+end
+
+--- Detach from the streams and run the callback. The destination is closed
+-- once its buffered writes are done, unless opts.close was false. If the
+-- pipe failed because of the destination, the source is closed too, unless
+-- it is the destination of another pipe, e.g the other half of a tunnel,
+-- which closes it when its data has been written.
+function StreamPipe:_finish(failed)
+    local src, dst = self.src, self.dst
+    if src._pipe_out ~= self then
+        return
+    end
+    src._pipe_out = nil
+    dst._pipe_in = nil
+    if self._timeout_ref then
+        src.io_loop:remove_timeout(self._timeout_ref)
+        self._timeout_ref = nil
+    end
+    if self.fds then
+        C.close(self.fds[0])
+        C.close(self.fds[1])
+        self.fds = nil
+    end
+    if failed and not src._pipe_in then
+        src:close()
+    elseif not src:closed() then
+        -- Done with length, the source may be read from again.
+        self:_resume_source()
+    end
+    if dst:closed() or not dst:writing() then
+        -- May be called from the write handler of dst, which would not wait
+        -- for an empty write.
+        src.io_loop:add_callback(self._done, self)
+        return
+    end
+    dst:write("", self._done, self)
+end
+
+function StreamPipe:_done()
+    if self.close_dst then
+        self.dst:close()
+    end
+    if self.callback then
+        self.callback(self.arg, self.bytes, self.timed_out)
+    end
+end
+
+--- Move everything read from this stream to another, until this stream is
+-- closed or opts.length bytes are moved. Plain sockets on Linux are spliced
+-- through a kernel pipe, so the data never enters userspace. Otherwise, e.g
+-- for SSL streams, it is copied through the read buffer of this stream into
+-- the write buffer of the other. Either way the stream stops reading while
+-- the other can not keep up, splice waits for the socket and copying waits
+-- for the write watermarks. For a tunnel, pipe both ways. Data already read
+-- is forwarded first. This stream must not be read from and the other not
+-- written to while piping. If writing fails, both streams are closed. If
+-- nothing moves for opts.timeout, this stream is closed.
+-- @param dst (IOStream instance) Stream to write to.
+-- @param opts (Table) Optional. callback, called with arg, the number of
+-- bytes moved and true if the pipe timed out, when done, arg, length: stop
+-- after this many bytes, e.g a HTTP body, close: close dst when done
+-- (default true unless length is given), timeout: msec without any data
+-- moved before the pipe fails, and splice: set to false to always copy.
+function iostream.IOStream:pipe_to(dst, opts)
+    assert(not self._read_callback, "Already reading.")
+    assert(not self._pipe_out, "Already piping.")
+    assert(not dst._pipe_in, "Destination is already piped to.")
+    StreamPipe(self, dst, opts or {}):_start()
+end
+
+--- Write count bytes from a file descriptor to the stream, starting at
+-- offset. Uses sendfile(2) where possible, so the data is never copied into
+-- userspace. For SSL streams the file is read and written in chunks, keeping
+-- memory use constant. Like write_zero_copy, this write MUST complete before
+-- any other writes can be performed. The file descriptor is not closed and
+-- its file position is not changed.
+-- @param fd (Number) File descriptor open for reading.
+-- @param offset (Number) Offset in file to start at.
+-- @param count (Number) Number of bytes to write.
+-- @param callback (Function) Optional callback to call when all is written.
+-- @param arg Optional argument for callback.
+function iostream.IOStream:write_file(fd, offset, count, callback, arg)
+    if self._write_buffer_size ~= 0 or self._const_write_buffer or
+        self._write_file then
+        error("Can not perform file write when there are unfinished \
+            writes in stream.")
+    end
+    self:_check_closed()
+    local off = ffi.new("int64_t[1]", offset or 0)
+    self._write_file = {
+        fd = fd,
+        offset = off,
+        remaining = count,
+        callback = callback,
+        arg = arg
+    }
+    self:_add_io_state(ioloop.WRITE)
+    self:_maybe_add_error_listener()
+end
+
+local WRITE_FILE_CHUNK_SZ = 1024*64
+local _write_file_chunk
+
+--- Complete a write_file operation.
+function iostream.IOStream:_finish_write_file()
+    local wf = self._write_file
+    self._write_file = nil
+    if wf.callback then
+        self:_run_callback(wf.callback, wf.arg)
+    end
+end
+
+--- Copying write_file implementation, used when sendfile(2) is not usable.
+-- Reads the next chunk once the previous has been written.
+function iostream.IOStream:_handle_write_file_copy()
+    local wf = self._write_file
+    if self._write_buffer_size == 0 then
+        if wf.remaining == 0 then
+            self:_finish_write_file()
+            return
+        end
+        local sz = min(wf.remaining, WRITE_FILE_CHUNK_SZ)
+        if not _write_file_chunk then
+            _write_file_chunk = ffi.new("char[?]", WRITE_FILE_CHUNK_SZ)
+        end
+        local n = tonumber(
+            C.pread64(wf.fd, _write_file_chunk, sz, wf.offset[0]))
+        if n <= 0 then
+            local errno = ffi.errno()
+            self:close()
+            error(string.format("Could not read file fd %d. %s",
+                wf.fd,
+                n == 0 and "Unexpected end of file." or
+                    socket.strerror(errno)))
+        end
+        self._write_buffer:clear()
+        self._write_buffer:append_right(_write_file_chunk, n)
+        self._write_buffer_offset = 0
+        self._write_buffer_size = n
+        wf.offset[0] = wf.offset[0] + n
+        wf.remaining = wf.remaining - n
+    end
+    -- Write callback is not set, so completion is only signaled above.
+    self:_handle_write_nonconst()
+end
+
+if platform.__LINUX__ and not _G.__TURBO_USE_LUASOCKET__ then
+    function iostream.IOStream:_handle_write_file()
+        local wf = self._write_file
+        if wf.remaining == 0 then
+            self:_finish_write_file()
+            return
+        end
+        local num_bytes = tonumber(C.sendfile64(
+            self.socket,
+            wf.fd,
+            wf.offset,
+            wf.remaining))
+        if num_bytes == -1 then
+            local errno = ffi.errno()
+            if errno == EWOULDBLOCK or errno == EAGAIN then
+                return
+            elseif errno == EPIPE or errno == ECONNRESET then
+                local fd = self.socket
+                self:close()
+                log.warning(string.format(
+                    "Connection closed on fd %d.",
+                    fd))
+                return
+            end
+            local fd = self.socket
+            self:close()
+            error(string.format("Error when sending file to fd %d, %s",
+                fd,
+                socket.strerror(errno)))
+        end
+        if num_bytes == 0 then
+            -- File is shorter than expected.
+            local fd = self.socket
+            self:close()
+            error(string.format(
+                "Unexpected end of file when sending file to fd %d.", fd))
+        end
+        wf.remaining = wf.remaining - num_bytes
+        if wf.remaining == 0 then
+            self:_finish_write_file()
+        end
+    end
+else
+    iostream.IOStream._handle_write_file =
+        iostream.IOStream._handle_write_file_copy
+end
+
+--- Cork the stream, so data from several writes, e.g headers followed by a
+-- write_zero_copy or write_file body, leaves in as few TCP segments as
+-- possible. Partial segments are held back until the stream is uncorked, by
+-- Linux for at most 200ms. Does nothing on streams that are not TCP, or
+-- where TCP_CORK is not available.
+-- @param on (Boolean) true to cork, false to send what is held back.
+-- @return (Boolean) true if the state was changed.
+if platform.__LINUX__ and not _G.__TURBO_USE_LUASOCKET__ then
+    function iostream.IOStream:set_cork(on)
+        on = on and true or false
+        if not self.socket or self._cork_unsupported or
+            (self._corked or false) == on then
+            return false
+        end
+        if socket.set_cork_opt(self.socket, on) ~= 0 then
+            -- E.g a Unix domain socket, do not try again.
+            self._cork_unsupported = true
+            return false
+        end
+        self._corked = on
+        return true
+    end
+else
+    function iostream.IOStream:set_cork(on)
+        return false
+    end
+end
+
 --- Are the stream currently being read from?
 -- @return (Boolean) true or false
 function iostream.IOStream:reading()
@@ -398,7 +1236,8 @@ end
 --- Are the stream currently being written too.
 -- @return (Boolean) true or false
 function iostream.IOStream:writing()
-    return self._write_buffer_size ~= 0 or self._const_write_buffer
+    return self._write_buffer_size ~= 0 or self._const_write_buffer or
+        self._write_file or self._pipe_in ~= nil and self._pipe_in.pending ~= 0
 end
 
 --- Set callback to be called when connection is closed.
@@ -449,6 +1288,10 @@ function iostream.IOStream:close()
             self.io_loop:remove_handler(self.socket)
             self._state = nil
         end
+        if self._release_timeout then
+            self.io_loop:remove_timeout(self._release_timeout)
+            self._release_timeout = nil
+        end
         if platform.__LINUX__ and not _G.__TURBO_USE_LUASOCKET__ then
             C.close(self.socket)
         else
@@ -462,9 +1305,36 @@ function iostream.IOStream:close()
             self._close_callback_arg = nil
             self:_run_callback(callback, arg)
         end
+        if self._write_waiters then
+            self:_wake_write_waiters(false)
+        end
+        -- Incoming pipe first, its source may be the destination of the
+        -- outgoing one, which closes it when flushed.
+        if self._pipe_in then
+            self._pipe_in:_finish(true)
+        end
+        if self._pipe_out then
+            self._pipe_out:_source_closed()
+        end
+        -- Callbacks already scheduled may still hold data from the buffers.
+        self.io_loop:add_callback(self._release_buffers, self)
     end
 end
 
+--- Give the buffers of a closed stream back to the pool, unless callbacks
+-- that may hold data from them are pending. The last of those tries again.
+function iostream.IOStream:_release_buffers()
+    if self.socket or self._pending_callbacks ~= 0 or
+        not self._read_buffer or self._read_buffer_size ~= 0 then
+        -- Unread data can still be read with read_until_close.
+        return
+    end
+    bufferpool.release(self._read_buffer)
+    bufferpool.release(self._write_buffer)
+    self._read_buffer = nil
+    self._write_buffer = nil
+end
+
 --- Is the stream closed?
 -- @return (Boolean) true or false
 function iostream.IOStream:closed()
@@ -478,6 +1348,7 @@ end
 --- Initial inline read for read methods.
 -- If read is not possible at this time, it is added to IOLoop.
 function iostream.IOStream:_initial_read()
+    self:_unpin_read_buffer()
     while true do
         if self:_read_from_buffer() == true then
             return
@@ -490,6 +1361,15 @@ function iostream.IOStream:_initial_read()
     self:_add_io_state(ioloop.READ)
 end
 
+--- A new read means slices handed out by the last one are done with.
+function iostream.IOStream:_unpin_read_buffer()
+    self._read_buffer_pinned = nil
+    if self._read_stalled then
+        self._read_stalled = nil
+        self:_add_io_state(ioloop.READ)
+    end
+end
+
 function iostream.IOStream:_handle_connect_fail(err)
     local cb = self._connect_fail_callback
     local arg = self._connect_callback_arg
@@ -546,7 +1426,7 @@ function iostream.IOStream:_handle_events(fd, events)
     if self:writing() then
         state = bitor(state, ioloop.WRITE)
     end
-    if state == ioloop.ERROR then
+    if state == ioloop.ERROR and not self._read_stalled then
         state = bitor(state, ioloop.READ)
     end
     if state ~= self._state then
@@ -595,6 +1475,10 @@ local function _run_callback_protected(call)
     if success == false then
         stream:close()
     end
+    -- close() does not run the close callback while callbacks are pending,
+    -- so a stream closed by the peer meanwhile must be handled here.
+    stream:_maybe_run_close_callback()
+    stream:_release_buffers()
 end
 
 function iostream.IOStream:_run_callback(callback, arg, data)
@@ -623,46 +1507,83 @@ function iostream.IOStream:_maybe_run_close_callback()
 end
 
 function iostream.IOStream:_handle_read()
+    if self._pipe_out then
+        self._pipe_out:_pump()
+        return
+    end
     self._pending_callbacks = self._pending_callbacks + 1
+    local budget = READ_BUDGET
     while not self:closed() do
-        -- Read from socket until we get EWOULDBLOCK or equivalient.
-        if self:_read_to_buffer() == 0 then
+        -- Read from socket until we get EWOULDBLOCK or equivalient, the
+        -- socket is drained or the budget is spent. The IOLoop is level
+        -- triggered, so it calls again for anything left.
+        local sz, drained = self:_read_to_buffer()
+        if sz == 0 then
             break
         end
         -- Give a chance to run scheduled callback before we read all data.
-        if self:_read_from_buffer() == true then
+        if self:_read_from_buffer() == true or drained then
             break
         end
+        if sz then
+            budget = budget - sz
+            if budget <= 0 then
+                break
+            end
+        end
     end
     self._pending_callbacks = self._pending_callbacks - 1
     self:_maybe_run_close_callback()
 end
 
+--- Called after each read. Schedule a release of the read buffer if a burst
+-- grew it.
+function iostream.IOStream:_read_done()
+    self._reads = self._reads + 1
+    if self._read_buffer:mem() > READ_BUFFER_KEEP and
+            not self._release_timeout then
+        self._release_reads = self._reads
+        self._release_timeout = self.io_loop:add_timeout(
+            util.gettimemonotonic() + READ_BUFFER_IDLE,
+            self._release_read_buffer, self)
+    end
+end
+
+--- Release a read buffer grown by a burst, if the stream has been idle since
+-- the release was scheduled. Otherwise check again later.
+function iostream.IOStream:_release_read_buffer()
+    self._release_timeout = nil
+    if not self.socket or self._read_buffer:mem() <= READ_BUFFER_KEEP then
+        return
+    end
+    if self._reads == self._release_reads and self._read_buffer_size == 0 and
+            not self._read_buffer_pinned then
+        self._read_buffer:release(READ_SIZE_MIN)
+        self._read_buffer_offset = 0
+        self._read_scan_offset = 0
+        self._read_size = READ_SIZE_MIN
+        return
+    end
+    self._release_reads = self._reads
+    self._release_timeout = self.io_loop:add_timeout(
+        util.gettimemonotonic() + READ_BUFFER_IDLE,
+        self._release_read_buffer, self)
+end
+
 --- Reads from the socket. Return the data chunk or nil if theres nothing to
 -- read, in the case of EWOULDBLOCK or equivalent.
 -- @return Chunk of data.
 if platform.__LINUX__ and not _G.__TURBO_USE_LUASOCKET__ then
-    function iostream.IOStream:_read_from_socket()
+    --- Read up to len bytes from the socket into ptr.
+    -- @return Number of bytes read, 0 on EWOULDBLOCK or equivalent, or nil
+    -- if the stream was closed.
+    function iostream.IOStream:_read_into(ptr, len)
         local errno
-        local buffer_left = self.max_buffer_size - self._read_buffer_size
-        if buffer_left == 0 then
-            log.devel("Maximum read buffer size reached. Throttling read.")
-            if self._maxb_callback then
-                self:_run_callback(self._maxb_callback,
-                                   self._maxb_callback_arg,
-                                   self._read_buffer_size)
-            end
-            return
-        end
-        local sz = tonumber(C.recv(self.socket,
-                                   buf,
-                                   TURBO_SOCKET_BUFFER_SZ < buffer_left and
-                                       TURBO_SOCKET_BUFFER_SZ or buffer_left,
-                                   0))
+        local sz = tonumber(C.recv(self.socket, ptr, len, 0))
         if sz == -1 then
             errno = ffi.errno()
             if errno == EWOULDBLOCK or errno == EAGAIN then
-                return
+                return 0
             elseif errno == ECONNRESET then
                 self:close()
                 return nil
@@ -681,19 +1602,14 @@ if platform.__LINUX__ and not _G.__TURBO_USE_LUASOCKET__ then
             self:close()
             return nil
         end
-        return buf, sz
+        return sz
     end
 else
     function iostream.IOStream:_read_from_socket()
         local errno, closed
         local buffer_left = self.max_buffer_size - self._read_buffer_size
         if buffer_left == 0 then
-            log.devel("Maximum read buffer size reached. Throttling read.")
-            if self._maxb_callback then
-                self:_run_callback(self._maxb_callback,
-                                   self._maxb_callback_arg,
-                                   self._read_buffer_size)
-            end
+            self:_read_buffer_full()
             return
         end
         -- Put buf in self, to keep reference for ptr after end of function.
@@ -741,28 +1657,88 @@ else
     end
 end
 
---- Read from the socket and append to the read buffer.
---  @return Amount of bytes appended to self._read_buffer.
-function iostream.IOStream:_read_to_buffer()
-    local ptr, sz, closed = self:_read_from_socket()
-    if not ptr then
+--- Called when the read buffer holds max_buffer_size bytes.
+function iostream.IOStream:_read_buffer_full()
+    log.devel("Maximum read buffer size reached. Throttling read.")
+    if self._maxb_callback then
+        self:_run_callback(self._maxb_callback,
+                           self._maxb_callback_arg,
+                           self._read_buffer_size)
+    end
+end
+
+if platform.__LINUX__ and not _G.__TURBO_USE_LUASOCKET__ then
+    --- Read from the socket into reserved space at the tail of the read
+    -- buffer.
+    -- @return Amount of bytes appended to self._read_buffer, and true if
+    -- the read was short so the socket is most likely drained.
+    function iostream.IOStream:_read_to_buffer()
+        local buffer_left = self.max_buffer_size - self._read_buffer_size
+        if buffer_left <= 0 then
+            self:_read_buffer_full()
+            return 0
+        end
+        local want = min(self._read_size, buffer_left)
+        local buf = self._read_buffer
+        local offset = self._read_buffer_offset
+        if offset ~= 0 and not self._read_buffer_pinned and
+                (offset >= self._read_buffer_size or
+                 buf:mem() - buf:len() < want) then
+            -- Move the unread data to the front instead of growing, when
+            -- that is cheaper than the read itself or saves a realloc. The
+            -- buffer stays within about twice max_buffer_size.
+            buf:pop_left(offset)
+            self._read_buffer_offset = 0
+        end
+        if self._read_buffer_pinned and buf:mem() - buf:len() < want then
+            -- Growing could move slices still held by a callback. Stop
+            -- reading until the next read is started.
+            self._read_stalled = true
+            return 0
+        end
+        local ptr = buf:reserve(want)
+        local sz = self:_read_into(ptr, want)
+        if not sz or sz == 0 then
+            return sz
+        end
+        buf:commit(sz)
+        self:_read_done()
+        self._read_buffer_size = self._read_buffer_size + sz
+        if sz == self._read_size then
+            if sz < READ_SIZE_MAX then
+                self._read_size = sz * 2
+            end
+        elseif sz < self._read_size / 4 and
+                self._read_size > READ_SIZE_MIN then
+            self._read_size = self._read_size / 2
+        end
+        return sz, sz < want and self._short_read_drains
+    end
+else
+    --- Read from the socket and append to the read buffer.
+    --  @return Amount of bytes appended to self._read_buffer.
+    function iostream.IOStream:_read_to_buffer()
+        local ptr, sz, closed = self:_read_from_socket()
+        if not ptr then
+            if closed then
+                self:close()
+                return
+            end
+            return 0
+        end
+        self._read_buffer:append_right(ptr, sz)
+        self:_read_done()
+        self._read_buffer_size = self._read_buffer_size + sz
         if closed then
             self:close()
+        end
+        if self._read_buffer_size > self.max_buffer_size then
+            log.error('Reached maximum read buffer size')
+            self:close()
             return
         end
-        return 0
+        return sz
     end
-    self._read_buffer:append_right(ptr, sz)
-    self._read_buffer_size = self._read_buffer_size + sz
-    if closed then
-        self:close()
-    end
-    if self._read_buffer_size > self.max_buffer_size then
-        log.error('Reached maximum read buffer size')
-        self:close()
-        return
-    end
-    return sz
 end
 
 --- Get the current read buffer pointer and size.
@@ -789,6 +1765,8 @@ function iostream.IOStream:_read_from_buffer()
             success = xpcall(self._streaming_callback, _run_callback_error_handler,
                 self._streaming_callback_arg, self:_consume(bytes_to_consume))
         end
+        -- Streaming slices are only valid during the call.
+        self._read_buffer_pinned = nil
         if not success then self:close() end
     end
     -- Handle read_bytes.
@@ -802,24 +1780,27 @@ function iostream.IOStream:_read_from_buffer()
         self._streaming_callback = nil
         self._streaming_callback_arg = nil
         self._read_bytes = nil
+        if self._read_transform then
+            local transform = self._read_transform
+            local transform_arg = self._read_transform_arg
+            self._read_transform = nil
+            self._read_transform_arg = nil
+            if num_bytes ~= 0 then
+                transform(transform_arg, self:_get_buffer_ptr(), num_bytes)
+            end
+        end
         self:_run_callback(callback, arg, self:_consume(num_bytes))
         self._raw_buffer = nil
         return true
     -- Handle read_until.
     elseif self._read_delimiter ~= nil then
         if self._read_buffer_size ~= 0 then
+            -- A failed search is continued where it stopped when more data
+            -- has been read.
             local ptr, sz = self:_get_buffer_ptr()
-            local delimiter_sz = self._read_delimiter:len()
-            local scan_ptr = ptr + self._read_scan_offset
-            sz = sz - self._read_scan_offset
-            local loc = util.str_find(
-                scan_ptr,
-                ffi.cast("char *", self._read_delimiter),
-                sz,
-                delimiter_sz)
+            local loc = self._read_searcher:find(ptr, sz)
             if loc then
-                loc = loc - ptr
-                local delimiter_end = loc + delimiter_sz
+                local delimiter_end = loc + self._read_delimiter:len()
                 local callback = self._read_callback
                 local arg = self._read_callback_arg
                 self._read_callback = nil
@@ -827,7 +1808,6 @@ function iostream.IOStream:_read_from_buffer()
                 self._streaming_callback = nil
                 self._streaming_callback_arg = nil
                 self._read_delimiter = nil
-                self._read_scan_offset = delimiter_end
                 if arg then
                     self:_run_callback(callback,
                         arg,
@@ -838,20 +1818,21 @@ function iostream.IOStream:_read_from_buffer()
                 self._raw_buffer = nil
                 return true
             end
-            self._read_scan_offset = sz
         end
     -- Handle read_until_pattern.
     elseif self._read_pattern ~= nil then
         if self._read_buffer_size ~= 0 then
-            -- Slow buffer to Lua string conversion to support Lua patterns.
-            -- Made even worse by a new allocation in self:_consume of a
-            -- different size.
+            -- Matched natively on the buffer. A failed search remembers the
+            -- first offset where a match could still start, so data that
+            -- has been ruled out is not scanned again.
             local ptr, sz = self:_get_buffer_ptr()
-            ptr = ptr + self._read_scan_offset
-            sz = sz - self._read_scan_offset
-            local chunk = ffi.string(ptr, sz)
-            local s_start, s_end = chunk:find(self._read_pattern, 1, false)
-            if s_start then
+            local pattern = self._read_pattern
+            local rc = libtffi.turbo_pattern_find(pattern, pattern:len(),
+                ptr, sz, self._read_scan_offset, _pattern_match)
+            if rc == -1 then
+                error("Malformed pattern given to read_until_pattern: " ..
+                    pattern)
+            elseif rc == 1 then
                 local callback = self._read_callback
                 local arg = self._read_callback_arg
                 self._read_callback = nil
@@ -859,13 +1840,33 @@ function iostream.IOStream:_read_from_buffer()
                 self._streaming_callback = nil
                 self._streaming_callback_arg = nil
                 self._read_pattern = nil
-                self:_run_callback(callback, arg, self:_consume(
-                    s_end + self._read_scan_offset))
-                self._read_scan_offset = s_end
+                self._read_scan_offset = 0
+                self:_run_callback(callback, arg,
+                    self:_consume(tonumber(_pattern_match["end"])))
                 self._raw_buffer = nil
                 return true
             end
-            self._read_scan_offset = sz
+            self._read_scan_offset = tonumber(_pattern_match.resume)
+        end
+    -- Handle read_decoded.
+    elseif self._read_decoder ~= nil then
+        if self._read_buffer_size >= self._read_decoder_need then
+            local ptr, sz = self:_get_buffer_ptr()
+            sz = tonumber(sz)
+            local consumed, result, need =
+                self._read_decoder(self._read_decoder_arg, ptr, sz)
+            if result ~= nil then
+                local callback = self._read_callback
+                local arg = self._read_callback_arg
+                self._read_callback = nil
+                self._read_callback_arg = nil
+                self._read_decoder = nil
+                self._read_decoder_arg = nil
+                self:_discard(consumed)
+                self:_run_callback(callback, arg, result)
+                return true
+            end
+            self._read_decoder_need = need and need > sz and need or sz + 1
         end
     end
     return false
@@ -946,24 +1947,16 @@ if platform.__LINUX__ and not _G.__TURBO_USE_LUASOCKET__ then
             -- buffer immediately instead of calling send() at all, otherwise
             -- the write never finishes and the ioloop spins on EPOLLOUT
             -- forever (e.g. serving a zero-length static file).
-            self._write_buffer_offset = 0
-            self._const_write_buffer = nil
-            if self._write_callback then
-                local callback = self._write_callback
-                local arg = self._write_callback_arg
-                self._write_callback = nil
-                self._write_callback_arg = nil
-                self:_run_callback(callback, arg)
-            end
+            self:_finish_write_const()
             return
         end
         local ptr = buf + self._write_buffer_offset
         local _sz = sz - self._write_buffer_offset
-        local num_bytes = C.send(
+        local num_bytes = tonumber(C.send(
             self.socket,
             ptr,
             _sz,
-            0)
+            0))
         if num_bytes == -1 then
             errno = ffi.errno()
             if errno == EWOULDBLOCK or errno == EAGAIN then
@@ -989,16 +1982,7 @@ if platform.__LINUX__ and not _G.__TURBO_USE_LUASOCKET__ then
         self._write_buffer_offset = self._write_buffer_offset + num_bytes
         if sz == self._write_buffer_offset then
             -- Buffer reached end. Remove reference to const write buffer.
-            self._write_buffer_offset = 0
-            self._const_write_buffer = nil
-            if self._write_callback then
-                -- Current buffer completely flushed.
-                local callback = self._write_callback
-                local arg = self._write_callback_arg
-                self._write_callback = nil
-                self._write_callback_arg = nil
-                self:_run_callback(callback, arg)
-            end
+            self:_finish_write_const()
         end
     end
 else
@@ -1049,15 +2033,104 @@ else
 
 end
 
+if platform.__LINUX__ and not _G.__TURBO_USE_LUASOCKET__ then
+    local IOV_MAX = 1024
+    local _iov = ffi.new("struct turbo_iovec[?]", IOV_MAX)
+
+    iostream.IOStream._can_writev = true
+    iostream.IOStream._can_splice = true
+    iostream.IOStream._short_read_drains = true
+
+    --- Send strings with writev until the socket would block.
+    -- @return Index of the first string that was not sent. A partially sent
+    -- string is replaced by its unsent remainder. nil if the stream was
+    -- closed.
+    function iostream.IOStream:_writev_direct(strs)
+        local n = #strs
+        local i = 1
+        while i <= n do
+            local cnt = min(n - i + 1, IOV_MAX)
+            local total = 0
+            for j = 0, cnt - 1 do
+                local str = strs[i + j]
+                _iov[j].iov_base = str
+                _iov[j].iov_len = str:len()
+                total = total + str:len()
+            end
+            local sent = tonumber(C.writev(self.socket, _iov, cnt))
+            if sent == -1 then
+                local errno = ffi.errno()
+                if errno == EWOULDBLOCK or errno == EAGAIN then
+                    sent = 0
+                elseif errno == EPIPE or errno == ECONNRESET then
+                    local fd = self.socket
+                    self:close()
+                    log.warning(string.format(
+                        "Connection closed on fd %d.",
+                        fd))
+                    return
+                else
+                    local fd = self.socket
+                    self:close()
+                    error(string.format("Error when writing to fd %d, %s",
+                        fd,
+                        socket.strerror(errno)))
+                end
+            end
+            if sent < total then
+                while sent >= strs[i]:len() do
+                    sent = sent - strs[i]:len()
+                    i = i + 1
+                end
+                if sent ~= 0 then
+                    strs[i] = strs[i]:sub(sent + 1)
+                end
+                return i
+            end
+            i = i + cnt
+        end
+        return i
+    end
+else
+    iostream.IOStream._can_writev = false
+end
+
+--- Called when the zero copy write buffer has been sent.
+function iostream.IOStream:_finish_write_const()
+    self._write_buffer_offset = 0
+    self._const_write_buffer = nil
+    self._const_write_shared = nil
+    if self._write_buffer_size ~= 0 then
+        -- Writes were queued behind a shared buffer. The callback runs when
+        -- they are flushed.
+        return
+    end
+    if self._write_callback then
+        local callback = self._write_callback
+        local arg = self._write_callback_arg
+        self._write_callback = nil
+        self._write_callback_arg = nil
+        self:_run_callback(callback, arg)
+    end
+end
+
 function iostream.IOStream:_handle_write()
     if not self.socket then
         return
     end
     if self._const_write_buffer then
         self:_handle_write_const()
+    elseif self._write_file then
+        self:_handle_write_file()
     else
         self:_handle_write_nonconst()
     end
+    if self._write_pressure and self.socket then
+        self:_check_write_pressure()
+    end
+    if self._pipe_in then
+        self._pipe_in:_dst_writable()
+    end
 end
 
 --- Add IO state to IOLoop.
@@ -1079,10 +2152,12 @@ function iostream.IOStream:_add_io_state(state)
     end
 end
 
+local _empty_slice = bufferptr(ffi.cast("char *", ""), 0)
+
 function iostream.IOStream:_consume(loc)
     if loc == 0 then
         if self._raw_buffer then
-            return {ptr=ffi.cast("char*", ""), len=0}
+            return _empty_slice
         else
             return ""
         end
@@ -1091,7 +2166,10 @@ function iostream.IOStream:_consume(loc)
     local ptr, sz = self._read_buffer:get()
     local chunk
     if self._raw_buffer then
-        chunk = {ptr = ptr + self._read_buffer_offset, len=loc}
+        -- The chunk points into the buffer, it must not be moved until the
+        -- next read.
+        self._read_buffer_pinned = true
+        chunk = bufferptr(ptr + self._read_buffer_offset, loc)
     else
         chunk = ffi.string(ptr + self._read_buffer_offset, loc)
     end
@@ -1106,6 +2184,20 @@ function iostream.IOStream:_consume(loc)
     return chunk
 end
 
+--- Drop bytes from the front of the read buffer.
+function iostream.IOStream:_discard(loc)
+    if loc == 0 then
+        return
+    end
+    self._read_buffer_size = self._read_buffer_size - loc
+    self._read_buffer_offset = self._read_buffer_offset + loc
+    local _, sz = self._read_buffer:get()
+    if self._read_buffer_offset == sz then
+        self._read_buffer:clear()
+        self._read_buffer_offset = 0
+    end
+end
+
 function iostream.IOStream:_check_closed()
     if not self.socket then
         error("Socket operation on closed stream.")
@@ -1212,6 +2304,15 @@ if _G.TURBO_SSL and platform.__LINUX__  and not _G.__TURBO_USE_LUASOCKET__ then
     -- must be set.
     iostream.SSLIOStream = class('SSLIOStream', iostream.IOStream)
 
+    -- sendfile(2) and writev(2) would bypass the encryption.
+    iostream.SSLIOStream._handle_write_file =
+        iostream.IOStream._handle_write_file_copy
+    iostream.SSLIOStream._can_writev = false
+    iostream.SSLIOStream._can_splice = false
+    -- OpenSSL may hold decrypted data after a short read, so keep reading
+    -- until it wants more from the socket.
+    iostream.SSLIOStream._short_read_drains = false
+
     --- Initialize a new SSLIOStream class instance.
     -- @param fd (Number) File descriptor, either open or closed. If closed then,
     -- the IOStream:connect() method can be used to connect.
@@ -1333,22 +2434,22 @@ if _G.TURBO_SSL and platform.__LINUX__  and not _G.__TURBO_USE_LUASOCKET__ then
         self:_do_ssl_handshake()
     end
 
-    function iostream.SSLIOStream:_read_from_socket()
+    function iostream.SSLIOStream:_read_into(ptr, len)
         if self._ssl_accepting == true then
             -- If the handshake has not been completed do not allow
             -- any reads to be done...
-            return
+            return 0
         end
         local errno
         local err
 
-        local sz = crypto.SSL_read(self._ssl, buf, _G.TURBO_SOCKET_BUFFER_SZ)
+        local sz = crypto.SSL_read(self._ssl, ptr, len)
         if sz == -1 then
             err = crypto.SSL_get_error(self._ssl, sz)
             if err == crypto.SSL_ERROR_SYSCALL then
                 errno = ffi.errno()
                 if errno == EWOULDBLOCK or errno == EAGAIN then
-                    return
+                    return 0
                 else
                     local fd = self.socket
                     self:close()
@@ -1359,7 +2460,7 @@ if _G.TURBO_SSL and platform.__LINUX__  and not _G.__TURBO_USE_LUASOCKET__ then
                         socket.strerror(errno)))
                 end
             elseif err == crypto.SSL_ERROR_WANT_READ then
-                return
+                return 0
             else
                 -- local fd = self.socket
                 local ssl_err = crypto.ERR_get_error()
@@ -1373,7 +2474,7 @@ if _G.TURBO_SSL and platform.__LINUX__  and not _G.__TURBO_USE_LUASOCKET__ then
             self:close()
             return
         end
-        return buf, sz
+        return sz
     end
 
     function iostream.SSLIOStream:_handle_write_nonconst()
@@ -1465,20 +2566,12 @@ if _G.TURBO_SSL and platform.__LINUX__  and not _G.__TURBO_USE_LUASOCKET__ then
             -- SSL_write() at all, otherwise the write never finishes and
             -- the ioloop spins on EPOLLOUT forever (e.g. serving a
             -- zero-length static file).
-            self._write_buffer_offset = 0
-            self._const_write_buffer = nil
-            if self._write_callback then
-                local callback = self._write_callback
-                local arg = self._write_callback_arg
-                self._write_callback = nil
-                self._write_callback_arg = nil
-                self:_run_callback(callback, arg)
-            end
+            self:_finish_write_const()
             return
         end
         buf = buf + self._write_buffer_offset
-        sz = sz - self._write_buffer_offset
-        local n = crypto.SSL_write(self._ssl, buf, sz)
+        local n = crypto.SSL_write(self._ssl, buf,
+                                   sz - self._write_buffer_offset)
         if n == -1 then
             local err = crypto.SSL_get_error(self._ssl, n)
             if err == crypto.SSL_ERROR_SYSCALL then
@@ -1511,20 +2604,13 @@ if _G.TURBO_SSL and platform.__LINUX__  and not _G.__TURBO_USE_LUASOCKET__ then
         self._write_buffer_offset = self._write_buffer_offset + n
         if sz == self._write_buffer_offset then
             -- Buffer reached end. Remove reference to const write buffer.
-            self._write_buffer_offset = 0
-            self._const_write_buffer = nil
-            if self._write_callback then
-                -- Current buffer completely flushed.
-                local callback = self._write_callback
-                local arg = self._write_callback_arg
-                self._write_callback = nil
-                self._write_callback_arg = nil
-                self:_run_callback(callback, arg)
-            end
+            self:_finish_write_const()
         end
     end
 elseif _G.TURBO_SSL then
     iostream.SSLIOStream = class('SSLIOStream', iostream.IOStream)
+    iostream.SSLIOStream._can_writev = false
+    iostream.SSLIOStream._can_splice = false
 
     function iostream.SSLIOStream:initialize(fd, ssl_options, io_loop,
         max_buffer_size)
@@ -1674,6 +2760,9 @@ if platform.__LINUX__ and not _G.__TURBO_USE_LUASOCKET__ then
         })
     end
     iostream._dns_cache = iostream.DNSCache() -- Static object cache :)
+    -- Lookups in progress, by cache id. Concurrent lookups of the same name
+    -- wait for the first one instead of forking resolvers of their own.
+    iostream._dns_pending = {}
     iostream.DNSResolv = class("DNSResolv")
 
     function iostream.DNSResolv:initialize(io_loop, args)
@@ -1687,9 +2776,36 @@ if platform.__LINUX__ and not _G.__TURBO_USE_LUASOCKET__ then
         if addr then
             return unpack(addr)
         end
+        local waiters = iostream._dns_pending[self.cache_id]
+        if waiters then
+            local ctx = coctx.CoroutineContext(self.io_loop)
+            waiters[#waiters + 1] = ctx
+            local err, servinfo, sockaddr = coroutine.yield(ctx)
+            if err then
+                error(err)
+            end
+            return servinfo, sockaddr
+        end
+        iostream._dns_pending[self.cache_id] = {}
         -- Set max time for DNS to resolve.
         self.com_port = "/tmp/turbo-dns-"..tostring(math.random(0,0xffffff))
-        self:_lookup_name(address, port, family)
+        local ok, lookup_err = pcall(self._lookup_name, self, address, port,
+            family)
+        if not ok then
+            -- Nothing would clear the pending entry, and later lookups of
+            -- the same name would wait on it forever.
+            iostream._dns_pending[self.cache_id] = nil
+            if self.pid then
+                ffi.C.kill(self.pid, signal.SIGKILL)
+                ffi.C.wait(nil)
+                self.pid = nil
+            end
+            if self.server_sockfd and self.server_sockfd >= 0 then
+                ffi.C.close(self.server_sockfd)
+                os.remove(self.com_port)
+            end
+            error(lookup_err, 0)
+        end
         self.ctx = coctx.CoroutineContext(self.io_loop)
         local _self = self
         self._dns_timeout = self.io_loop:add_timeout(
@@ -1702,8 +2818,7 @@ if platform.__LINUX__ and not _G.__TURBO_USE_LUASOCKET__ then
                 end
                 ffi.C.close(_self.server_sockfd)
                 os.remove(_self.com_port)
-                _self.ctx:set_arguments("DNS resolv timeout.")
-                _self.ctx:finalize_context()
+                _self:_finalize({"DNS resolv timeout."})
             end
         )
         local err, servinfo, sockaddr = coroutine.yield(self.ctx)
@@ -1713,6 +2828,19 @@ if platform.__LINUX__ and not _G.__TURBO_USE_LUASOCKET__ then
         return servinfo, sockaddr
     end
 
+    function iostream.DNSResolv:_finalize(args)
+        local waiters = iostream._dns_pending[self.cache_id]
+        iostream._dns_pending[self.cache_id] = nil
+        self.ctx:set_arguments(args)
+        self.ctx:finalize_context()
+        if waiters then
+            for i = 1, #waiters do
+                waiters[i]:set_arguments(args)
+                waiters[i]:finalize_context()
+            end
+        end
+    end
+
     function iostream.DNSResolv:clean()
         iostream._dns_cache = iostream.DNSCache()
     end
@@ -1907,8 +3035,7 @@ if platform.__LINUX__ and not _G.__TURBO_USE_LUASOCKET__ then
                     _self.io_loop:remove_timeout(self._dns_timeout)
                     os.remove(self.com_port)
 
-                    _self.ctx:set_arguments(errmsg)
-                    _self.ctx:finalize_context()
+                    _self:_finalize({errmsg})
                     return
                 end
                 pipe:read_until_pattern("\r\n\r\n", function(packed_servinfo)
@@ -1921,8 +3048,7 @@ if platform.__LINUX__ and not _G.__TURBO_USE_LUASOCKET__ then
                     local servinfo, sockaddr =
                         _unpack_addrinfo(packed_servinfo)
                     iostream._dns_cache[self.cache_id] = {servinfo, sockaddr}
-                    _self.ctx:set_arguments({false, servinfo, sockaddr})
-                    _self.ctx:finalize_context()
+                    _self:_finalize({false, servinfo, sockaddr})
                 end)
             end)
         end)
@@ -0,0 +1,246 @@
+--- Turbo.lua pubsub module.
+-- Topic based publish and subscribe for WebSocket connections spread over
+-- the worker processes of TCPServer:start(procs).
+--
+-- Copyright 2026 John Abrahamsen
+--
+-- Licensed under the Apache License, Version 2.0 (the "License");
+-- you may not use this file except in compliance with the License.
+-- You may obtain a copy of the License at
+--
+-- http://www.apache.org/licenses/LICENSE-2.0
+--
+-- Unless required by applicable law or agreed to in writing, software
+-- distributed under the License is distributed on an "AS IS" BASIS,
+-- WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+-- See the License for the specific language governing permissions and
+-- limitations under the License.
+
+local ffi = require "ffi"
+local ioloop = require "turbo.ioloop"
+local util = require "turbo.util"
+local log = require "turbo.log"
+local buffer = require "turbo.structs.buffer"
+local websocket = require "turbo.websocket"
+require "turbo.cdef"
+require "turbo.3rdparty.middleclass"
+
+local C = ffi.C
+local libtffi = util.load_libtffi()
+
+local pubsub = {} -- pubsub namespace
+
+--- Default size of the message ring of each worker.
+pubsub.RING_SIZE = 1024*1024
+
+local _topic = ffi.new("const char *[1]")
+local _topic_len = ffi.new("size_t[1]")
+local _data = ffi.new("const char *[1]")
+local _data_len = ffi.new("size_t[1]")
+local _efd_counter = ffi.new("uint64_t[1]")
+
+--- Bus class.
+-- Every worker process has a message ring in shared memory and a eventfd
+-- registered with its IOLoop. Publishing frames the message once, sends it to
+-- the subscribers in the publishing process and copies the frame into the
+-- ring of every other worker, which send it to their own subscribers. The
+-- Bus must be created before the workers are forked.
+-- Usage:
+--     local bus = turbo.pubsub.Bus(4)
+--     local srv = turbo.httpserver.HTTPServer(app)
+--     srv:bind(8888)
+--     srv:start(4)
+--     bus:attach()
+--     turbo.ioloop.instance():start()
+pubsub.Bus = class("Bus")
+
+--- Create a new Bus instance.
+-- @param workers (Number) Number of worker processes.
+-- @param ring_size (Number) Optional size in bytes of each worker's ring,
+-- rounded up to a power of two. Messages larger than half of it can not be
+-- sent to other workers. Default is pubsub.RING_SIZE.
+-- @param policy (Table) Optional slow consumer policy for local delivery,
+-- overrides keys in websocket.BROADCAST_POLICY.
+function pubsub.Bus:initialize(workers, ring_size, policy)
+    local sz = 64
+    while sz < (ring_size or pubsub.RING_SIZE) do
+        sz = sz * 2
+    end
+    self.workers = workers
+    self.ring_size = sz
+    self.policy = policy
+    self.ring = nil
+    self._bus = libtffi.turbo_bus_create(workers, sz)
+    if self._bus == nil then
+        error("Could not create shared memory for pubsub.Bus.")
+    end
+    self._topics = {}
+    self._subscriptions = setmetatable({}, {__mode="k"})
+end
+
+--- Attach the calling worker process to the Bus. Must be called once in
+-- every worker after it is forked, before it can publish or receive.
+-- Messages published to the worker before it attached are delivered now.
+-- @param io_loop (IOLoop instance) Optional, defaults to ioloop.instance().
+-- @param ring (Number) Optional ring index, 0 to workers-1. By default the
+-- first free ring is claimed.
+function pubsub.Bus:attach(io_loop, ring)
+    assert(not self.ring, "Bus already attached.")
+    ring = libtffi.turbo_bus_claim(self._bus, ring or -1,
+                                   tonumber(C.getpid()))
+    if ring == -1 then
+        error("No free ring in pubsub.Bus, too many workers attached.")
+    end
+    self.ring = ring
+    self.io_loop = io_loop or ioloop.instance()
+    self._efd = libtffi.turbo_bus_eventfd(self._bus, ring)
+    self.io_loop:add_handler(self._efd, ioloop.READ, self._on_wakeup, self)
+    self:_drain()
+end
+
+--- Subscribe a WebSocketHandler to a topic. It is unsubscribed from all
+-- topics when the connection closes.
+-- @param topic (String) Topic name.
+-- @param handler (WebSocketHandler instance)
+function pubsub.Bus:subscribe(topic, handler)
+    local subs = self._subscriptions[handler]
+    if not subs then
+        subs = {}
+        self._subscriptions[handler] = subs
+        handler._buses = handler._buses or {}
+        handler._buses[self] = true
+    end
+    if subs[topic] then
+        return
+    end
+    local list = self._topics[topic]
+    if not list then
+        list = {}
+        self._topics[topic] = list
+    end
+    list[#list + 1] = handler
+    subs[topic] = #list
+end
+
+--- Unsubscribe a WebSocketHandler from a topic.
+-- @param topic (String) Topic name.
+-- @param handler (WebSocketHandler instance)
+function pubsub.Bus:unsubscribe(topic, handler)
+    local subs = self._subscriptions[handler]
+    local i = subs and subs[topic]
+    if not i then
+        return
+    end
+    subs[topic] = nil
+    -- Move the last subscriber into the hole.
+    local list = self._topics[topic]
+    local last = list[#list]
+    list[i] = last
+    list[#list] = nil
+    if last ~= handler then
+        self._subscriptions[last][topic] = i
+    end
+    if #list == 0 then
+        self._topics[topic] = nil
+    end
+end
+
+--- Unsubscribe a WebSocketHandler from all topics.
+-- @param handler (WebSocketHandler instance)
+function pubsub.Bus:unsubscribe_all(handler)
+    local subs = self._subscriptions[handler]
+    if not subs then
+        return
+    end
+    for topic in pairs(subs) do
+        self:unsubscribe(topic, handler)
+    end
+    self._subscriptions[handler] = nil
+    handler._buses[self] = nil
+end
+
+--- Number of subscribers to a topic in this worker.
+-- @param topic (String) Topic name.
+function pubsub.Bus:subscribers(topic)
+    local list = self._topics[topic]
+    return list and #list or 0
+end
+
+--- Publish a message to the subscribers of a topic in all workers.
+-- @param topic (String) Topic name.
+-- @param msg The message to send. This may be either a JSON-serializable
+-- table or a string.
+-- @param binary (Boolean) Treat the message as binary data.
+-- @return Number of local subscribers the message was sent to and the
+-- number of workers it could not be sent to because their ring was full.
+function pubsub.Bus:publish(topic, msg, binary)
+    assert(self.ring, "Bus is not attached.")
+    local frame = websocket.encode_message(msg, binary)
+    local sent = 0
+    local list = self._topics[topic]
+    if list then
+        sent = websocket.broadcast_frame(list, frame, self.policy)
+    end
+    local ptr, sz = frame:get()
+    local dropped = 0
+    for ring = 0, self.workers - 1 do
+        if ring ~= self.ring and
+                libtffi.turbo_bus_publish(self._bus, ring, topic, topic:len(),
+                                          ptr, sz) == 0 then
+            dropped = dropped + 1
+        end
+    end
+    if dropped ~= 0 then
+        log.warning(string.format(
+            "[pubsub.lua] Ring full, message to %s dropped by %d workers.",
+            topic, dropped))
+    end
+    return sent, dropped
+end
+
+--- Number of messages to this worker that were dropped because its ring
+-- was full.
+function pubsub.Bus:dropped()
+    assert(self.ring, "Bus is not attached.")
+    return tonumber(libtffi.turbo_bus_dropped(self._bus, self.ring))
+end
+
+--- Stop receiving messages. The ring stays claimed.
+function pubsub.Bus:detach()
+    if self._efd then
+        self.io_loop:remove_handler(self._efd)
+        self._efd = nil
+    end
+end
+
+function pubsub.Bus:_on_wakeup()
+    C.read(self._efd, _efd_counter, 8)
+    self:_drain()
+end
+
+function pubsub.Bus:_drain()
+    local bus = self._bus
+    local ring = self.ring
+    while true do
+        local rec = libtffi.turbo_bus_next(bus, ring, _topic, _topic_len,
+                                           _data, _data_len)
+        if rec == 0 then
+            -- Ask publishers for a wakeup, unless something arrived while
+            -- draining.
+            if libtffi.turbo_bus_wait(bus, ring) == 0 then
+                break
+            end
+        else
+            local list = self._topics[ffi.string(_topic[0], _topic_len[0])]
+            if list then
+                local sz = tonumber(_data_len[0])
+                local frame = buffer(sz)
+                frame:append_right(_data[0], sz)
+                websocket.broadcast_frame(list, frame, self.policy)
+            end
+            libtffi.turbo_bus_consume(bus, ring, rec)
+        end
+    end
+end
+
+return pubsub
@@ -282,6 +282,12 @@ SO.SO_PEEK_OFF =        42
 SO.SO_NOFCS =           43
 end
 
+-- TCP level options, the same on all Linux architectures.
+local TCP = {}
+TCP.IPPROTO_TCP =       6
+TCP.TCP_NODELAY =       1
+TCP.TCP_CORK =          3
+
 local E
 if ffi.arch == "mipsel" or ffi.arch == "mips" then
 E = {
@@ -364,6 +370,24 @@ if platform.__LINUX__ and not _G.__TURBO_USE_LUASOCKET__ then
         return 0
     end
 
+    --- Set or clear TCP_CORK. While set, partial frames are held back, so
+    -- data written by several send calls leaves in full sized segments.
+    -- Clearing it sends what is held right away.
+    local function set_cork_opt(fd, on)
+        setopt[0] = on and 1 or 0
+        local rc = ffi.C.setsockopt(fd,
+            TCP.IPPROTO_TCP,
+            TCP.TCP_CORK,
+            setopt,
+            ffi.sizeof("int32_t"))
+        if rc ~= 0 then
+           errno = ffi.errno()
+           return -1, string.format("setsockopt TCP_CORK failed. %s",
+                                    strerror(errno))
+        end
+        return 0
+    end
+
     --- Create new non blocking socket for use in IOStream.
     -- If family or stream type is not set AF_INET and SOCK_STREAM is used.
     local function new_nonblock_socket(family, stype, protocol)
@@ -403,7 +427,8 @@ if platform.__LINUX__ and not _G.__TURBO_USE_LUASOCKET__ then
         util.tablemerge(AF,
         util.tablemerge(PF,
         util.tablemerge(SOL,
-        util.tablemerge(SO, E)))))))
+        util.tablemerge(SO,
+        util.tablemerge(TCP, E))))))))
 
     return util.tablemerge({
         strerror = strerror,
@@ -411,6 +436,7 @@ if platform.__LINUX__ and not _G.__TURBO_USE_LUASOCKET__ then
         getaddrinfo = ffi.C.getaddrinfo,
         set_nonblock_flag = set_nonblock_flag,
         set_reuseaddr_opt = set_reuseaddr_opt,
+        set_cork_opt = set_cork_opt,
         new_nonblock_socket = new_nonblock_socket,
         get_socket_error = get_socket_error,
         INADDR_ANY = 0x00000000,
@@ -449,7 +475,8 @@ else
         util.tablemerge(AF,
         util.tablemerge(PF,
         util.tablemerge(SOL,
-        util.tablemerge(SO, E)))))))
+        util.tablemerge(SO,
+        util.tablemerge(TCP, E))))))))
     return util.tablemerge({
         new_nonblock_socket = new_nonblock_socket,
         INADDR_ANY = 0x00000000,
@@ -38,11 +38,34 @@ local function _tbuffer_free(ptr)
     ffi.C.free(ptr)
 end
 
+--- Resize the data of a buffer with libc. Returns the new pointer and the
+-- number of bytes it holds.
+function Buffer._realloc(ptr, old_mem, mem)
+    return ffi.C.realloc(ptr, mem), mem
+end
+
 --- Create a new buffer.
 -- @param size_hint The buffer is preallocated with this amount of storage.
+-- @param allocator (Table) Optional, allocate the data with something else
+-- than libc, see turbo.structs.bufferpool. A table with the functions
+-- realloc(ptr, old_mem, mem), returning the new pointer and the number of
+-- bytes it holds, and free(tbuffer), called when the buffer is collected.
 -- @return Buffer instance.
-function Buffer:initialize(size_hint)
+function Buffer:initialize(size_hint, allocator)
     size_hint = size_hint or 1024
+    if allocator then
+        self._realloc = allocator.realloc
+        self.tbuffer = ffi.gc(ffi.new("struct tbuffer"), allocator.free)
+        local ptr, mem = allocator.realloc(nil, 0, size_hint)
+        if ptr == nil then
+            error("No memory.")
+        end
+        self.tbuffer.mem = mem
+        self.tbuffer.sz = 0
+        self.tbuffer.data = ptr
+        self.tbuffer.sz_hint = size_hint
+        return
+    end
     local ptr = ffi.C.malloc(ffi.sizeof("struct tbuffer"))
     if ptr == nil then
         error("No memory.")
@@ -59,46 +82,71 @@ function Buffer:initialize(size_hint)
     self.tbuffer.sz_hint = size_hint
 end
 
+-- Resize the data to at least mem bytes.
+local function _resize(self, mem)
+    local tbuffer = self.tbuffer
+    local ptr, got = self._realloc(tbuffer.data, tbuffer.mem, mem)
+    if ptr == nil then
+        error("No memory.")
+    end
+    tbuffer.data = ptr
+    tbuffer.mem = got
+end
+
+-- Make room for len more bytes.
+-- Realloc: double up to 1MB, then grow by 1MB at a time.
+local function _grow(self, len)
+    local new_sz = self.tbuffer.sz + len
+    _resize(self, new_sz + (new_sz < 1048576 and new_sz or 1048576))
+end
+
 --- Append data to buffer.
 -- @param data The data to append in char * form.
 -- @param len The length of the data in bytes.
 function Buffer:append_right(data, len)
-    if self.tbuffer.mem - self.tbuffer.sz >= len then
-        ffi.copy(self.tbuffer.data + self.tbuffer.sz, data, len)
-        self.tbuffer.sz = self.tbuffer.sz + len
-    else
-        -- Realloc: double up to 1MB, then grow by 1MB at a time.
-        local new_sz = self.tbuffer.sz + len
-        local new_mem = new_sz + (new_sz < 1048576 and new_sz or 1048576)
-        local ptr = ffi.C.realloc(self.tbuffer.data, new_mem)
-        if ptr == nil then
-            error("No memory.")
-        end
-        self.tbuffer.data = ptr
-        ffi.copy(self.tbuffer.data + self.tbuffer.sz, data, len)
-        self.tbuffer.mem = new_mem
-        self.tbuffer.sz = new_sz
+    local tbuffer = self.tbuffer
+    if tbuffer.mem - tbuffer.sz < len then
+        _grow(self, len)
     end
+    ffi.copy(tbuffer.data + tbuffer.sz, data, len)
+    tbuffer.sz = tbuffer.sz + len
     return self
 end
 
 function Buffer:append_char_right(char)
-    if self.tbuffer.mem - self.tbuffer.sz >= 1 then
-        self.tbuffer.data[self.tbuffer.sz] = char
-        self.tbuffer.sz = self.tbuffer.sz + 1
-    else
-        -- Realloc: double up to 1MB, then grow by 1MB at a time.
-        local new_sz = self.tbuffer.sz + 1
-        local new_mem = new_sz + (new_sz < 1048576 and new_sz or 1048576)
-        local ptr = ffi.C.realloc(self.tbuffer.data, new_mem)
-        if ptr == nil then
-            error("No memory.")
-        end
-        self.tbuffer.data = ptr
-        self.tbuffer.data[self.tbuffer.sz] = char
-        self.tbuffer.mem = new_mem
-        self.tbuffer.sz = new_sz
+    local tbuffer = self.tbuffer
+    if tbuffer.mem - tbuffer.sz < 1 then
+        _grow(self, 1)
+    end
+    tbuffer.data[tbuffer.sz] = char
+    tbuffer.sz = tbuffer.sz + 1
+    return self
+end
+
+--- Reserve space for at least len bytes after the data, so that it can be
+-- written in place, e.g by recv(), instead of through a temporary buffer.
+-- The space is not part of the buffer until Buffer:commit is called.
+-- @return Pointer to the reserved space and its size, which may be larger
+-- than len.
+function Buffer:reserve(len)
+    local tbuffer = self.tbuffer
+    if tbuffer.mem - tbuffer.sz < len then
+        -- Only the data is doubled, the same reservation is usually made
+        -- again once it is filled.
+        local sz = tbuffer.sz
+        _resize(self, sz + len + (sz < 1048576 and sz or 1048576))
+    end
+    return tbuffer.data + tbuffer.sz, tbuffer.mem - tbuffer.sz
+end
+
+--- Add len bytes written to the space returned by Buffer:reserve to the
+-- buffer.
+function Buffer:commit(len)
+    local tbuffer = self.tbuffer
+    if tbuffer.mem - tbuffer.sz < len then
+        error("Trying to commit more than the reserved space of buffer")
     end
+    tbuffer.sz = tbuffer.sz + len
     return self
 end
 
@@ -129,17 +177,11 @@ function Buffer:append_left(data, len)
     else
         -- Realloc and double required memory size.
         local new_sz = self.tbuffer.sz + len
-        local new_mem  = new_sz * 2
-        local ptr = ffi.C.realloc(self.tbuffer.data, new_mem)
-        if ptr == nil then
-            error("No memory.")
-        end
-        self.tbuffer.data = ptr
+        _resize(self, new_sz * 2)
         if self.tbuffer.sz ~= 0 then
             ffi.C.memmove(self.tbuffer.data + len, self.tbuffer.data, self.tbuffer.sz)
         end
         ffi.copy(self.tbuffer.data, data, len)
-        self.tbuffer.mem = new_mem
         self.tbuffer.sz = new_sz
     end
     return self
@@ -193,11 +235,18 @@ function Buffer:shrink()
         -- allocated. Bail.
         return self
     end
-    local ptr = ffi.C.realloc(self.tbuffer.data, self.tbuffer.sz)
-    if ptr == nil then
-        error("No memory.")
+    _resize(self, self.tbuffer.sz)
+    return self
+end
+
+--- Clear the buffer and give back its memory, keeping mem bytes allocated.
+-- @param mem (Number) Bytes to keep. Defaults to the size hint.
+function Buffer:release(mem)
+    mem = mem or self.tbuffer.sz_hint
+    self.tbuffer.sz = 0
+    if self.tbuffer.mem > mem then
+        _resize(self, mem)
     end
-    self.tbuffer.data = ptr
     return self
 end
 
@@ -0,0 +1,123 @@
+-- Turbo.lua Buffer pool
+--
+-- Copyright 2026 John Abrahamsen
+--
+-- Licensed under the Apache License, Version 2.0 (the "License");
+-- you may not use this file except in compliance with the License.
+-- You may obtain a copy of the License at
+--
+-- http://www.apache.org/licenses/LICENSE-2.0
+--
+-- Unless required by applicable law or agreed to in writing, software
+-- distributed under the License is distributed on an "AS IS" BASIS,
+-- WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+-- See the License for the specific language governing permissions and
+-- limitations under the License.
+
+require "turbo.cdef"
+local ffi = require "ffi"
+local util = require "turbo.util"
+local buffer = require "turbo.structs.buffer"
+
+local libtffi = util.load_libtffi()
+
+--- Pool of Buffer instances for per connection buffers.
+-- Buffers are kept in size classes, powers of two from 1KB to 64KB, and their
+-- memory comes from a native slab instead of malloc. A released buffer is
+-- shrunk back to its class and handed out again by the next acquire of that
+-- class, so once the pool is warm, opening and closing connections does not
+-- allocate memory or create garbage collected objects.
+local bufferpool = {} -- bufferpool namespace
+
+--- Smallest and largest size class.
+bufferpool.MIN_CLASS = 1024
+bufferpool.MAX_CLASS = 64*1024
+--- Released buffers kept per size class, the rest are left to the garbage
+-- collector.
+bufferpool.MAX_FREE = 4096
+
+local _got = ffi.new("size_t[1]")
+local _stats = ffi.new("struct turbo_slab_stats")
+
+local function _slab_free(tbuffer)
+    libtffi.turbo_slab_free(tbuffer.data, tbuffer.mem)
+end
+
+local _allocator = {
+    realloc = function(ptr, old_mem, mem)
+        if ptr == nil then
+            ptr = libtffi.turbo_slab_alloc(mem, _got)
+        else
+            ptr = libtffi.turbo_slab_realloc(ptr, old_mem, mem, _got)
+        end
+        return ffi.cast("char *", ptr), _got[0]
+    end,
+    free = _slab_free
+}
+
+local _free = {}
+
+local function _class(size_hint)
+    local c = bufferpool.MIN_CLASS
+    while c < size_hint do
+        c = c * 2
+    end
+    return c
+end
+
+--- Get a Buffer from the pool.
+-- @param size_hint (Number) Bytes to preallocate, rounded up to the size
+-- class. Defaults to 1024.
+-- @return Empty Buffer instance. Give it back with bufferpool.release.
+function bufferpool.acquire(size_hint)
+    local c = _class(size_hint or 1024)
+    local free = _free[c]
+    if free and #free ~= 0 then
+        local buf = free[#free]
+        free[#free] = nil
+        buf._pooled = nil
+        return buf
+    end
+    return buffer(c, _allocator)
+end
+
+--- Give a Buffer from bufferpool.acquire back to the pool. It is cleared and
+-- shrunk to its size class and must not be used afterwards.
+-- @param buf (Buffer instance)
+function bufferpool.release(buf)
+    assert(not buf._pooled, "Buffer released twice.")
+    local c = tonumber(buf.tbuffer.sz_hint)
+    buf:release(c)
+    if c > bufferpool.MAX_CLASS then
+        return
+    end
+    local free = _free[c]
+    if not free then
+        free = {}
+        _free[c] = free
+    end
+    if #free < bufferpool.MAX_FREE then
+        buf._pooled = true
+        free[#free + 1] = buf
+    end
+end
+
+--- Get statistics of the pool and the native slab.
+-- @return Table with free, the number of buffers waiting in the pool, and
+-- slab_bytes, used_bytes and large_bytes: memory in slabs, memory of slab
+-- blocks in use and memory of buffers larger than the largest class.
+function bufferpool.stats()
+    libtffi.turbo_slab_get_stats(_stats)
+    local free = 0
+    for _, list in pairs(_free) do
+        free = free + #list
+    end
+    return {
+        free = free,
+        slab_bytes = tonumber(_stats.slab_bytes),
+        used_bytes = tonumber(_stats.used_bytes),
+        large_bytes = tonumber(_stats.large_bytes)
+    }
+end
+
+return bufferpool
@@ -17,6 +17,8 @@
 require 'turbo.3rdparty.middleclass'
 local ffi = require "ffi"
 
+--- View of memory owned by something else, e.g a slice of the IOStream read
+-- buffer. Nothing is copied until a string is asked for.
 local BufferPtr = class('BufferPtr')
 
 function BufferPtr:initialize(ptr, size)
@@ -29,4 +31,19 @@ function BufferPtr:len() return self.size end
 
 function BufferPtr:get() return self.ptr, self.size end
 
-return BufferPtr
\ No newline at end of file
+--- Get a view of part of the memory.
+-- @param offset (Number) Offset of the part, from 0.
+-- @param len (Number) Length of the part. Defaults to the rest.
+function BufferPtr:slice(offset, len)
+	len = len or self.size - offset
+	assert(offset >= 0 and len >= 0 and offset + len <= self.size,
+		"Slice out of range.")
+	return BufferPtr(self.ptr + offset, len)
+end
+
+--- Copy the memory to a Lua string, using the tostring() builtin.
+function BufferPtr:__tostring()
+	return ffi.string(self.ptr, self.size)
+end
+
+return BufferPtr
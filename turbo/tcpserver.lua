@@ -167,6 +167,7 @@ function tcpserver.TCPServer:start(procs)
                     tonumber(pid)))
                 break
             end
+            self.io_loop:reinit_poll()
         end
     end
     local sockets = self._pending_sockets
@@ -312,6 +312,50 @@ function util.str_find(s, p, slen, plen)
     end
 end
 
+local libtffi
+local searcher_pos = ffi.new("size_t[1]")
+local searcher_mt = {
+    __index = {
+        --- Find the delimiter in memory.
+        -- @param ptr (char*) Memory to search.
+        -- @param sz (Number) Size of memory.
+        -- @return Offset of the delimiter from ptr or nil if it was not
+        -- found. A search after nil continues where it stopped, so ptr must
+        -- point at the same data, possibly with more appended.
+        find = function(self, ptr, sz)
+            if libtffi.turbo_searcher_find(self, ptr, sz, searcher_pos) == 1
+            then
+                return tonumber(searcher_pos[0])
+            end
+        end,
+        --- Forget the state of a search that did not find the delimiter.
+        reset = function(self)
+            self.offset = 0
+        end
+    }
+}
+local searcher_ct
+
+--- Prepare a searcher for a plain delimiter. The search is done natively,
+-- with SSE2/AVX2 where available, and is much faster than util.str_find
+-- for delimiters whose first byte is common in the data, like "\r\n\r\n".
+-- A searcher remembers where a search that failed stopped, so searching
+-- the same memory again after more data has been appended only scans the
+-- new data.
+-- @param delimiter (String) Delimiter, text or binary.
+-- @return Searcher cdata with find(ptr, sz) and reset() methods.
+function util.searcher(delimiter)
+    if not searcher_ct then
+        libtffi = util.load_libtffi()
+        searcher_ct = ffi.metatype("struct turbo_searcher", searcher_mt)
+    end
+    local len = delimiter:len()
+    local s = searcher_ct(len)
+    s.len = len
+    ffi.copy(s.needle, delimiter, len)
+    return s
+end
+
 --- Turbo Booyer-Moore memory search algorithm.
 -- DEPRECATED as of v.1.1.
 -- @param x char* Needle memory pointer
@@ -26,6 +26,7 @@ local log =             require "turbo.log"
 local httputil =        require "turbo.httputil"
 local httpserver =      require "turbo.httpserver"
 local buffer =          require "turbo.structs.buffer"
+local bufferpool =      require "turbo.structs.bufferpool"
 local bufferptr =       require "turbo.structs.bufferptr"
 local escape =          require "turbo.escape"
 local platform =        require "turbo.platform"
@@ -34,6 +35,9 @@ local mime_types =      require "turbo.mime_types"
 local util =            require "turbo.util"
 local hash =            require "turbo.hash"
 local socket =          require "turbo.socket_ffi"
+local ioloop =          require "turbo.ioloop"
+local iostream =        require "turbo.iostream"
+local coctx =           require "turbo.coctx"
 local bit = jit and require "bit" or require "bit32"
 local syscall =         require "turbo.syscall"
 local fs
@@ -261,7 +265,7 @@ function web.RequestHandler:clear()
             self:add_header("Connection", "Keep-Alive")
         end
     end
-    self._write_buffer = buffer:new()
+    self._write_buffer = bufferpool.acquire()
     self._status_code = 200
 end
 
@@ -520,6 +524,10 @@ end
 -- request. Giving a new callback before the pending has been run leads to
 -- discarding of the current pending callback. For HEAD method request the
 -- chunk is ignored and only headers are written to the socket.
+-- Without a callback, flush waits while more than the high write watermark
+-- of the stream is waiting to be sent, so a handler producing a response
+-- faster than the client reads it is paused instead of queueing it whole.
+-- See IOStream:set_write_watermarks.
 -- @param callback (Function) Callback function.
 function web.RequestHandler:flush(callback, arg)
     local headers
@@ -570,6 +578,19 @@ function web.RequestHandler:flush(callback, arg)
             self.request:write(chunk, callback, arg)
         end
     end
+    if not callback and not self._finished and coroutine.running() then
+        self.request.connection.stream:wait_writable()
+    end
+end
+
+--- Cork the connection until the request is finished, so headers and a body
+-- that are written separately leave in the same TCP segments. Only for
+-- responses whose body follows right away, held back data waits up to 200ms.
+-- See IOStream:set_cork.
+function web.RequestHandler:_cork()
+    if self.request.connection.stream:set_cork(true) then
+        self._corked = true
+    end
 end
 
 function web.RequestHandler:_gen_headers()
@@ -620,6 +641,8 @@ function web.RequestHandler:finish(chunk)
         self:write(chunk)
     end
     self:flush() -- Make sure everything in buffers are flushed to IOStream.
+    bufferpool.release(self._write_buffer)
+    self._write_buffer = nil
     if self.chunked then
         self.request:write("0\r\n\r\n", self._finish, self)
         return
@@ -745,6 +768,10 @@ function web.RequestHandler:_finish()
             self.request.remote_ip,
             self.request:request_time()))
     end
+    if self._corked then
+        self._corked = nil
+        self.request.connection.stream:set_cork(false)
+    end
     self.request:finish()
     self:on_finish()
 end
@@ -1032,6 +1059,7 @@ function web.StaticFileHandler:_send_from_file(stat, file)
     self._file = file
     self._file_offset = 0
     self._file_stat = stat
+    self:_cork()
     self:flush(self._send_next_chunk, self)
 end
 
@@ -1076,6 +1104,7 @@ function web.StaticFileHandler:get(path)
         if sha1 then
             self:add_header("Etag", sha1)
         end
+        self:_cork()
         self:flush(web.StaticFileHandler._headers_flushed_cb, self)
     elseif rc == SWCRC_TOO_BIG then
         self.headers:set_status_code(200)
@@ -1166,6 +1195,650 @@ function web.RedirectHandler:prepare()
     self:redirect(self.options, true)
 end
 
+--- Hop-by-hop header fields, RFC 7230 section 6.1. They only apply to a
+-- single connection, so ProxyHandler does not forward them.
+local _hop_by_hop = {
+    ["connection"] = true,
+    ["keep-alive"] = true,
+    ["proxy-authenticate"] = true,
+    ["proxy-authorization"] = true,
+    ["proxy-connection"] = true,
+    ["te"] = true,
+    ["trailer"] = true,
+    ["transfer-encoding"] = true,
+    ["upgrade"] = true
+}
+-- Request fields that are replaced or answered by the proxy.
+local _proxy_request_skip = {
+    ["expect"] = true,
+    ["x-forwarded-for"] = true
+}
+local _idempotent_methods = {
+    GET = true, HEAD = true, OPTIONS = true, PUT = true, DELETE = true
+}
+local _proxy_methods = {
+    "GET", "HEAD", "POST", "DELETE", "PUT", "OPTIONS", "PATCH"
+}
+
+--- Resume the coroutine waiting on ctx. Only the first call counts, e.g
+-- when both a read and the close of the stream would resume it. The resume
+-- is scheduled, as the coroutine may not have yielded yet.
+local function _proxy_resume(ctx, ...)
+    if ctx.resumed then
+        return
+    end
+    ctx.resumed = true
+    ctx:set_arguments({...})
+    ctx.io_loop:add_callback(ctx.finalize_context, ctx)
+end
+
+local function _proxy_connected(ctx)
+    _proxy_resume(ctx, true)
+end
+
+local function _proxy_connect_failed(ctx, err)
+    _proxy_resume(ctx, false, err)
+end
+
+local function _proxy_timeout(ctx)
+    ctx.timed_out = true
+    ctx.stream:close()
+    _proxy_resume(ctx)
+end
+
+--- Wait for a operation on stream to resume ctx. The stream is closed if
+-- it takes longer than timeout msec. With watch_close, close of the stream
+-- resumes with nil.
+local function _proxy_wait(stream, ctx, timeout, watch_close)
+    local ref
+    if timeout then
+        ctx.stream = stream
+        ref = stream.io_loop:add_timeout(
+            util.gettimemonotonic() + timeout, _proxy_timeout, ctx)
+    end
+    if watch_close and not stream:closed() then
+        stream:set_close_callback(_proxy_resume, ctx)
+    end
+    local a, b = coroutine.yield(ctx)
+    if ref then
+        stream.io_loop:remove_timeout(ref)
+    end
+    if watch_close then
+        stream:set_close_callback(nil)
+    end
+    return a, b
+end
+
+--- Read from stream until delimiter.
+-- @return The data, or nil if the stream was closed first.
+local function _proxy_read(stream, delimiter, timeout)
+    local ctx = coctx.CoroutineContext(stream.io_loop)
+    if not pcall(stream.read_until, stream, delimiter, _proxy_resume, ctx) then
+        return nil
+    end
+    return _proxy_wait(stream, ctx, timeout, true), ctx.timed_out
+end
+
+--- Pipe src to dst until length bytes are moved, or src is closed. src is
+-- closed if nothing moves for timeout msec.
+-- @return Number of bytes moved, and true if the pipe timed out.
+local function _proxy_pipe(src, dst, length, timeout)
+    local ctx = coctx.CoroutineContext(src.io_loop)
+    src:pipe_to(dst, {
+        length = length,
+        close = false,
+        timeout = timeout,
+        callback = _proxy_resume,
+        arg = ctx
+    })
+    return coroutine.yield(ctx)
+end
+
+--- Append the end-to-end fields of headers to the list t, leaving out
+-- hop-by-hop fields, those named by the Connection field and those in skip.
+local function _proxy_fields(headers, t, skip)
+    local fields = headers:get_fields()
+    local listed
+    for i = 1, #fields do
+        if fields[i][1]:lower() == "connection" then
+            listed = listed or {}
+            for token in fields[i][2]:gmatch("[^,%s]+") do
+                listed[token:lower()] = true
+            end
+        end
+    end
+    for i = 1, #fields do
+        local key = fields[i][1]:lower()
+        if not _hop_by_hop[key] and not (listed and listed[key]) and
+            not (skip and skip[key]) then
+            t[#t + 1] = fields[i][1]
+            t[#t + 1] = ": "
+            t[#t + 1] = fields[i][2]
+            t[#t + 1] = "\r\n"
+        end
+    end
+    return t
+end
+
+--- A group of upstream servers for ProxyHandler. Requests are balanced
+-- round robin, or to the server with the least active requests.
+-- Connections are kept alive and reused. A server that fails max_fails
+-- times in a row, by refused or timed out connections or broken responses,
+-- is not used for fail_timeout seconds, after which one request tries it
+-- again.
+-- Usage:
+-- local api = turbo.web.UpstreamGroup({"10.0.0.1:8080", "10.0.0.2:8080"},
+--      {balance = "least_conn"})
+-- local application = turbo.web.Application({
+--      {"^/api/.*$", turbo.web.ProxyHandler, api}
+-- })
+web.UpstreamGroup = class("UpstreamGroup")
+
+--- Create a new UpstreamGroup class instance.
+-- @param servers (Table) List of "host:port" strings.
+-- @param kwargs (Table) Optional keyword arguments.
+-- Key word arguments supported:
+-- "balance" = "round_robin" (default) or "least_conn".
+-- "max_fails" = Failures in a row before a server is taken out. Default 3.
+-- "fail_timeout" = Seconds a failed server is out. Default 10.
+-- "keepalive" = Idle connections kept per server. Default 16.
+-- "keepalive_timeout" = Seconds a idle connection is kept. Default 60.
+-- "connect_timeout" = Seconds to connect. Default 5.
+-- "read_timeout" = Seconds to wait for response headers, and for any data
+--      to move while a body is forwarded. Default 60.
+-- "x_forwarded" = Add X-Forwarded-For and X-Forwarded-Proto fields to
+--      requests. Default true.
+-- "io_loop" = IOLoop instance to use. Default is the global instance.
+function web.UpstreamGroup:initialize(servers, kwargs)
+    assert(type(servers) == "table" and #servers ~= 0, "No upstream servers.")
+    kwargs = kwargs or {}
+    self.balance = kwargs.balance or "round_robin"
+    assert(self.balance == "round_robin" or self.balance == "least_conn",
+        "Unknown balance method " .. tostring(self.balance))
+    self.max_fails = kwargs.max_fails or 3
+    self.fail_timeout = (kwargs.fail_timeout or 10) * 1000
+    self.keepalive = kwargs.keepalive or 16
+    self.keepalive_timeout = (kwargs.keepalive_timeout or 60) * 1000
+    self.connect_timeout = (kwargs.connect_timeout or 5) * 1000
+    self.read_timeout = (kwargs.read_timeout or 60) * 1000
+    self.x_forwarded = kwargs.x_forwarded ~= false
+    self.io_loop = kwargs.io_loop or ioloop.instance()
+    self.servers = {}
+    for i = 1, #servers do
+        local host, port = servers[i]:match("^%[?(.-)%]?:(%d+)$")
+        assert(host, "Invalid upstream server " .. tostring(servers[i]))
+        self.servers[i] = {
+            name = servers[i],
+            host = host,
+            port = tonumber(port),
+            family = host:find(":", 1, true) and socket.AF_INET6 or
+                socket.AF_INET,
+            -- Requests in progress.
+            active = 0,
+            -- Failures in a row.
+            fails = 0,
+            -- Out until this time, see fail_timeout.
+            down_until = 0,
+            idle = {}
+        }
+    end
+    self._next = 1
+end
+
+--- Pick a server that is not out and not in exclude. Each pick starts
+-- looking one server further, so ties in least_conn are spread too.
+-- @return Server or nil if there is none.
+function web.UpstreamGroup:_select(exclude)
+    local servers = self.servers
+    local n = #servers
+    local now = util.gettimemonotonic()
+    local start = self._next
+    local best
+    for i = 0, n - 1 do
+        local server = servers[(start + i - 1) % n + 1]
+        if not exclude[server] and server.down_until <= now then
+            if self.balance == "round_robin" then
+                best = server
+                break
+            elseif not best or server.active < best.active then
+                best = server
+            end
+        end
+    end
+    self._next = start % n + 1
+    return best
+end
+
+--- Get a connection to server, a idle one unless fresh is set.
+-- @return IOStream and true if it was idle, or nil if it could not connect.
+function web.UpstreamGroup:_acquire(server, fresh)
+    local idle = server.idle
+    while not fresh and #idle ~= 0 do
+        local conn = table.remove(idle)
+        self.io_loop:remove_timeout(conn.timeout)
+        conn.stream:set_close_callback(nil)
+        if not conn.stream:closed() then
+            server.active = server.active + 1
+            return conn.stream, true
+        end
+    end
+    local fd, msg = socket.new_nonblock_socket(server.family,
+        socket.SOCK_STREAM,
+        0)
+    if fd == -1 then
+        log.error(string.format("[web.lua] Could not create socket. %s", msg))
+        return nil
+    end
+    local stream = iostream.IOStream(fd, self.io_loop)
+    local ctx = coctx.CoroutineContext(self.io_loop)
+    stream:connect(server.host,
+        server.port,
+        server.family,
+        _proxy_connected,
+        _proxy_connect_failed,
+        ctx)
+    local ok, err = _proxy_wait(stream, ctx, self.connect_timeout, true)
+    if ok ~= true then
+        stream:close()
+        log.warning(string.format(
+            "[web.lua] Could not connect to upstream %s. %s",
+            server.name,
+            ctx.timed_out and "Timed out." or tostring(err or "Closed.")))
+        return nil
+    end
+    server.active = server.active + 1
+    return stream, false
+end
+
+local function _idle_closed(conn)
+    local idle = conn.server.idle
+    for i = 1, #idle do
+        if idle[i] == conn then
+            table.remove(idle, i)
+            conn.group.io_loop:remove_timeout(conn.timeout)
+            return
+        end
+    end
+end
+
+local function _idle_expired(conn)
+    conn.stream:close()
+end
+
+--- Give back a connection from _acquire. It is kept for the next request
+-- if reusable.
+function web.UpstreamGroup:_release(server, stream, reusable)
+    server.active = server.active - 1
+    if not reusable or stream:closed() or #server.idle >= self.keepalive or
+        server.down_until > util.gettimemonotonic() then
+        stream:close()
+        return
+    end
+    local conn = {group = self, server = server, stream = stream}
+    conn.timeout = self.io_loop:add_timeout(
+        util.gettimemonotonic() + self.keepalive_timeout,
+        _idle_expired,
+        conn)
+    -- Closed by the server, or expired.
+    stream:set_close_callback(_idle_closed, conn)
+    server.idle[#server.idle + 1] = conn
+end
+
+function web.UpstreamGroup:_failed(server)
+    server.fails = server.fails + 1
+    if server.fails >= self.max_fails then
+        server.down_until = util.gettimemonotonic() + self.fail_timeout
+        log.warning(string.format(
+            "[web.lua] Upstream %s failed %d times, out for %dms.",
+            server.name,
+            server.fails,
+            self.fail_timeout))
+        -- The close callbacks only run later, so the list is taken first.
+        local idle = server.idle
+        server.idle = {}
+        for i = 1, #idle do
+            local conn = idle[i]
+            self.io_loop:remove_timeout(conn.timeout)
+            conn.stream:set_close_callback(nil)
+            conn.stream:close()
+        end
+    end
+end
+
+function web.UpstreamGroup:_succeeded(server)
+    server.fails = 0
+end
+
+--- Reverse proxy handler, forwarding requests to a UpstreamGroup given as
+-- the third element of its entry in the Application routing table. Request
+-- and response bodies are streamed, spliced between the sockets where
+-- possible, and neither side is read faster than the other is written.
+-- The body of a request is only streamed when the application is served
+-- with Application:listen, else HTTPServer has read it already. Requests
+-- with a Transfer-Encoding are refused by HTTPServer.
+web.ProxyHandler = class("ProxyHandler", web.RequestHandler)
+web.ProxyHandler.stream_request_body = true
+
+function web.ProxyHandler:initialize(...)
+    web.RequestHandler.initialize(self, ...)
+    self.SUPPORTED_METHODS = _proxy_methods
+end
+
+--- Forward the request and its response.
+function web.ProxyHandler:proxy()
+    local group = self.options
+    if not instanceOf(web.UpstreamGroup, group) then
+        error(web.HTTPError(500,
+            "ProxyHandler executed without UpstreamGroup argument."))
+    end
+    local req = self.request
+    local length = req.headers:get("Content-Length")
+    if length then
+        length = tonumber(length)
+        if not length or length < 0 or length % 1 ~= 0 then
+            -- Can not tell where the body ends, or the next request starts.
+            self:_proxy_abort(400)
+            return
+        end
+    else
+        length = 0
+    end
+    -- Unread if HTTPServer left it in the stream.
+    self._body_left = #req.body == length and 0 or length
+    local ok, err = pcall(self._proxy_forward, self, group, length)
+    if not ok then
+        -- E.g writing to a client that has gone, the upstream connection
+        -- must still be given back.
+        self:_proxy_release(group, false)
+        error(err, 0)
+    end
+end
+
+function web.ProxyHandler:_proxy_forward(group, length)
+    local stream, server, res = self:_proxy_request(group, length)
+    if not stream then
+        -- res is the status code to respond with.
+        if self._body_left ~= 0 then
+            self:_proxy_abort(res)
+            return
+        end
+        error(web.HTTPError(res))
+    end
+    self:_proxy_response(group, server, stream, res)
+end
+
+--- Give the upstream connection from _proxy_request back to group, if it
+-- is not already.
+function web.ProxyHandler:_proxy_release(group, reusable)
+    local conn = self._proxy_conn
+    if conn then
+        self._proxy_conn = nil
+        group:_release(conn[1], conn[2], reusable)
+    end
+end
+
+web.ProxyHandler.get = web.ProxyHandler.proxy
+web.ProxyHandler.head = web.ProxyHandler.proxy
+web.ProxyHandler.post = web.ProxyHandler.proxy
+web.ProxyHandler.delete = web.ProxyHandler.proxy
+web.ProxyHandler.put = web.ProxyHandler.proxy
+web.ProxyHandler.options = web.ProxyHandler.proxy
+web.ProxyHandler.patch = web.ProxyHandler.proxy
+
+--- Respond with code if nothing is written yet and close the connection to
+-- the client.
+function web.ProxyHandler:_proxy_abort(code)
+    self:set_status(code)
+    if not self._headers_written then
+        self:add_header("Connection", "close")
+        self:write(response_codes[code])
+        self:flush()
+    end
+    self.request.connection.no_keep_alive = true
+    self:finish()
+end
+
+--- Build the request line and fields sent upstream, except Host if the
+-- client did not send it.
+function web.ProxyHandler:_proxy_request_head(group)
+    local req = self.request
+    local t = {req.method, " ", req.uri, " HTTP/1.1\r\n"}
+    _proxy_fields(req.headers, t, _proxy_request_skip)
+    if group.x_forwarded then
+        local xff = req.headers:get("X-Forwarded-For")
+        if type(xff) == "table" then
+            xff = table.concat(xff, ", ")
+        end
+        t[#t + 1] = "X-Forwarded-For: "
+        t[#t + 1] = xff and xff .. ", " .. req.remote_ip or req.remote_ip
+        t[#t + 1] = "\r\n"
+        if not req.headers:get("X-Forwarded-Proto") then
+            t[#t + 1] = "X-Forwarded-Proto: "
+            t[#t + 1] = req.protocol
+            t[#t + 1] = "\r\n"
+        end
+    end
+    return table.concat(t)
+end
+
+--- Send the request upstream and wait for the response headers. Failed
+-- requests are tried on other servers, or on a new connection if a idle
+-- one was closed by the server meanwhile, unless the body has been
+-- streamed or the method is not idempotent.
+-- @return Upstream stream, its server and the response headers, or nil, nil
+-- and a status code to respond with.
+function web.ProxyHandler:_proxy_request(group, length)
+    local streamed = self._body_left ~= 0
+    local retry = not streamed and _idempotent_methods[self.request.method]
+    local head = self:_proxy_request_head(group)
+    local tried = {}
+    local fresh = false
+    while true do
+        local server = group:_select(tried)
+        if not server then
+            log.error("[web.lua] No upstream server available.")
+            return nil, nil, 502
+        end
+        local stream, reused = group:_acquire(server, fresh)
+        fresh = false
+        if not stream then
+            tried[server] = true
+            group:_failed(server)
+        else
+            self._proxy_conn = {server, stream}
+            local res, code = self:_proxy_exchange(group, server, stream,
+                head, length)
+            if res then
+                group:_succeeded(server)
+                return stream, server, res
+            end
+            self:_proxy_release(group, false)
+            if code == 504 or not reused then
+                tried[server] = true
+                group:_failed(server)
+            end
+            if not retry or self._body_left ~= 0 then
+                return nil, nil, code
+            end
+            fresh = reused
+        end
+    end
+end
+
+--- Write the request on stream and read the response headers.
+-- @return Response headers, or nil and a status code.
+function web.ProxyHandler:_proxy_exchange(group, server, stream, head, length)
+    local req = self.request
+    stream:write(head)
+    if not req.headers:get("Host") then
+        stream:write("Host: " .. server.name .. "\r\n")
+    end
+    stream:write("\r\n")
+    if self._body_left ~= 0 then
+        local client = req.connection.stream
+        local expect = req.headers:get("Expect")
+        if type(expect) == "string" and expect:lower() == "100-continue" then
+            client:write("HTTP/1.1 100 Continue\r\n\r\n")
+        end
+        self._body_left = length - _proxy_pipe(client, stream, length,
+            group.read_timeout)
+        if self._body_left ~= 0 then
+            return nil, 502
+        end
+    elseif length ~= 0 then
+        stream:write(req.body)
+    end
+    while true do
+        local data, timed_out = _proxy_read(stream, "\r\n\r\n",
+            group.read_timeout)
+        if not data then
+            log.warning(string.format(
+                "[web.lua] Upstream %s %s before responding.",
+                server.name,
+                timed_out and "timed out" or "closed"))
+            return nil, timed_out and 504 or 502
+        end
+        local ok, res = pcall(httputil.HTTPParser, data,
+            httputil.hdr_t["HTTP_RESPONSE"])
+        if not ok then
+            log.warning(string.format(
+                "[web.lua] Invalid response from upstream %s. %s",
+                server.name,
+                tostring(res)))
+            stream:close()
+            return nil, 502
+        end
+        -- Interim responses are not forwarded, Expect was answered here.
+        if res:get_status_code() >= 200 then
+            return res
+        end
+    end
+end
+
+--- Forward the response headers and body to the client.
+function web.ProxyHandler:_proxy_response(group, server, stream, res)
+    local req = self.request
+    local client = req.connection.stream
+    local code = res:get_status_code()
+    local length, chunked
+    if req.method ~= "HEAD" and code ~= 204 and code ~= 304 then
+        local te = res:get("Transfer-Encoding")
+        if type(te) == "table" then
+            te = table.concat(te, ",")
+        end
+        if te then
+            chunked = te:lower():find("chunked", 1, true) ~= nil
+        else
+            length = res:get("Content-Length")
+            if length then
+                length = tonumber(length)
+                if not length or length < 0 or length % 1 ~= 0 then
+                    log.warning(string.format(
+                        "[web.lua] Invalid Content-Length from upstream %s.",
+                        server.name))
+                    self:_proxy_release(group, false)
+                    error(web.HTTPError(502))
+                end
+            end
+        end
+    else
+        length = 0
+    end
+    local http11 = req:supports_http_1_1()
+    -- Bodies delimited by close, and chunked for HTTP/1.0 clients, which
+    -- are sent without the chunk framing, end by closing the connection.
+    local close_client = not length and not (chunked and http11)
+    local t = {"HTTP/1.1 ", code, " ", response_codes[code] or "Unknown",
+        "\r\n"}
+    _proxy_fields(res, t)
+    if chunked and http11 then
+        t[#t + 1] = "Transfer-Encoding: chunked\r\n"
+    end
+    if close_client then
+        t[#t + 1] = "Connection: close\r\n"
+        req.connection.no_keep_alive = true
+    end
+    t[#t + 1] = "\r\n"
+    self._headers_written = true
+    self:set_status(code)
+    if length and length ~= 0 then
+        -- Not for chunked or close delimited bodies, they may be streams
+        -- where held back data would be late.
+        self:_cork()
+    end
+    self.request:write(table.concat(t))
+    local ok
+    if length then
+        ok = length == 0 or
+            _proxy_pipe(stream, client, length, group.read_timeout) == length
+    elseif chunked then
+        ok = self:_proxy_chunks(group, stream, client, http11)
+    else
+        -- Until the upstream closes.
+        local _, timed_out = _proxy_pipe(stream, client, nil,
+            group.read_timeout)
+        ok = not timed_out
+    end
+    local connection = res:get("Connection")
+    if type(connection) == "table" then
+        connection = table.concat(connection, ",")
+    end
+    connection = connection and connection:lower() or ""
+    local keep_alive
+    if res:get_version() == "HTTP/1.1" then
+        keep_alive = not connection:find("close", 1, true)
+    else
+        keep_alive = connection:find("keep-alive", 1, true) ~= nil
+    end
+    self:_proxy_release(group, ok and not close_client and keep_alive)
+    if not ok then
+        -- The client can not tell the response is incomplete otherwise.
+        client:close()
+    end
+    self:finish()
+end
+
+--- Forward a chunked body. With rechunk the chunk framing is kept, else
+-- only the data is sent.
+-- @return true if the whole body was forwarded.
+function web.ProxyHandler:_proxy_chunks(group, stream, client, rechunk)
+    while true do
+        local line = _proxy_read(stream, "\r\n", group.read_timeout)
+        local size = line and line:match("^%x+")
+        size = size and tonumber(size, 16)
+        if not size then
+            stream:close()
+            return false
+        end
+        if rechunk then
+            self.request:write(line)
+        end
+        if size == 0 then
+            -- Trailer fields, up to a empty line.
+            repeat
+                line = _proxy_read(stream, "\r\n", group.read_timeout)
+                if not line then
+                    return false
+                end
+                if rechunk then
+                    self.request:write(line)
+                end
+            until line == "\r\n"
+            return true
+        end
+        if rechunk then
+            -- Data and the line break after it.
+            if _proxy_pipe(stream, client, size + 2,
+                group.read_timeout) ~= size + 2 then
+                return false
+            end
+        elseif _proxy_pipe(stream, client, size, group.read_timeout) ~= size or
+            _proxy_read(stream, "\r\n", group.read_timeout) ~= "\r\n" then
+            return false
+        end
+    end
+end
+
 --- The Application class is a collection of request handler classes that
 -- together make up a web application. Example:
 -- local application = turbo.web.Application({
@@ -1237,6 +1910,13 @@ function web.Application:listen(port, address, kwargs)
     -- To enable SSL remember to set the _G.TURBO_SSL global.
     -- ``key_file`` = SSL key file if a SSL enabled server is wanted.
     -- ``cert_file`` = Certificate file. key_file must also be set.
+    if not kwargs or kwargs.read_body == nil then
+        local app = self
+        kwargs = util.tablemerge({}, kwargs or {})
+        kwargs.read_body = function(request)
+            return app:_read_body(request)
+        end
+    end
     local server = httpserver.HTTPServer:new(self, nil, nil, nil, kwargs)
     server:listen(port, address)
 end
@@ -1261,13 +1941,30 @@ function web.Application:_get_request_handlers(request)
     end
 end
 
+--- Decide if HTTPServer reads the body of request before its handler runs.
+-- Handlers with stream_request_body set read it themselves. The route is
+-- kept for __call.
+-- @param request (HTTPRequest instance)
+-- @return (Boolean)
+function web.Application:_read_body(request)
+    local handler, args, options = self:_get_request_handlers(request)
+    request._route = {handler, args, options}
+    return not (handler and handler.stream_request_body)
+end
+
 local _str_borders_down = string.rep("▼", 80)
 local _str_borders_up = string.rep("▲", 80)
 --- Entry point for requests receive by HTTPServer.
 -- @param request (HTTPRequest instance)
 function web.Application:__call(request)
     local handler = nil
-    local handlers, args, options = self:_get_request_handlers(request)
+    local handlers, args, options
+    local route = request._route
+    if route then
+        handlers, args, options = route[1], route[2], route[3]
+    else
+        handlers, args, options = self:_get_request_handlers(request)
+    end
     if handlers then
         handler = handlers(self, request, args, options)
         local status, err = pcall(handler._execute, handler)
@@ -33,12 +33,15 @@ local log =             require "turbo.log"
 local httputil =        require "turbo.httputil"
 local httpserver =      require "turbo.httpserver"
 local buffer =          require "turbo.structs.buffer"
+local bufferpool =      require "turbo.structs.bufferpool"
 local escape =          require "turbo.escape"
 local util =            require "turbo.util"
 local hash =            require "turbo.hash"
 local platform =        require "turbo.platform"
 local web =             require "turbo.web"
 local async =           require "turbo.async"
+local zlib =            require "turbo.zlib"
+local ioloop =          require "turbo.ioloop"
 local buffer =          require "turbo.structs.buffer"
 require('turbo.3rdparty.middleclass')
 local libturbo_parser = util.load_libtffi()
@@ -72,40 +75,190 @@ ffi.cdef [[
 ]]
 
 local _ws_header = ffi.new("struct ws_header")
-local _ws_mask = ffi.new("int32_t[1]")
 
-local _unmask_payload
+-- XOR a payload in place with a 4 byte mask. Used as transform for the
+-- IOStream, so frames are (un)masked directly in its read and write buffers.
+local _mask_inplace
 if platform.__WINDOWS__ then
-    _unmask_payload = function(mask32, data)
-        local i = ffi.new("size_t", 0)
-        local sz = data:len()
-        local buf = ffi.cast("char*", ffi.C.malloc(data:len()))
-        if buf == nil then
-            error("Could not allocate memory for WebSocket frame masking.\
-                  Catastrophic failure.")
-        end
-        data = ffi.cast("char*", data)
-        local mask = ffi.cast("char*", mask32)
-        while i < sz do
-            buf[i] = bit.bxor(data[i],  mask[i % 4])
-            i = i + 1
-        end
-        local str = ffi.string(buf, sz)
-        ffi.C.free(buf)
-        return str
+    _mask_inplace = function(mask, ptr, sz)
+        local m = {mask:byte(1, 4)}
+        for i = 0, sz - 1 do
+            ptr[i] = bit.bxor(ptr[i], m[i % 4 + 1])
+        end
     end
 else
-    _unmask_payload = function(mask, data)
-        local ptr = libturbo_parser.turbo_websocket_mask(mask, data, data:len())
-        if ptr ~= nil then
-            local str = ffi.string(ptr, data:len())
-            ffi.C.free(ptr)
-            return str
-        else
-            error("Could not allocate memory for WebSocket frame masking.\
-                  Catastrophic failure.")
+    _mask_inplace = function(mask, ptr, sz)
+        libturbo_parser.turbo_websocket_mask_inplace(ptr, mask, sz)
+    end
+end
+
+-- Frames parsed per pass over the read buffer.
+local MAX_FRAMES = 64
+local _frames = ffi.new("struct turbo_ws_frame[?]", MAX_FRAMES)
+local _frames_consumed = ffi.new("size_t[1]")
+local _frames_need = ffi.new("uint64_t[1]")
+
+-- Data frames larger than this are delivered in pieces to streams that
+-- receive messages in chunks, instead of being buffered whole.
+local STREAM_FRAME_SZ = 1024*64
+
+--- Take the next piece of a frame being received in pieces. It is returned
+-- as a single frame, with _chunk_first and _chunk_last telling where in the
+-- real frame it belongs.
+local function _decode_partial(self, ptr, sz, first)
+    local n = math.min(sz, self._partial_remaining, STREAM_FRAME_SZ)
+    if n == 0 and not first then
+        return 0, nil, 1
+    end
+    if self._partial_mask then
+        _mask_inplace(self._partial_mask, ptr, n)
+        -- Next piece starts at a different offset into the mask.
+        local r = n % 4
+        if r ~= 0 then
+            self._partial_mask = self._partial_mask:sub(r + 1) ..
+                self._partial_mask:sub(1, r)
+        end
+    end
+    self._partial_remaining = self._partial_remaining - n
+    self._frame_flags[1] = self._partial_flags
+    self._frame_masked[1] = self._partial_masked
+    self._frame_data[1] = ffi.string(ptr, n)
+    self._chunk_first = first
+    self._chunk_last = self._partial_remaining == 0
+    if self._chunk_last then
+        self._partial_remaining = nil
+    end
+    return n, 1
+end
+
+--- Start receiving a large data frame in pieces.
+-- @param need Size of the frame, header included.
+-- @param unmasked (Boolean) Payload has already been unmasked.
+-- @return Same as _decode_frames, or nil if the frame is not a data frame.
+local function _decode_partial_start(self, ptr, sz, need, unmasked)
+    local b = ffi.cast("const unsigned char *", ptr)
+    if bit.band(b[0], 0xf) >= 0x8 then
+        -- Control frames are small and never split.
+        return
+    end
+    local hdr = 2
+    local len = bit.band(b[1], 0x7f)
+    if len == 126 then
+        hdr = 4
+    elseif len == 127 then
+        hdr = 10
+    end
+    self._partial_masked = bit.band(b[1], 0x80) ~= 0
+    self._partial_mask = nil
+    if self._partial_masked then
+        hdr = hdr + 4
+        if not unmasked then
+            self._partial_mask = ffi.string(ptr + hdr - 4, 4)
+        end
+    end
+    self._partial_flags = b[0]
+    self._partial_remaining = need - hdr
+    local consumed, count = _decode_partial(self, ptr + hdr, sz - hdr, true)
+    return consumed + hdr, count
+end
+
+--- IOStream decoder: parse every complete frame in the read buffer. Payloads
+-- are unmasked in place by the parser and stored in the stream's frame
+-- arrays, the result is the number of frames.
+local function _decode_frames(self, ptr, sz)
+    if self._partial_remaining then
+        return _decode_partial(self, ptr, sz, false)
+    end
+    local n = libturbo_parser.turbo_websocket_parse_frames(ptr,
+                                                           sz,
+                                                           _frames,
+                                                           MAX_FRAMES,
+                                                           _frames_consumed,
+                                                           _frames_need)
+    if n == -1 then
+        return 0, false
+    elseif n == 0 then
+        local need = tonumber(_frames_need[0])
+        if self._stream_chunks and need > STREAM_FRAME_SZ then
+            -- need is only this large once the header is complete.
+            local consumed, count = _decode_partial_start(self, ptr, sz, need)
+            if consumed then
+                return consumed, count
+            end
+        end
+        if need > self.stream.max_buffer_size then
+            return 0, false
+        end
+        return 0, nil, need
+    end
+    if self._stream_chunks then
+        -- Large frames that arrived whole are split up too. Deliver the
+        -- frames before it first.
+        for i = 0, n - 1 do
+            local frame = _frames[i]
+            if frame.len > STREAM_FRAME_SZ and bit.band(frame.flags, 0xf) < 8
+                    then
+                -- Frames after it are parsed again next time, so undo the
+                -- unmasking done by the parser.
+                for j = i + 1, n - 1 do
+                    local f = _frames[j]
+                    if f.masked ~= 0 then
+                        _mask_inplace(ffi.string(ptr + f.offset - 4, 4),
+                                      ptr + f.offset,
+                                      f.len)
+                    end
+                end
+                if i == 0 then
+                    return _decode_partial_start(
+                        self, ptr, sz, tonumber(frame.offset + frame.len), true)
+                end
+                if frame.masked ~= 0 then
+                    _mask_inplace(ffi.string(ptr + frame.offset - 4, 4),
+                                  ptr + frame.offset,
+                                  frame.len)
+                end
+                n = i
+                frame = _frames[i - 1]
+                _frames_consumed[0] = frame.offset + frame.len
+                break
+            end
         end
     end
+    self._chunk_first = nil
+    self._chunk_last = nil
+    local flags = self._frame_flags
+    local masked = self._frame_masked
+    local data = self._frame_data
+    for i = 0, n - 1 do
+        local frame = _frames[i]
+        flags[i + 1] = frame.flags
+        masked[i + 1] = frame.masked ~= 0
+        data[i + 1] = ffi.string(ptr + frame.offset, frame.len)
+    end
+    return tonumber(_frames_consumed[0]), n
+end
+
+-- Frame header for a payload of sz bytes, as a Lua string. The length is
+-- always in network byte order.
+local function _frame_header(flags, sz, masked)
+    local mask_bit = masked and 0x80 or 0x0
+    if sz < 126 then
+        return string.char(flags, bor(sz, mask_bit))
+    elseif sz <= 0xffff then
+        return string.char(flags, bor(126, mask_bit),
+                           bit.rshift(sz, 8), bit.band(sz, 0xff))
+    end
+    local hi = math.floor(sz / 0x100000000)
+    local lo = sz % 0x100000000
+    return string.char(flags, bor(127, mask_bit),
+        bit.band(bit.rshift(hi, 24), 0xff),
+        bit.band(bit.rshift(hi, 16), 0xff),
+        bit.band(bit.rshift(hi, 8), 0xff),
+        bit.band(hi, 0xff),
+        bit.band(bit.rshift(lo, 24), 0xff),
+        bit.band(bit.rshift(lo, 16), 0xff),
+        bit.band(bit.rshift(lo, 8), 0xff),
+        bit.band(lo, 0xff))
 end
 
 local websocket = {}
@@ -124,6 +277,17 @@ websocket.opcode = {
     -- 0xB-F Reserved
 }
 
+--- Status codes sent in close frames (RFC 6455 7.4.1).
+websocket.close_code = {
+    NORMAL =            1000,
+    GOING_AWAY =        1001,
+    PROTOCOL_ERROR =    1002,
+    UNSUPPORTED_DATA =  1003,
+    INVALID_PAYLOAD =   1007, -- E.g text message that is not UTF-8.
+    POLICY_VIOLATION =  1008,
+    MESSAGE_TOO_BIG =   1009
+}
+
 websocket.errors = {
      INVALID_URL = -1 -- URL could not be parsed.
     ,INVALID_SCHEMA = -2 -- Invalid URL schema
@@ -143,6 +307,211 @@ websocket.errors = {
     ,WEBSOCKET_PROTOCOL_ERROR = -16
 }
 
+--- Frame header bit marking the first frame of a compressed message
+-- (RFC 7692 6).
+local RSV1 = 0x40
+-- A sync flush always ends with an empty stored block. permessage-deflate
+-- strips it on send and the receiver appends it back (RFC 7692 7.2.1).
+local DEFLATE_TAIL = "\0\0\255\255"
+
+--- Default permessage-deflate settings. Keys given in the compression table
+-- for WebSocketHandler or WebSocketClient override these.
+websocket.COMPRESSION_DEFAULTS = {
+    level = 6, -- zlib compression level.
+    mem_level = 8, -- zlib memory level, 1-9.
+    threshold = 256, -- Messages shorter than this are sent uncompressed.
+    -- Max size of a inflated message. Default is the stream max buffer size.
+    max_message_size = nil,
+    server_no_context_takeover = false,
+    client_no_context_takeover = false,
+    server_max_window_bits = 15,
+    client_max_window_bits = 15
+}
+
+local function _compression_config(opts)
+    local cfg = {}
+    for k, v in pairs(websocket.COMPRESSION_DEFAULTS) do
+        cfg[k] = v
+    end
+    if type(opts) == "table" then
+        for k, v in pairs(opts) do
+            cfg[k] = v
+        end
+    end
+    for _, k in ipairs({"server_max_window_bits", "client_max_window_bits"}) do
+        if type(cfg[k]) ~= "number" or cfg[k] < 8 or cfg[k] > 15 then
+            error(strf("Invalid permessage-deflate %s: %s", k,
+                       tostring(cfg[k])))
+        end
+    end
+    return cfg
+end
+
+--- Parse a Sec-WebSocket-Extensions value into a list of extensions, each a
+-- table with the lower case name and a table of parameters. Parameters
+-- without a value are true. Extensions with repeated parameters are marked
+-- invalid.
+local function _parse_extensions(value)
+    local extensions = {}
+    if type(value) == "table" then
+        value = table.concat(value, ",")
+    end
+    if not value then
+        return extensions
+    end
+    for ext in value:gmatch("[^,]+") do
+        local name
+        local params = {}
+        local invalid = false
+        for part in ext:gmatch("[^;]+") do
+            part = escape.trim(part)
+            if not name then
+                name = part:lower()
+            elseif part ~= "" then
+                local k, v = part:match("^([^=]+)=(.*)$")
+                if k then
+                    k = escape.trim(k):lower()
+                    v = (escape.trim(v):gsub('^"(.*)"$', "%1"))
+                else
+                    k = part:lower()
+                    v = true
+                end
+                if params[k] ~= nil then
+                    invalid = true
+                end
+                params[k] = v
+            end
+        end
+        if name and name ~= "" then
+            extensions[#extensions + 1] = {
+                name = name,
+                params = params,
+                invalid = invalid
+            }
+        end
+    end
+    return extensions
+end
+
+local function _window_bits(v)
+    if type(v) ~= "string" or not v:match("^%d%d?$") then
+        return nil
+    end
+    local bits = tonumber(v)
+    if bits < 8 or bits > 15 then
+        return nil
+    end
+    return bits
+end
+
+--- Server side: accept a permessage-deflate offer from a client.
+-- @return Negotiated parameters and the response extension string, or nil
+-- if the offer can not be accepted.
+local function _accept_deflate_offer(params, cfg)
+    local server_bits = cfg.server_max_window_bits
+    local server_nct = cfg.server_no_context_takeover
+    local client_nct = cfg.client_no_context_takeover
+    local client_bits
+    for k, v in pairs(params) do
+        if k == "server_no_context_takeover" and v == true then
+            server_nct = true
+        elseif k == "client_no_context_takeover" and v == true then
+            client_nct = true
+        elseif k == "server_max_window_bits" then
+            local bits = _window_bits(v)
+            if not bits then
+                return nil
+            end
+            server_bits = math.min(server_bits, bits)
+        elseif k == "client_max_window_bits" then
+            -- The client may only be limited if it announced support.
+            client_bits = cfg.client_max_window_bits
+            if v ~= true then
+                local bits = _window_bits(v)
+                if not bits then
+                    return nil
+                end
+                client_bits = math.min(client_bits, bits)
+            end
+        else
+            return nil
+        end
+    end
+    local response = {"permessage-deflate"}
+    if server_nct then
+        response[#response + 1] = "server_no_context_takeover"
+    end
+    if client_nct then
+        response[#response + 1] = "client_no_context_takeover"
+    end
+    if server_bits < 15 then
+        response[#response + 1] = "server_max_window_bits=" .. server_bits
+    end
+    if client_bits and client_bits < 15 then
+        response[#response + 1] = "client_max_window_bits=" .. client_bits
+    end
+    return {
+        window_bits = server_bits,
+        deflate_no_context = server_nct,
+        inflate_no_context = client_nct
+    }, table.concat(response, "; ")
+end
+
+--- Client side: create the permessage-deflate offer.
+local function _deflate_offer(cfg)
+    local offer = {"permessage-deflate"}
+    if cfg.server_no_context_takeover then
+        offer[#offer + 1] = "server_no_context_takeover"
+    end
+    if cfg.client_no_context_takeover then
+        offer[#offer + 1] = "client_no_context_takeover"
+    end
+    if cfg.server_max_window_bits < 15 then
+        offer[#offer + 1] = "server_max_window_bits=" ..
+            cfg.server_max_window_bits
+    end
+    if cfg.client_max_window_bits < 15 then
+        offer[#offer + 1] = "client_max_window_bits=" ..
+            cfg.client_max_window_bits
+    else
+        offer[#offer + 1] = "client_max_window_bits"
+    end
+    return table.concat(offer, "; ")
+end
+
+--- Client side: validate the servers response to our offer.
+-- @return Negotiated parameters or nil if the response is invalid.
+local function _accept_deflate_response(params, cfg)
+    local client_bits = cfg.client_max_window_bits
+    local client_nct = cfg.client_no_context_takeover
+    local server_nct = false
+    for k, v in pairs(params) do
+        if k == "server_no_context_takeover" and v == true then
+            server_nct = true
+        elseif k == "client_no_context_takeover" and v == true then
+            client_nct = true
+        elseif k == "server_max_window_bits" then
+            local bits = _window_bits(v)
+            if not bits or bits > cfg.server_max_window_bits then
+                return nil
+            end
+        elseif k == "client_max_window_bits" then
+            local bits = _window_bits(v)
+            if not bits then
+                return nil
+            end
+            client_bits = math.min(client_bits, bits)
+        else
+            return nil
+        end
+    end
+    return {
+        window_bits = client_bits,
+        deflate_no_context = client_nct,
+        inflate_no_context = server_nct
+    }
+end
+
 --- WebSocketStream is a abstraction for a WebSocket connection,
 -- used as class mixin in WebSocketHandler and WebSocketClient.
 websocket.WebSocketStream = {}
@@ -153,17 +522,26 @@ websocket.WebSocketStream = {}
 -- @param binary (Boolean) Treat the message as binary data (use WebSocket binary
 -- opcode).
 -- If the connection has been closed a error is raised.
+-- @return true while the connection accepts more messages, false once more
+-- than the high write watermark is waiting to be sent. See wait_writable.
 function websocket.WebSocketStream:write_message(msg, binary)
     if self._closed == true then
         error("WebSocket connection has been closed. Can not write message.")
     end
+    if self._send_opcode then
+        error("Can not write message while a message sent with \
+            begin_message() is in progress.")
+    end
     if type(msg) == "table" then
         msg = escape.json_encode(msg)
     end
-    self:_send_frame(true,
-                     binary and
-                        websocket.opcode.BINARY or websocket.opcode.TEXT,
-                     msg)
+    local opcode = binary and websocket.opcode.BINARY or websocket.opcode.TEXT
+    if self._compression and msg:len() >= self._compression.threshold then
+        msg = self:_compress_message(msg)
+        opcode = bor(opcode, RSV1)
+    end
+    self:_send_frame(true, opcode, msg)
+    return self.stream:writable()
 end
 
 --- Send a pong reply to the server.
@@ -179,10 +557,17 @@ function websocket.WebSocketStream:ping(data, callback, callback_arg)
 end
 
 --- Close the connection.
-function websocket.WebSocketStream:close()
+-- @param code (Number) Optional status code from websocket.close_code.
+-- @param reason (String) Optional reason, only sent with a status code.
+function websocket.WebSocketStream:close(code, reason)
     self._closed = true
     local _self = self
-    self:_send_frame(true, websocket.opcode.CLOSE, "", function()
+    local payload = ""
+    if code then
+        payload = string.char(bit.rshift(code, 8), bit.band(code, 0xff)) ..
+            (reason or "")
+    end
+    self:_send_frame(true, websocket.opcode.CLOSE, payload, function()
         _self.stream:close()
     end)
 end
@@ -193,116 +578,491 @@ function websocket.WebSocketStream:closed()
     return self._closed
 end
 
---- Accept a new WebSocket frame.
-function websocket.WebSocketStream:_accept_frame(header)
-    local ws_header = ffi.cast("struct ws_header *", header)
-    self._final_bit = bit.band(ws_header.flags, 0x80) ~= 0
-    self._rsv1_bit = bit.band(ws_header.flags, 0x40) ~= 0
-    self._rsv2_bit = bit.band(ws_header.flags, 0x20) ~= 0
-    self._rsv3_bit = bit.band(ws_header.flags, 0x10) ~= 0
-    self._opcode = bit.band(ws_header.flags, 0xf)
-    self._mask_bit = bit.band(ws_header.len, 0x80) ~= 0
-    -- A server MUST reject any unmasked frame from a client (RFC 6455 5.1).
-    -- mask_outgoing is only truthy on the client side of the stream, so this
-    -- fires for server handlers and is skipped for clients reading the server.
-    if not self.mask_outgoing and not self._mask_bit then
-        self:_error(
-            "WebSocket protocol error: \
-            received an unmasked frame from a client.")
+--- Coalesce outgoing frames. Instead of being written one at a time, frames
+-- are queued and handed to the IOStream together with a single writev(2)
+-- once the current IOLoop iteration is done, or after max_latency_ms.
+-- Control frames are never delayed. Useful for connections sending many
+-- small messages in bursts.
+-- @param max_latency_ms (Number) Longest time a frame may be held back.
+-- 0 flushes at the end of the current IOLoop iteration. nil disables
+-- coalescing.
+-- @param max_bytes (Number) Flush as soon as this many bytes are queued.
+-- Default is 64KB.
+function websocket.WebSocketStream:set_coalescing(max_latency_ms, max_bytes)
+    if max_latency_ms == nil then
+        self:_flush_send_queue()
+        self._coalesce = nil
         return
     end
-    local payload_len = bit.band(ws_header.len, 0x7f)
-    if self._opcode == websocket.opcode.CLOSE and payload_len >= 126 then
-        self:_error(
-            "WebSocket protocol error: \
-            Received CLOSE opcode with greater than 126 payload.")
-        return
+    self._coalesce = {
+        max_latency = max_latency_ms,
+        max_bytes = max_bytes or 1024*64
+    }
+    self._send_queue = self._send_queue or {}
+    self._send_queue_frames = self._send_queue_frames or 0
+    self._send_queue_bytes = self._send_queue_bytes or 0
+end
+
+--- Outbound queue depth, to let applications detect slow consumers.
+-- @return Number of frames waiting to be flushed by coalescing and the
+-- number of bytes not yet written to the socket, including those frames.
+function websocket.WebSocketStream:send_queue_depth()
+    local frames = self._send_queue_frames or 0
+    local bytes = self._send_queue_bytes or 0
+    if self.stream then
+        bytes = bytes + self.stream:pending_write_bytes()
+    end
+    return frames, bytes
+end
+
+--- Set the write watermarks of the connection, see
+-- IOStream:set_write_watermarks. The pressure and drain events are
+-- delivered to on_pressure and on_drain.
+-- @param high (Number) High watermark in bytes.
+-- @param low (Number) Optional low watermark in bytes.
+function websocket.WebSocketStream:set_write_watermarks(high, low)
+    self.stream:set_write_watermarks(high, low)
+end
+
+--- Wait until the connection is below its high write watermark, e.g
+-- before writing the next message of a large transfer to a slow peer.
+-- Without a callback the running coroutine is suspended until then.
+-- @param callback (Function) Optional callback, called with true when more
+-- messages can be written or false if the connection was closed.
+-- @param arg Optional argument for callback.
+-- @return (Boolean) Without callback: true if writable, false if closed.
+function websocket.WebSocketStream:wait_writable(callback, arg)
+    return self.stream:wait_writable(callback, arg)
+end
+
+--- Deliver write pressure events of the IOStream.
+function websocket.WebSocketStream:_setup_write_pressure()
+    self.stream:set_pressure_callback(self._write_pressure, self)
+    self.stream:set_drain_callback(self._write_drained, self)
+end
+
+--- Add a frame to the coalescing queue and schedule a flush.
+function websocket.WebSocketStream:_queue_frame(finflag, opcode, data,
+    callback, callback_arg)
+    local queue = self._send_queue
+    local flags = bor(finflag and 0x80 or 0x0, opcode)
+    local sz = data:len()
+    if self.mask_outgoing == true then
+        local ws_mask = util.secure_random_bytes(4)
+        local buf = buffer(sz)
+        buf:append_luastr_right(data)
+        local ptr = buf:get()
+        _mask_inplace(ws_mask, ptr, sz)
+        queue[#queue + 1] = _frame_header(flags, sz, true) .. ws_mask
+        queue[#queue + 1] = tostring(buf)
+    else
+        queue[#queue + 1] = _frame_header(flags, sz)
+        queue[#queue + 1] = data
+    end
+    self._send_queue_frames = self._send_queue_frames + 1
+    self._send_queue_bytes = self._send_queue_bytes + queue[#queue]:len() +
+        queue[#queue - 1]:len()
+    if callback then
+        -- Like IOStream writes, the callback runs when everything queued
+        -- so far has been written.
+        self._send_queue_callback = callback
+        self._send_queue_callback_arg = callback_arg
     end
-    if payload_len < 126 then
-        self._payload_len = payload_len
-        if self._mask_bit then
-            self.stream:read_bytes(4, self._frame_mask_key, self)
+    local c = self._coalesce
+    if opcode >= websocket.opcode.CLOSE or
+        self._send_queue_bytes >= c.max_bytes then
+        self:_flush_send_queue()
+    elseif not self._send_queue_scheduled then
+        self._send_queue_scheduled = true
+        local io_loop = self.stream.io_loop
+        if c.max_latency == 0 then
+            io_loop:add_callback(self._flush_send_queue, self)
         else
-            self.stream:read_bytes(self._payload_len,
-                                   self._frame_payload,
-                                   self)
+            self._send_queue_timeout = io_loop:add_timeout(
+                util.gettimemonotonic() + c.max_latency,
+                self._flush_send_queue,
+                self)
         end
-    elseif payload_len == 126 then
-        -- 16 bit length.
-        self.stream:read_bytes(2, self._frame_len_16, self)
-    elseif payload_len == 127 then
-        -- 64 bit length.
-        self.stream:read_bytes(8, self._frame_len_64, self)
     end
 end
 
-if le then
-    local _tmp_convert_16 = ffi.new("uint16_t[1]")
-    function websocket.WebSocketStream:_frame_len_16(data)
-        -- Network byte order for multi-byte length values.
-        -- What were they thinking!
-        ffi.copy(_tmp_convert_16, data, 2)
-        self._payload_len = tonumber(ffi.C.ntohs(_tmp_convert_16[0]))
-        if self._mask_bit then
-            self.stream:read_bytes(4, self._frame_mask_key, self)
-        else
-            self.stream:read_bytes(self._payload_len,
-                                   self._frame_payload,
-                                   self)
-        end
+--- Write all queued frames to the IOStream.
+function websocket.WebSocketStream:_flush_send_queue()
+    if self._send_queue_timeout then
+        self.stream.io_loop:remove_timeout(self._send_queue_timeout)
+        self._send_queue_timeout = nil
+    end
+    self._send_queue_scheduled = false
+    local queue = self._send_queue
+    if not queue or #queue == 0 then
+        return
+    end
+    local callback = self._send_queue_callback
+    local callback_arg = self._send_queue_callback_arg
+    self._send_queue = {}
+    self._send_queue_frames = 0
+    self._send_queue_bytes = 0
+    self._send_queue_callback = nil
+    self._send_queue_callback_arg = nil
+    if self.stream:closed() then
+        return
     end
+    self.stream:writev(queue, callback, callback_arg)
+end
 
-    local _tmp_convert_64 = ffi.new("uint64_t[1]")
-    function websocket.WebSocketStream:_frame_len_64(data)
-        ffi.copy(_tmp_convert_64, data, 8)
-        self._payload_len = tonumber(
-            ENDIAN_SWAP_U64(_tmp_convert_64[0]))
-        if self._mask_bit then
-            self.stream:read_bytes(4, self._frame_mask_key, self)
-        else
-            self.stream:read_bytes(self._payload_len,
-                                   self._frame_payload,
-                                   self)
+--- Set up permessage-deflate with negotiated parameters.
+function websocket.WebSocketStream:_setup_compression(cfg, negotiated)
+    self._compression = {
+        level = cfg.level,
+        mem_level = cfg.mem_level,
+        threshold = cfg.threshold,
+        max_message_size = cfg.max_message_size,
+        window_bits = negotiated.window_bits,
+        deflate_no_context = negotiated.deflate_no_context,
+        inflate_no_context = negotiated.inflate_no_context
+    }
+    if negotiated.window_bits < 9 then
+        -- zlib can not produce raw deflate with a 256 byte window. Sending
+        -- every message uncompressed is always allowed.
+        self._compression.threshold = math.huge
+    end
+end
+
+--- Compress a piece of a message. Without context takeover the zlib stream
+-- is only borrowed from the pool until the last piece is compressed.
+-- @param last (Boolean) Last piece of the message.
+function websocket.WebSocketStream:_deflate(data, last)
+    local c = self._compression
+    local d = self._deflater or
+        zlib.acquire_deflate(c.level, -c.window_bits, c.mem_level)
+    data = d:deflate(data, data:len(), zlib.SYNC_FLUSH)
+    if last and c.deflate_no_context then
+        zlib.release_deflate(d)
+        self._deflater = nil
+    else
+        self._deflater = d
+    end
+    if last then
+        data = data:sub(1, -5)
+        if data:len() == 0 then
+            -- Nothing new since the last flush, zlib produced no output.
+            -- Send the header of a empty stored block so the tail the peer
+            -- appends completes it.
+            data = "\0"
         end
     end
-elseif be then
-    -- Network byte order is big-endian, so on a BE host the wire bytes are
-    -- already in host order, no conversion needed.
-    local _tmp_convert_16 = ffi.new("uint16_t[1]")
-    function websocket.WebSocketStream:_frame_len_16(data)
-        ffi.copy(_tmp_convert_16, data, 2)
-        self._payload_len = tonumber(_tmp_convert_16[0])
-        if self._mask_bit then
-            self.stream:read_bytes(4, self._frame_mask_key, self)
-        else
-            self.stream:read_bytes(self._payload_len,
-                                   self._frame_payload,
-                                   self)
+    return data
+end
+
+--- Compress a complete message.
+function websocket.WebSocketStream:_compress_message(msg)
+    return self:_deflate(msg, true)
+end
+
+--- Decompress a piece of a message.
+-- @param last (Boolean) Last piece of the message.
+-- @return Inflated data, or nil and a error message.
+function websocket.WebSocketStream:_inflate(data, last)
+    local c = self._compression
+    local inf = self._inflater
+    if not inf then
+        -- The peer window is at most 15 bits, so a full window inflates
+        -- anything it negotiated.
+        inf = zlib.acquire_inflate(zlib.RAW)
+        inf.max_output = c.max_message_size or self.stream.max_buffer_size
+    end
+    if last then
+        self._message_compressed = false
+        data = data .. DEFLATE_TAIL
+    end
+    local res, err = inf:inflate(data)
+    if not res or (last and c.inflate_no_context) then
+        zlib.release_inflate(inf)
+        self._inflater = nil
+    else
+        if last and inf.finished then
+            -- Peer ended the deflate stream with a final block.
+            inf:reset()
         end
+        self._inflater = inf
     end
+    return res, err
+end
+
+--- Decompress a complete message.
+-- @return Inflated message, or nil and a error message.
+function websocket.WebSocketStream:_decompress_message(data)
+    return self:_inflate(data, true)
+end
 
-    local _tmp_convert_64 = ffi.new("uint64_t[1]")
-    function websocket.WebSocketStream:_frame_len_64(data)
-        ffi.copy(_tmp_convert_64, data, 8)
-        self._payload_len = tonumber(_tmp_convert_64[0])
-        if self._mask_bit then
-            self.stream:read_bytes(4, self._frame_mask_key, self)
+--- Deliver a piece of a data frame to a stream receiving messages in chunks.
+-- Fragments are passed on as they arrive instead of being reassembled.
+-- @return true if the stream should keep reading.
+function websocket.WebSocketStream:_stream_payload(data)
+    local opcode = self._opcode
+    if self._chunk_first ~= false then
+        if opcode == websocket.opcode.CONTINUE then
+            if not self._chunk_opcode then
+                self:_protocol_error(
+                    "WebSocket protocol error: \
+                    CONTINUE opcode, but theres nothing to continue.")
+                return
+            end
+        elseif self._chunk_opcode then
+            self:_protocol_error(
+                "WebSocket protocol error: \
+                previous CONTINUE opcode not finished.")
+            return
         else
-            self.stream:read_bytes(self._payload_len,
-                                   self._frame_payload,
-                                   self)
+            self._chunk_opcode = opcode
+        end
+    end
+    local last = self._final_bit and self._chunk_last ~= false
+    if self._message_compressed then
+        local err
+        data, err = self:_inflate(data, last)
+        if not data then
+            self:_protocol_error("WebSocket protocol error: \
+                could not inflate message. " .. err)
+            return
         end
     end
+    if self._chunk_opcode == websocket.opcode.TEXT and
+            not self:_valid_utf8(data, last) then
+        self:_invalid_utf8()
+        return
+    end
+    local binary = self._chunk_opcode == websocket.opcode.BINARY
+    if last then
+        self._chunk_opcode = nil
+    elseif data:len() == 0 then
+        return true
+    end
+    if self._closed ~= true then
+        self:_message_chunk(data, last, binary)
+    end
+    return true
+end
+
+--- Start sending a message in pieces, for messages too large to hold in
+-- memory at once. Send the pieces with write_fragment() and finish with
+-- end_message(). Other messages can not be sent until then, control frames
+-- can.
+-- @param binary (Boolean) Send a binary message.
+function websocket.WebSocketStream:begin_message(binary)
+    if self._closed == true then
+        error("WebSocket connection has been closed. Can not write message.")
+    end
+    if self._send_opcode then
+        error("WebSocket message already in progress.")
+    end
+    self._send_opcode = binary and websocket.opcode.BINARY or
+        websocket.opcode.TEXT
+    local c = self._compression
+    if c and c.threshold ~= math.huge then
+        -- Size is unknown up front, so compress regardless of threshold.
+        self._send_opcode = bor(self._send_opcode, RSV1)
+        self._send_compressed = true
+    else
+        self._send_compressed = false
+    end
+end
+
+--- Send a piece of the message started with begin_message().
+-- @param data (String) Data, may be empty.
+-- @param callback (Function) Optional callback called when the data has been
+-- written to the socket.
+-- @param callback_arg Optional argument for callback.
+function websocket.WebSocketStream:write_fragment(data, callback, callback_arg)
+    self:_write_fragment(false, data, callback, callback_arg)
+end
+
+--- Send the last piece of the message started with begin_message().
+-- @param data (String) Optional data.
+-- @param callback (Function) Optional callback called when the message has
+-- been written to the socket.
+-- @param callback_arg Optional argument for callback.
+function websocket.WebSocketStream:end_message(data, callback, callback_arg)
+    self:_write_fragment(true, data or "", callback, callback_arg)
+end
+
+function websocket.WebSocketStream:_write_fragment(fin, data, callback,
+    callback_arg)
+    if self._closed == true then
+        error("WebSocket connection has been closed. Can not write message.")
+    end
+    local opcode = self._send_opcode
+    if not opcode then
+        error("No WebSocket message in progress, call begin_message() first.")
+    end
+    if self._send_compressed then
+        data = self:_deflate(data, fin)
+    end
+    -- The opcode, and RSV1, only go in the first frame.
+    self._send_opcode = websocket.opcode.CONTINUE
+    if fin then
+        self._send_opcode = nil
+    end
+    self:_send_frame(fin, opcode, data, callback, callback_arg)
+end
+
+--- Return zlib streams held by the connection to the pools.
+function websocket.WebSocketStream:_release_compression()
+    if self._deflater then
+        zlib.release_deflate(self._deflater)
+        self._deflater = nil
+    end
+    if self._inflater then
+        zlib.release_inflate(self._inflater)
+        self._inflater = nil
+    end
+end
+
+local _utf8_state_ct = ffi.typeof("struct turbo_utf8_state")
+
+--- Validate the next piece of a text message. Characters may be split
+-- between pieces.
+-- @param last (Boolean) Last piece of the message.
+function websocket.WebSocketStream:_valid_utf8(data, last)
+    local state = self._utf8_state
+    if not state then
+        state = _utf8_state_ct()
+        self._utf8_state = state
+    end
+    local valid = libturbo_parser.turbo_utf8_validate(data,
+                                                      data:len(),
+                                                      state) == 1
+    if last or not valid then
+        valid = valid and state.len == 0
+        state.len = 0
+    end
+    return valid
+end
+
+--- Validate a text frame as it arrives. Compressed messages are validated
+-- once inflated.
+-- @return false if the connection was closed because of invalid UTF-8.
+function websocket.WebSocketStream:_check_utf8(data)
+    local opcode = self._opcode
+    if opcode == websocket.opcode.CONTINUE then
+        opcode = self._fragmented_message_opcode
+    end
+    if opcode ~= websocket.opcode.TEXT or self._message_compressed or
+            self:_valid_utf8(data, self._final_bit) then
+        return true
+    end
+    self:_invalid_utf8()
+    return false
+end
+
+--- Close the connection with status 1007 after a text message that is not
+-- valid UTF-8.
+function websocket.WebSocketStream:_invalid_utf8()
+    local msg = "WebSocket protocol error: \
+        text message is not valid UTF-8."
+    if self._closed ~= true and not self.stream:closed() then
+        self:close(websocket.close_code.INVALID_PAYLOAD, "Invalid UTF-8")
+    end
+    if not self.mask_outgoing then
+        self:_error(msg)
+        return
+    end
+    -- WebSocketClient:_error would close the stream before the close frame
+    -- is sent.
+    log.error(msg)
+    if type(self.kwargs.on_error) == "function" then
+        self.kwargs.on_error(self,
+                             websocket.errors.WEBSOCKET_PROTOCOL_ERROR,
+                             msg)
+    end
+end
+
+--- Report a protocol error from code shared by the server and client.
+function websocket.WebSocketStream:_protocol_error(msg)
+    if self.mask_outgoing then
+        self:_error(websocket.errors.WEBSOCKET_PROTOCOL_ERROR, msg)
+    else
+        self:_error(msg)
+    end
 end
 
-function websocket.WebSocketStream:_frame_mask_key(data)
-    self._frame_mask = data
-    self.stream:read_bytes(self._payload_len, self._masked_frame_payload, self)
+--- Read all complete frames in the stream buffer in one pass.
+function websocket.WebSocketStream:_read_frames()
+    self.stream:read_decoded(_decode_frames, self, self._handle_frames, self)
+end
+
+--- Dispatch frames parsed by _decode_frames.
+-- @param count Number of frames, or false if a invalid frame was received.
+function websocket.WebSocketStream:_handle_frames(count)
+    local data = self._frame_data
+    if count == false then
+        self:_protocol_error(
+            "WebSocket protocol error: \
+            invalid frame length.")
+        return
+    end
+    for i = 1, count do
+        local payload = data[i]
+        data[i] = nil
+        if self._closed == true or self.stream:closed() then
+            return
+        end
+        -- Pieces of a frame after the first carry no header.
+        if self._chunk_first ~= false and
+                not self:_accept_frame(self._frame_flags[i],
+                                       self._frame_masked[i],
+                                       payload:len()) then
+            return
+        end
+        if not self:_frame_payload(payload) then
+            return
+        end
+    end
+    if self._closed ~= true and not self.stream:closed() then
+        self:_read_frames()
+    end
 end
 
-function websocket.WebSocketStream:_masked_frame_payload(data)
-    local unmasked = _unmask_payload(self._frame_mask, data)
-    self:_frame_payload(unmasked)
+--- Accept a new WebSocket frame.
+-- @return true if the frame is valid.
+function websocket.WebSocketStream:_accept_frame(flags, masked, payload_len)
+    self._final_bit = bit.band(flags, 0x80) ~= 0
+    self._rsv1_bit = bit.band(flags, 0x40) ~= 0
+    self._rsv2_bit = bit.band(flags, 0x20) ~= 0
+    self._rsv3_bit = bit.band(flags, 0x10) ~= 0
+    self._opcode = bit.band(flags, 0xf)
+    self._mask_bit = masked
+    if self._rsv2_bit or self._rsv3_bit or (self._rsv1_bit and
+            (not self._compression or self._opcode == 0 or self._opcode > 7))
+            then
+        -- RSV1 is only defined for the first frame of a data message, and
+        -- only when permessage-deflate is negotiated.
+        self:_protocol_error(
+            "WebSocket protocol error: \
+            received a frame with unexpected reserved bits set.")
+        return false
+    end
+    if self._opcode == websocket.opcode.TEXT or
+            self._opcode == websocket.opcode.BINARY then
+        self._message_compressed = self._rsv1_bit
+    end
+    -- A server MUST reject any unmasked frame from a client (RFC 6455 5.1).
+    -- mask_outgoing is only truthy on the client side of the stream, so this
+    -- fires for server handlers and is skipped for clients reading the server.
+    if not self.mask_outgoing and not self._mask_bit then
+        self:_protocol_error(
+            "WebSocket protocol error: \
+            received an unmasked frame from a client.")
+        return false
+    end
+    if self._opcode == websocket.opcode.CLOSE and payload_len >= 126 then
+        self:_protocol_error(
+            "WebSocket protocol error: \
+            Received CLOSE opcode with greater than 126 payload.")
+        return false
+    end
+    self._payload_len = payload_len
+    return true
 end
 
 if le then
@@ -313,6 +1073,10 @@ if le then
         if self.stream:closed() then
             return
         end
+        if self._coalesce then
+            self:_queue_frame(finflag, opcode, data, callback, callback_arg)
+            return
+        end
 
         local data_sz = data:len()
         _ws_header.flags = bit.bor(finflag and 0x80 or 0x0, opcode)
@@ -340,14 +1104,10 @@ if le then
 
         if self.mask_outgoing == true then
             -- Create a random mask from OS entropy.
-            local ws_mask = ffi.new("unsigned char[4]")
-            local rnd = util.secure_random_bytes(4)
-            ws_mask[0] = rnd:byte(1)
-            ws_mask[1] = rnd:byte(2)
-            ws_mask[2] = rnd:byte(3)
-            ws_mask[3] = rnd:byte(4)
-            self.stream:write(ffi.string(ws_mask, 4))
-            self.stream:write(_unmask_payload(ws_mask, data), callback, callback_arg)
+            local ws_mask = util.secure_random_bytes(4)
+            self.stream:write(ws_mask)
+            self.stream:write_transform(data, _mask_inplace, ws_mask,
+                                        callback, callback_arg)
             return
         end
 
@@ -362,6 +1122,10 @@ elseif be then
         if self.stream:closed() then
             return
         end
+        if self._coalesce then
+            self:_queue_frame(finflag, opcode, data, callback, callback_arg)
+            return
+        end
 
         local data_sz = data:len()
         _ws_header.flags = bit.bor(finflag and 0x80 or 0x0, opcode)
@@ -387,14 +1151,10 @@ elseif be then
 
         if self.mask_outgoing == true then
             -- Create a random mask from OS entropy.
-            local ws_mask = ffi.new("unsigned char[4]")
-            local rnd = util.secure_random_bytes(4)
-            ws_mask[0] = rnd:byte(1)
-            ws_mask[1] = rnd:byte(2)
-            ws_mask[2] = rnd:byte(3)
-            ws_mask[3] = rnd:byte(4)
-            self.stream:write(ffi.string(ws_mask, 4))
-            self.stream:write(_unmask_payload(ws_mask, data), callback, callback_arg)
+            local ws_mask = util.secure_random_bytes(4)
+            self.stream:write(ws_mask)
+            self.stream:write_transform(data, _mask_inplace, ws_mask,
+                                        callback, callback_arg)
             return
         end
 
@@ -404,6 +1164,339 @@ elseif be then
 end
 
 
+--- Frame a message, unmasked, in a new Buffer.
+local function _encode_frame(flags, payload)
+    local sz = payload:len()
+    local header = _frame_header(flags, sz)
+    local buf = buffer(header:len() + sz)
+    buf:append_luastr_right(header)
+    buf:append_luastr_right(payload)
+    return buf
+end
+
+--- Default slow consumer policy for websocket.broadcast.
+websocket.BROADCAST_POLICY = {
+    -- Connections with more bytes than this waiting to be written are slow
+    -- consumers.
+    max_pending = 1024*1024,
+    -- "skip" drops the message for slow consumers, "close" disconnects them.
+    slow = "skip"
+}
+
+-- Check if a broadcast can be sent to h, applying the slow consumer policy.
+local function _broadcast_ready(h, max_pending, slow_policy, slow)
+    local stream = h.stream
+    if h._closed == true or not stream or stream:closed() or
+            h._send_opcode then
+        -- Frames of other messages can not go in the middle of a
+        -- message sent in pieces.
+        return false
+    end
+    if stream:pending_write_bytes() > max_pending then
+        slow[#slow + 1] = h
+        if slow_policy == "close" then
+            log.warning(strf(
+                "[websocket.lua] Closing slow consumer with %d bytes \
+                pending.", stream:pending_write_bytes()))
+            h._closed = true
+            stream:close()
+        end
+        return false
+    end
+    return true
+end
+
+local function _broadcast_policy(policy)
+    return policy and policy.max_pending or
+        websocket.BROADCAST_POLICY.max_pending,
+        policy and policy.slow or websocket.BROADCAST_POLICY.slow
+end
+
+--- Send a message to many WebSocketHandler connections. The message is
+-- serialized and framed once, into a Buffer that every stream sends from
+-- directly instead of copying it into its write buffer. Connections using
+-- compression with context takeover must compress for themselves; all others
+-- with the same compression settings share one compressed frame.
+-- @param handlers (Table) List of WebSocketHandler instances. Closed
+-- connections are ignored.
+-- @param msg The message to send. This may be either a JSON-serializable
+-- table or a string.
+-- @param binary (Boolean) Treat the message as binary data.
+-- @param policy (Table) Optional, overrides keys in
+-- websocket.BROADCAST_POLICY.
+-- @return Number of connections the message was sent to and a list of the
+-- slow consumers that were skipped or closed.
+function websocket.broadcast(handlers, msg, binary, policy)
+    local max_pending, slow_policy = _broadcast_policy(policy)
+    if type(msg) == "table" then
+        msg = escape.json_encode(msg)
+    end
+    local opcode = binary and websocket.opcode.BINARY or websocket.opcode.TEXT
+    local frames = {}
+    local sent = 0
+    local slow = {}
+    for i = 1, #handlers do
+        local h = handlers[i]
+        if _broadcast_ready(h, max_pending, slow_policy, slow) then
+            local c = h._compression
+            local key, flags
+            if h.mask_outgoing then
+                -- Client side streams mask every frame differently.
+                h:write_message(msg, binary)
+            elseif c and msg:len() >= c.threshold then
+                if c.deflate_no_context then
+                    key = strf("%d:%d:%d", c.level, c.window_bits,
+                               c.mem_level)
+                    flags = bor(0x80, RSV1, opcode)
+                else
+                    h:_send_frame(true, bor(opcode, RSV1),
+                                  h:_compress_message(msg))
+                end
+            else
+                key = ""
+                flags = bor(0x80, opcode)
+            end
+            if key then
+                local frame = frames[key]
+                if not frame then
+                    frame = _encode_frame(flags, key == "" and msg or
+                                          h:_compress_message(msg))
+                    frames[key] = frame
+                end
+                if h._coalesce then
+                    -- Keep the order of frames already queued.
+                    h:_flush_send_queue()
+                end
+                h.stream:write_shared(frame)
+            end
+            sent = sent + 1
+        end
+    end
+    return sent, slow
+end
+
+--- Frame a message once, unmasked and uncompressed, for
+-- websocket.broadcast_frame.
+-- @param msg The message to send. This may be either a JSON-serializable
+-- table or a string.
+-- @param binary (Boolean) Treat the message as binary data.
+-- @return (Buffer) The frame.
+function websocket.encode_message(msg, binary)
+    if type(msg) == "table" then
+        msg = escape.json_encode(msg)
+    end
+    return _encode_frame(
+        bor(0x80, binary and websocket.opcode.BINARY or websocket.opcode.TEXT),
+        msg)
+end
+
+--- Send a frame made by websocket.encode_message to many WebSocketHandler
+-- connections, all sending from the same Buffer. Compression is not applied.
+-- @param handlers (Table) List of WebSocketHandler instances. Closed and
+-- client side connections are ignored.
+-- @param frame (Buffer) The frame.
+-- @param policy (Table) Optional, overrides keys in
+-- websocket.BROADCAST_POLICY.
+-- @return Number of connections the frame was sent to and a list of the
+-- slow consumers that were skipped or closed.
+function websocket.broadcast_frame(handlers, frame, policy)
+    local max_pending, slow_policy = _broadcast_policy(policy)
+    local sent = 0
+    local slow = {}
+    for i = 1, #handlers do
+        local h = handlers[i]
+        if not h.mask_outgoing and
+                _broadcast_ready(h, max_pending, slow_policy, slow) then
+            if h._coalesce then
+                h:_flush_send_queue()
+            end
+            h.stream:write_shared(frame)
+            sent = sent + 1
+        end
+    end
+    return sent, slow
+end
+
+--- Default keepalive settings.
+websocket.KEEPALIVE_DEFAULTS = {
+    -- Time between pings to each connection in milliseconds.
+    interval = 30000,
+    -- Resolution of the timer wheel in milliseconds. Pings are sent up to
+    -- this much late.
+    tick = 1000,
+    -- Close connections that have not answered this many pings in a row.
+    max_missed = 2
+}
+
+-- Payload prefix of keepalive pings.
+local KEEPALIVE_PREFIX = "turbo-ka:"
+
+--- Keepalive manager. Pings connections on a timer wheel driven by one
+-- IOLoop interval. Each connection sits in the wheel slot it is due in, so a
+-- tick only visits the connections that are due. The round trip time of
+-- every ping is recorded and connections that stop answering are closed.
+websocket.KeepAlive = class("KeepAlive")
+
+--- Create a new KeepAlive instance.
+-- @param opts (Table) Optional, overrides keys in
+-- websocket.KEEPALIVE_DEFAULTS.
+-- @param io_loop (IOLoop instance) Defaults to ioloop.instance().
+function websocket.KeepAlive:initialize(opts, io_loop)
+    opts = type(opts) == "table" and opts or {}
+    local defaults = websocket.KEEPALIVE_DEFAULTS
+    self.interval = opts.interval or defaults.interval
+    self.tick = opts.tick or defaults.tick
+    self.max_missed = opts.max_missed or defaults.max_missed
+    self.io_loop = io_loop or ioloop.instance()
+    self._slots = math.max(1, math.ceil(self.interval / self.tick))
+    self._wheel = {}
+    for i = 1, self._slots do
+        self._wheel[i] = {}
+    end
+    self._pos = 1
+    self._count = 0
+    self._last_tick = util.gettimemonotonic()
+    self._interval_ref = nil
+end
+
+--- Start pinging a connection.
+-- @param conn WebSocketHandler or WebSocketClient instance.
+function websocket.KeepAlive:add(conn)
+    if conn._keepalive then
+        conn._keepalive:remove(conn)
+    end
+    -- Due a full interval from now, the current slot is visited last.
+    local slot = self._pos
+    self._wheel[slot][conn] = true
+    conn._keepalive = self
+    conn._keepalive_slot = slot
+    conn._keepalive_missed = 0
+    conn._keepalive_ping = nil
+    self._count = self._count + 1
+    if not self._interval_ref then
+        self._last_tick = util.gettimemonotonic()
+        self._interval_ref = self.io_loop:set_interval(self.tick,
+                                                       self._on_tick,
+                                                       self)
+    end
+end
+
+--- Stop pinging a connection.
+function websocket.KeepAlive:remove(conn)
+    if conn._keepalive ~= self then
+        return
+    end
+    self._wheel[conn._keepalive_slot][conn] = nil
+    conn._keepalive = nil
+    conn._keepalive_slot = nil
+    self._count = self._count - 1
+    if self._count == 0 and self._interval_ref then
+        self.io_loop:clear_interval(self._interval_ref)
+        self._interval_ref = nil
+    end
+end
+
+--- Number of connections managed.
+function websocket.KeepAlive:count()
+    return self._count
+end
+
+function websocket.KeepAlive:_on_tick()
+    local now = util.gettimemonotonic()
+    -- Catch up on ticks delayed by a busy IOLoop.
+    local ticks = math.min(math.max(1,
+        math.floor((now - self._last_tick) / self.tick)), self._slots)
+    self._last_tick = now
+    for _ = 1, ticks do
+        self._pos = self._pos % self._slots + 1
+        local slot = self._wheel[self._pos]
+        for conn in pairs(slot) do
+            self:_ping(conn, now)
+        end
+    end
+end
+
+function websocket.KeepAlive:_ping(conn, now)
+    local stream = conn.stream
+    if conn._closed == true or not stream or stream:closed() then
+        self:remove(conn)
+        return
+    end
+    if conn._keepalive_ping then
+        conn._keepalive_missed = conn._keepalive_missed + 1
+        if conn._keepalive_missed >= self.max_missed then
+            log.warning(strf(
+                "[websocket.lua] Closing connection that missed %d pings.",
+                conn._keepalive_missed))
+            self:remove(conn)
+            -- The peer is gone, so do not wait for a close handshake.
+            conn._closed = true
+            stream:close()
+            return
+        end
+    end
+    -- The send time goes in the payload, so a late pong still gives the
+    -- right round trip time.
+    conn._keepalive_ping = true
+    conn:_send_frame(true, websocket.opcode.PING, KEEPALIVE_PREFIX .. now)
+end
+
+local _keepalive_managers = setmetatable({}, {__mode = "k"})
+
+--- Get a KeepAlive instance shared by all connections on the IOLoop using
+-- the same settings.
+-- @param opts (Table) Settings, or true for websocket.KEEPALIVE_DEFAULTS.
+-- @param io_loop (IOLoop instance) Defaults to ioloop.instance().
+function websocket.keepalive_manager(opts, io_loop)
+    io_loop = io_loop or ioloop.instance()
+    opts = type(opts) == "table" and opts or {}
+    local defaults = websocket.KEEPALIVE_DEFAULTS
+    local key = strf("%d:%d:%d", opts.interval or defaults.interval,
+                     opts.tick or defaults.tick,
+                     opts.max_missed or defaults.max_missed)
+    local managers = _keepalive_managers[io_loop]
+    if not managers then
+        managers = {}
+        _keepalive_managers[io_loop] = managers
+    end
+    if not managers[key] then
+        managers[key] = websocket.KeepAlive(opts, io_loop)
+    end
+    return managers[key]
+end
+
+--- Round trip time of the last answered keepalive ping.
+-- @return (Number) Milliseconds, or nil if no keepalive ping has been
+-- answered yet.
+function websocket.WebSocketStream:rtt()
+    return self._rtt
+end
+
+--- Start keepalive pings with the given settings, see
+-- websocket.KEEPALIVE_DEFAULTS. nil stops them.
+function websocket.WebSocketStream:set_keepalive(opts)
+    if opts then
+        websocket.keepalive_manager(opts, self.stream.io_loop):add(self)
+    elseif self._keepalive then
+        self._keepalive:remove(self)
+    end
+end
+
+--- Check if a pong answers a keepalive ping.
+-- @return true if it did, the pong is then not passed on.
+function websocket.WebSocketStream:_keepalive_pong(data)
+    if data:sub(1, KEEPALIVE_PREFIX:len()) ~= KEEPALIVE_PREFIX then
+        return false
+    end
+    local sent = tonumber(data:sub(KEEPALIVE_PREFIX:len() + 1))
+    if sent then
+        self._rtt = util.gettimemonotonic() - sent
+    end
+    self._keepalive_ping = nil
+    self._keepalive_missed = 0
+    return true
+end
+
 --- WebSocket Server
 -- Must be used in turbo.web.Application.
 websocket.WebSocketHandler = class("WebSocketHandler", web.RequestHandler)
@@ -424,9 +1517,40 @@ function websocket.WebSocketHandler:open() end
 -- @param msg (String) The receive message.
 function websocket.WebSocketHandler:on_message(msg) end
 
+--- Optional. If a subclass defines on_message_chunk(chunk, last, binary) it
+-- is called instead of on_message with the pieces of each message as they
+-- arrive, so that large messages never have to be held in memory whole.
+-- "last" is true for the final piece of a message, "binary" is true for
+-- binary messages.
+websocket.WebSocketHandler.on_message_chunk = nil
+
+function websocket.WebSocketHandler:_message_chunk(chunk, last, binary)
+    self:on_message_chunk(chunk, last, binary)
+end
+
 --- Called when the connection is closed.
 function websocket.WebSocketHandler:on_close() end
 
+--- Optional. If a subclass defines on_pressure() it is called when more
+-- than the high write watermark is waiting to be sent to the client, and
+-- on_drain() when that has drained to the low watermark. Producers, e.g a
+-- broadcast, can skip or pause a slow client in between. See
+-- set_write_watermarks.
+websocket.WebSocketHandler.on_pressure = nil
+websocket.WebSocketHandler.on_drain = nil
+
+function websocket.WebSocketHandler:_write_pressure()
+    if self.on_pressure then
+        self:on_pressure()
+    end
+end
+
+function websocket.WebSocketHandler:_write_drained()
+    if self.on_drain then
+        self:on_drain()
+    end
+end
+
 --- Called when a error is raised.
 function websocket.WebSocketHandler:on_error(msg) end
 
@@ -444,6 +1568,26 @@ function websocket.WebSocketHandler:prepare() end
 -- the request is done by either raising error or returning nil.
 function websocket.WebSocketHandler:subprotocol(protocols) end
 
+--- Called if the client offers the permessage-deflate extension. Return nil
+-- to decline compression, true to use websocket.COMPRESSION_DEFAULTS or a
+-- table overriding some of them. The default implementation returns the
+-- "compression" key of the options table given in the Application route.
+function websocket.WebSocketHandler:compression_options()
+    if type(self.options) == "table" then
+        return self.options.compression
+    end
+end
+
+--- Keepalive settings for the connection. Return nil to not send keepalive
+-- pings, true to use websocket.KEEPALIVE_DEFAULTS or a table overriding some
+-- of them. The default implementation returns the "keepalive" key of the
+-- options table given in the Application route.
+function websocket.WebSocketHandler:keepalive_options()
+    if type(self.options) == "table" then
+        return self.options.keepalive
+    end
+end
+
 --- Main entry point for the Application class.
 function websocket.WebSocketHandler:_execute()
     if self.request.method ~= "GET" then
@@ -496,6 +1640,11 @@ function websocket.WebSocketHandler:_execute()
             self.subprotocol = selected_protocol
         end
     end
+    local extensions = _parse_extensions(
+        self.request.headers:get("Sec-WebSocket-Extensions", true))
+    if #extensions ~= 0 then
+        self:_negotiate_compression(extensions)
+    end
     -- Origin can be used by client applications to either accept or deny
     -- a request. This responsibility is left up to each developer to handle
     -- in e.g the prepare() method.
@@ -512,6 +1661,26 @@ function websocket.WebSocketHandler:_execute()
     self:_continue_ws()
 end
 
+function websocket.WebSocketHandler:_negotiate_compression(extensions)
+    local opts = self:compression_options()
+    if not opts then
+        return
+    end
+    local cfg = _compression_config(opts)
+    for i = 1, #extensions do
+        local ext = extensions[i]
+        if ext.name == "permessage-deflate" and not ext.invalid then
+            local negotiated, response =
+                _accept_deflate_offer(ext.params, cfg)
+            if negotiated then
+                self:_setup_compression(cfg, negotiated)
+                self._extensions_header = response
+                return
+            end
+        end
+    end
+end
+
 function websocket.WebSocketHandler:_calculate_ws_accept()
     assert(escape.base64_decode(self.sec_websocket_key):len() == 16,
            "Sec-WebSocket-Key is of invalid size.")
@@ -531,6 +1700,9 @@ function websocket.WebSocketHandler:_create_response_header()
         -- Set user selected subprotocol string.
         header:add("Sec-WebSocket-Protocol", self.subprotocol)
     end
+    if self._extensions_header then
+        header:add("Sec-WebSocket-Extensions", self._extensions_header)
+    end
     return header:stringify_as_response()
 end
 
@@ -548,6 +1720,15 @@ function websocket.WebSocketHandler:_socket_closed()
         self.request.headers:get_url(),
         self.request.remote_ip,
         self.request:request_time()))
+    self:_release_compression()
+    self:set_keepalive(nil)
+    bufferpool.release(self._fragmented_message_buffer)
+    self._fragmented_message_buffer = nil
+    if self._buses then
+        for bus in pairs(self._buses) do
+            bus:unsubscribe_all(self)
+        end
+    end
     self:on_close()
 end
 
@@ -555,18 +1736,40 @@ end
 -- to WebSocket.
 function websocket.WebSocketHandler:_continue_ws()
     self.stream:set_close_callback(self._socket_closed, self)
-    self._fragmented_message_buffer = buffer(1024)
-    self.stream:read_bytes(2, self._accept_frame, self)
+    -- Upgraded connections do not write HTTP responses.
+    if self._write_buffer then
+        bufferpool.release(self._write_buffer)
+        self._write_buffer = nil
+    end
+    self._fragmented_message_buffer = bufferpool.acquire(1024)
+    self._frame_flags = {}
+    self._frame_masked = {}
+    self._frame_data = {}
+    self._stream_chunks = self.on_message_chunk ~= nil
+    self:_setup_write_pressure()
+    local keepalive = self:keepalive_options()
+    if keepalive then
+        self:set_keepalive(keepalive)
+    end
+    self:_read_frames()
     self:open(unpack(self._url_args or {}))
 end
 
 function websocket.WebSocketHandler:_frame_payload(data)
     local opcode
-    if self._opcode == websocket.opcode.CLOSE then
+    if self._stream_chunks and self._opcode < websocket.opcode.CLOSE then
+        return self:_stream_payload(data)
+    end
+    if not self:_check_utf8(data) then
+        return
+    end
+    if self._opcode >= websocket.opcode.CLOSE then
+        -- Control frames may be sent between the fragments of a message,
+        -- but are never fragmented themselves.
         if not self._final_bit then
             self:_error(
                 "WebSocket protocol error: \
-                CLOSE opcode was fragmented.")
+                control frame was fragmented.")
             return
         end
         opcode = self._opcode
@@ -602,6 +1805,22 @@ function websocket.WebSocketHandler:_frame_payload(data)
         end
     end
     if self._final_bit == true then
+        if self._message_compressed and
+                (opcode == websocket.opcode.TEXT or
+                 opcode == websocket.opcode.BINARY) then
+            local err
+            data, err = self:_decompress_message(data)
+            if not data then
+                self:_error("WebSocket protocol error: \
+                    could not inflate message. " .. err)
+                return
+            end
+            if opcode == websocket.opcode.TEXT and
+                    not self:_valid_utf8(data, true) then
+                self:_invalid_utf8()
+                return
+            end
+        end
         self:_handle_opcode(opcode, data)
     end
     -- Fragments are only cleared on the final frame (above), so a peer that
@@ -613,9 +1832,7 @@ function websocket.WebSocketHandler:_frame_payload(data)
             fragmented message exceeds max buffer size.")
         return
     end
-    if self._closed ~= true then
-        self.stream:read_bytes(2, self._accept_frame, self)
-    end
+    return true
 end
 
 function websocket.WebSocketHandler:_handle_opcode(opcode, data)
@@ -630,6 +1847,9 @@ function websocket.WebSocketHandler:_handle_opcode(opcode, data)
     elseif opcode == websocket.opcode.PING then
         self:_send_frame(true, websocket.opcode.PONG, data)
     elseif opcode == websocket.opcode.PONG then
+        if self:_keepalive_pong(data) then
+            return
+        end
         if self._ping_callback then
             local callback = self._ping_callback
             local arg = self._ping_callback_arg
@@ -659,12 +1879,15 @@ end
 --      on_connect =         function(self) end,
 --      on_close =           function(self) end,
 --      on_ping =            function(self, data) end,
+--      on_pressure =        function(self) end,
+--      on_drain =           function(self) end,
 --      modify_headers =     function(header) end,
 --      request_timeout =    10,
 --      connect_timeout =    10,
 --      user_agent =         "Turbo WS Client v1.1",
 --      cookie =             "Bla",
---      websocket_protocol = "meh"
+--      websocket_protocol = "meh",
+--      compression =        true
 --  })
 websocket.WebSocketClient = class("WebSocketClient")
 websocket.WebSocketClient:include(websocket.WebSocketStream)
@@ -674,6 +1897,10 @@ function websocket.WebSocketClient:initialize(address, kwargs)
     self.address = address
     self.kwargs = kwargs or {}
     self._connect_time = util.gettimemonotonic()
+    local compression_cfg
+    if self.kwargs.compression then
+        compression_cfg = _compression_config(self.kwargs.compression)
+    end
     self.http_cli = async.HTTPClient(self.kwargs.ssl_options,
                                      self.kwargs.ioloop,
                                      self.kwargs.max_buffer_size)
@@ -703,6 +1930,10 @@ function websocket.WebSocketClient:initialize(address, kwargs)
             elseif self.kwargs.websocket_protocol then
                 error("Invalid type of \"websocket_protocol\" value")
             end
+            if compression_cfg then
+                http_header:add("Sec-WebSocket-Extensions",
+                                _deflate_offer(compression_cfg))
+            end
             if type(self.kwargs.modify_headers) == "function" then
                 -- User can modify header in callback.
                 _modify_headers_success = self:_protected_call(
@@ -756,14 +1987,33 @@ function websocket.WebSocketClient:initialize(address, kwargs)
     -- Store ref. for IOStream in the HTTPClient.
     self.stream = self.http_cli.iostream
     assert(self.stream:closed() == false, "Connection were closed.")
+    local extensions = _parse_extensions(
+        res.headers:get("Sec-WebSocket-Extensions", true))
+    for i = 1, #extensions do
+        local ext = extensions[i]
+        local negotiated
+        -- A client must fail the connection if the server accepts
+        -- extensions it did not offer, or uses invalid parameters.
+        if compression_cfg and not self._compression and
+                ext.name == "permessage-deflate" and not ext.invalid then
+            negotiated = _accept_deflate_response(ext.params, compression_cfg)
+        end
+        if not negotiated then
+            self:_error(websocket.errors.WEBSOCKET_PROTOCOL_ERROR,
+                        strf("Server accepted invalid extension \"%s\".",
+                             ext.name))
+            return
+        end
+        self:_setup_compression(compression_cfg, negotiated)
+    end
     log.success(string.format(
         [[[websocket.lua] WebSocketClient connection open %s]],
         self.address))
     self:_continue_ws()
 end
 
-function websocket.WebSocketClient:_protected_call(name, func, arg, data)
-    local status, err = pcall(func, arg, data)
+function websocket.WebSocketClient:_protected_call(name, func, arg, ...)
+    local status, err = pcall(func, arg, ...)
     if status ~= true then
         local err_msg = strf(
             "WebSocketClient at %p unhandled error in callback \"%s\":\n",
@@ -776,12 +2026,32 @@ function websocket.WebSocketClient:_protected_call(name, func, arg, data)
     return true
 end
 
+function websocket.WebSocketClient:_write_pressure()
+    if type(self.kwargs.on_pressure) == "function" then
+        self:_protected_call("on_pressure", self.kwargs.on_pressure, self)
+    end
+end
+
+function websocket.WebSocketClient:_write_drained()
+    if type(self.kwargs.on_drain) == "function" then
+        self:_protected_call("on_drain", self.kwargs.on_drain, self)
+    end
+end
+
 --- Called after HTTP handshake has passed and connection has been upgraded
 -- to WebSocket.
 function websocket.WebSocketClient:_continue_ws()
     self.stream:set_close_callback(self._socket_closed, self)
-    self._fragmented_message_buffer = buffer(1024)
-    self.stream:read_bytes(2, self._accept_frame, self)
+    self._fragmented_message_buffer = bufferpool.acquire(1024)
+    self._frame_flags = {}
+    self._frame_masked = {}
+    self._frame_data = {}
+    self._stream_chunks = type(self.kwargs.on_message_chunk) == "function"
+    self:_setup_write_pressure()
+    if self.kwargs.keepalive then
+        self:set_keepalive(self.kwargs.keepalive)
+    end
+    self:_read_frames()
     if type(self.kwargs.on_connect) == "function" then
         self:_protected_call("on_connect", self.kwargs.on_connect, self)
     end
@@ -801,11 +2071,19 @@ end
 
 function websocket.WebSocketClient:_frame_payload(data)
     local opcode
-    if self._opcode == websocket.opcode.CLOSE then
+    if self._stream_chunks and self._opcode < websocket.opcode.CLOSE then
+        return self:_stream_payload(data)
+    end
+    if not self:_check_utf8(data) then
+        return
+    end
+    if self._opcode >= websocket.opcode.CLOSE then
+        -- Control frames may be sent between the fragments of a message,
+        -- but are never fragmented themselves.
         if not self._final_bit then
             self:_error(websocket.errors.WEBSOCKET_PROTOCOL_ERROR,
                 "WebSocket protocol error: \
-                CLOSE opcode was fragmented.")
+                control frame was fragmented.")
             return
         end
         opcode = self._opcode
@@ -841,6 +2119,23 @@ function websocket.WebSocketClient:_frame_payload(data)
         end
     end
     if self._final_bit == true then
+        if self._message_compressed and
+                (opcode == websocket.opcode.TEXT or
+                 opcode == websocket.opcode.BINARY) then
+            local err
+            data, err = self:_decompress_message(data)
+            if not data then
+                self:_error(websocket.errors.WEBSOCKET_PROTOCOL_ERROR,
+                    "WebSocket protocol error: \
+                    could not inflate message. " .. err)
+                return
+            end
+            if opcode == websocket.opcode.TEXT and
+                    not self:_valid_utf8(data, true) then
+                self:_invalid_utf8()
+                return
+            end
+        end
         self:_handle_opcode(opcode, data)
     end
     -- Bound the reassembly buffer; a server that never sends a final frame
@@ -851,9 +2146,16 @@ function websocket.WebSocketClient:_frame_payload(data)
             fragmented message exceeds max buffer size.")
         return
     end
-    if self._closed ~= true then
-        self.stream:read_bytes(2, self._accept_frame, self)
-    end
+    return true
+end
+
+function websocket.WebSocketClient:_message_chunk(chunk, last, binary)
+    self:_protected_call("on_message_chunk",
+                         self.kwargs.on_message_chunk,
+                         self,
+                         chunk,
+                         last,
+                         binary)
 end
 
 function websocket.WebSocketClient:_handle_opcode(opcode, data)
@@ -880,6 +2182,9 @@ function websocket.WebSocketClient:_handle_opcode(opcode, data)
             self:pong(data)
         end
     elseif opcode == websocket.opcode.PONG then
+        if self:_keepalive_pong(data) then
+            return
+        end
         if self._ping_callback then
             local callback = self._ping_callback
             local arg = self._ping_callback_arg
@@ -904,6 +2209,10 @@ function websocket.WebSocketClient:_socket_closed()
         [[[websocket.lua] WebSocketClient closed %s %dms]],
         self.address,
         util.gettimemonotonic() - self._connect_time))
+    self:_release_compression()
+    self:set_keepalive(nil)
+    bufferpool.release(self._fragmented_message_buffer)
+    self._fragmented_message_buffer = nil
     if type(self.kwargs.on_close) == "function" then
         self:_protected_call("on_close", self.kwargs.on_close, self)
     end
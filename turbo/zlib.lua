@@ -0,0 +1,312 @@
+--- Turbo.lua zlib module.
+-- Streaming compression and decompression through the system zlib library,
+-- used for HTTP content encoding and WebSocket compression.
+--
+-- Copyright 2026 John Abrahamsen
+--
+-- Licensed under the Apache License, Version 2.0 (the "License");
+-- you may not use this file except in compliance with the License.
+-- You may obtain a copy of the License at
+--
+-- http://www.apache.org/licenses/LICENSE-2.0
+--
+-- Unless required by applicable law or agreed to in writing, software
+-- distributed under the License is distributed on an "AS IS" BASIS,
+-- WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+-- See the License for the specific language governing permissions and
+-- limitations under the License.
+
+local ffi = require "ffi"
+local buffer = require "turbo.structs.buffer"
+require "turbo.cdef"
+require "turbo.3rdparty.middleclass"
+
+local ok, lz = pcall(ffi.load, os.getenv("TURBO_LIBZ") or "z")
+if not ok then
+    -- Runtime only installs ship libz.so.1 without the development symlink.
+    ok, lz = pcall(ffi.load, "libz.so.1")
+end
+
+local zlib = {} -- zlib namespace
+
+--- Is zlib loaded and usable?
+zlib.available = ok
+
+zlib.NO_FLUSH =     0
+zlib.SYNC_FLUSH =   2
+zlib.FULL_FLUSH =   3
+zlib.FINISH =       4
+
+--- Window bits for the different stream formats.
+zlib.ZLIB =     15 -- zlib wrapper (RFC 1950).
+zlib.GZIP =     31 -- gzip wrapper (RFC 1952).
+zlib.AUTO =     47 -- Inflate only, detect zlib or gzip wrapper.
+zlib.RAW =      -15 -- No wrapper (RFC 1951).
+
+local Z_OK =            0
+local Z_STREAM_END =    1
+local Z_BUF_ERROR =     -5
+local Z_DEFLATED =      8
+local Z_DEFAULT_STRATEGY = 0
+
+-- Scratch output area shared by all streams. Output is always moved into a
+-- Buffer before returning, so it is never held across calls.
+local CHUNK_SZ = 1024*16
+local _chunk = ffi.new("unsigned char[?]", CHUNK_SZ)
+
+local function _check_available()
+    if not zlib.available then
+        error("zlib is not available. Set TURBO_LIBZ to the library path.")
+    end
+end
+
+local function _errmsg(strm, rc)
+    if strm.msg ~= nil then
+        return ffi.string(strm.msg)
+    end
+    return string.format("zlib error %d", rc)
+end
+
+--- Inflate class.
+-- Decompresses a stream fed in arbitrary sized pieces.
+zlib.Inflate = class("Inflate")
+
+--- Create a new Inflate instance.
+-- @param window_bits (Number) One of zlib.ZLIB, zlib.GZIP, zlib.AUTO or
+-- zlib.RAW, or any value accepted by inflateInit2. Defaults to zlib.AUTO.
+-- @param max_output (Number) Optional limit on the number of bytes one call
+-- to inflate() may produce. Guards against decompression bombs.
+function zlib.Inflate:initialize(window_bits, max_output)
+    _check_available()
+    self.window_bits = window_bits or zlib.AUTO
+    self.max_output = max_output
+    self.finished = false
+    self._out = buffer(CHUNK_SZ)
+    self.strm = ffi.new("z_stream")
+    local rc = lz.inflateInit2_(self.strm,
+                                self.window_bits,
+                                lz.zlibVersion(),
+                                ffi.sizeof("z_stream"))
+    if rc ~= Z_OK then
+        error("Could not initialize inflate stream. " ..
+              _errmsg(self.strm, rc))
+    end
+    ffi.gc(self.strm, lz.inflateEnd)
+end
+
+--- Inflate a piece of the compressed stream.
+-- @param data (String or char *) Compressed data.
+-- @param len (Number) Length of data. Optional if data is a Lua string.
+-- @return (String) Decompressed data, may be empty. On failure nil and an
+-- error message is returned.
+function zlib.Inflate:inflate(data, len)
+    local strm = self.strm
+    local out = self._out
+    out:clear()
+    if self.finished then
+        -- Trailing garbage after the end of stream is ignored.
+        return ""
+    end
+    strm.next_in = ffi.cast("const unsigned char *", data)
+    strm.avail_in = len or data:len()
+    repeat
+        strm.next_out = _chunk
+        strm.avail_out = CHUNK_SZ
+        local rc = lz.inflate(strm, zlib.NO_FLUSH)
+        if rc ~= Z_OK and rc ~= Z_STREAM_END and rc ~= Z_BUF_ERROR then
+            strm.next_in = nil
+            return nil, _errmsg(strm, rc)
+        end
+        out:append_right(_chunk, CHUNK_SZ - strm.avail_out)
+        if self.max_output and out:len() > self.max_output then
+            strm.next_in = nil
+            return nil, "Decompressed data exceeds size limit."
+        end
+        if rc == Z_STREAM_END then
+            self.finished = true
+            break
+        end
+    until strm.avail_out ~= 0
+    -- Do not keep a reference to memory we do not own.
+    strm.next_in = nil
+    strm.avail_in = 0
+    return tostring(out)
+end
+
+--- Reset the stream so that the instance can be reused for a new stream,
+-- without the cost of reallocating the inflate state.
+function zlib.Inflate:reset()
+    lz.inflateReset(self.strm)
+    self.finished = false
+    self._out:clear()
+    return self
+end
+
+--- Deflate class.
+-- Compresses a stream fed in arbitrary sized pieces.
+zlib.Deflate = class("Deflate")
+
+--- Create a new Deflate instance.
+-- @param level (Number) Compression level 0-9. Default is zlib default (6).
+-- @param window_bits (Number) One of zlib.ZLIB, zlib.GZIP or zlib.RAW, or
+-- any value accepted by deflateInit2. Defaults to zlib.ZLIB.
+-- @param mem_level (Number) 1-9, how much memory to use for the internal
+-- compression state. Default is 8.
+function zlib.Deflate:initialize(level, window_bits, mem_level)
+    _check_available()
+    self.level = level or -1
+    self.window_bits = window_bits or zlib.ZLIB
+    self.mem_level = mem_level or 8
+    self._out = buffer(CHUNK_SZ)
+    self.strm = ffi.new("z_stream")
+    local rc = lz.deflateInit2_(self.strm,
+                                self.level,
+                                Z_DEFLATED,
+                                self.window_bits,
+                                self.mem_level,
+                                Z_DEFAULT_STRATEGY,
+                                lz.zlibVersion(),
+                                ffi.sizeof("z_stream"))
+    if rc ~= Z_OK then
+        error("Could not initialize deflate stream. " ..
+              _errmsg(self.strm, rc))
+    end
+    ffi.gc(self.strm, lz.deflateEnd)
+end
+
+--- Deflate a piece of the stream.
+-- @param data (String or char *) Data to compress.
+-- @param len (Number) Length of data. Optional if data is a Lua string.
+-- @param flush (Number) zlib.NO_FLUSH, zlib.SYNC_FLUSH, zlib.FULL_FLUSH or
+-- zlib.FINISH. Default is zlib.NO_FLUSH.
+-- @return (String) Compressed data produced so far, may be empty.
+function zlib.Deflate:deflate(data, len, flush)
+    local strm = self.strm
+    local out = self._out
+    flush = flush or zlib.NO_FLUSH
+    out:clear()
+    strm.next_in = ffi.cast("const unsigned char *", data)
+    strm.avail_in = len or data:len()
+    while true do
+        strm.next_out = _chunk
+        strm.avail_out = CHUNK_SZ
+        local rc = lz.deflate(strm, flush)
+        if rc ~= Z_OK and rc ~= Z_STREAM_END and rc ~= Z_BUF_ERROR then
+            strm.next_in = nil
+            error("Could not deflate data. " .. _errmsg(strm, rc))
+        end
+        out:append_right(_chunk, CHUNK_SZ - strm.avail_out)
+        if rc == Z_STREAM_END or
+            (flush ~= zlib.FINISH and strm.avail_out ~= 0) then
+            break
+        end
+    end
+    strm.next_in = nil
+    strm.avail_in = 0
+    return tostring(out)
+end
+
+--- Reset the stream so that the instance can be reused for a new stream.
+function zlib.Deflate:reset()
+    lz.deflateReset(self.strm)
+    self._out:clear()
+    return self
+end
+
+--- Compress a Lua string in one go.
+-- @param data (String) Data to compress.
+-- @param window_bits (Number) Stream format. Default is zlib.GZIP.
+-- @param level (Number) Compression level.
+function zlib.compress(data, window_bits, level)
+    local d = zlib.Deflate(level, window_bits or zlib.GZIP)
+    return d:deflate(data, data:len(), zlib.FINISH)
+end
+
+--- Decompress a Lua string in one go.
+-- @param data (String) Data to decompress.
+-- @param window_bits (Number) Stream format. Default is zlib.AUTO.
+-- @return (String) Decompressed data or nil and error message.
+function zlib.decompress(data, window_bits)
+    local inf = zlib.acquire_inflate(window_bits or zlib.AUTO)
+    local res, err = inf:inflate(data)
+    zlib.release_inflate(inf)
+    return res, err
+end
+
+--- Inflate streams are relatively expensive to create (about 7KB of state
+-- plus a 32KB window allocated on first use), so keep a pool of reset
+-- instances per window bits value.
+zlib.POOL_MAX = 32
+local _inflate_pool = {}
+
+--- Get a Inflate instance from the pool, or create a new one.
+-- @param window_bits (Number) Stream format.
+function zlib.acquire_inflate(window_bits)
+    window_bits = window_bits or zlib.AUTO
+    local pool = _inflate_pool[window_bits]
+    if pool and #pool > 0 then
+        local inf = pool[#pool]
+        pool[#pool] = nil
+        return inf
+    end
+    return zlib.Inflate(window_bits)
+end
+
+--- Return a Inflate instance to the pool. It must not be used by the caller
+-- afterwards.
+-- @param inf (Inflate instance)
+function zlib.release_inflate(inf)
+    inf.max_output = nil
+    local pool = _inflate_pool[inf.window_bits]
+    if not pool then
+        pool = {}
+        _inflate_pool[inf.window_bits] = pool
+    end
+    if #pool < zlib.POOL_MAX then
+        pool[#pool + 1] = inf:reset()
+    end
+end
+
+--- Deflate streams are even larger, (1 << (window_bits + 2)) +
+-- (1 << (mem_level + 9)) bytes, about 256KB with the defaults. Connections
+-- that reset their compression context per message borrow one from this
+-- pool instead of holding it while idle.
+local _deflate_pool = {}
+
+local function _deflate_key(level, window_bits, mem_level)
+    return string.format("%d:%d:%d", level, window_bits, mem_level)
+end
+
+--- Get a Deflate instance from the pool, or create a new one.
+-- @param level (Number) Compression level.
+-- @param window_bits (Number) Stream format.
+-- @param mem_level (Number) Memory level.
+function zlib.acquire_deflate(level, window_bits, mem_level)
+    level = level or -1
+    window_bits = window_bits or zlib.ZLIB
+    mem_level = mem_level or 8
+    local pool = _deflate_pool[_deflate_key(level, window_bits, mem_level)]
+    if pool and #pool > 0 then
+        local d = pool[#pool]
+        pool[#pool] = nil
+        return d
+    end
+    return zlib.Deflate(level, window_bits, mem_level)
+end
+
+--- Return a Deflate instance to the pool. It must not be used by the caller
+-- afterwards.
+-- @param d (Deflate instance)
+function zlib.release_deflate(d)
+    local key = _deflate_key(d.level, d.window_bits, d.mem_level)
+    local pool = _deflate_pool[key]
+    if not pool then
+        pool = {}
+        _deflate_pool[key] = pool
+    end
+    if #pool < zlib.POOL_MAX then
+        pool[#pool + 1] = d:reset()
+    end
+end
+
+return zlib